@@ -0,0 +1,84 @@
+// sessiond - SSL session cache daemon, file admit.cpp
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+#include "admit.h"
+#include "protocol.h"
+#include <string.h>
+
+ADMISSION::ADMISSION() : buckets(NULL), rate(0), burst(0), pressure(false) {
+}
+
+ADMISSION::~ADMISSION() {
+    delete[] buckets;
+}
+
+// limit every source to r requests per second, 0 for no limit
+void ADMISSION::limit(const unsigned r) {
+    rate=r<1000000 ? r : 1000000;
+    burst=rate*1000;
+    if(rate && !buckets) {
+        buckets=new BUCKET[ADMIT_SETS*ADMIT_WAYS];
+        memset(buckets, 0, ADMIT_SETS*ADMIT_WAYS*sizeof(BUCKET));
+    }
+}
+
+// the bucket of a source, refilled up to now
+BUCKET &ADMISSION::bucket(const uint32_t addr, const uint32_t now) {
+    uint32_t h=addr*0x9e3779b1u; // Fibonacci hashing
+    BUCKET *set=buckets+(h>>22)%ADMIT_SETS*ADMIT_WAYS;
+    BUCKET *b=NULL, *oldest=set;
+    for(unsigned i=0; i<ADMIT_WAYS && !b; ++i) {
+        if(set[i].addr==addr)
+            b=&set[i];
+        else if((int32_t)(set[i].stamp-oldest->stamp)<0 || !set[i].addr)
+            oldest=&set[i];
+    }
+    if(!b) { // a new source starts with a full bucket
+        b=oldest;
+        b->addr=addr;
+        b->tokens=burst;
+        b->stamp=now;
+        return *b;
+    }
+    const uint32_t elapsed=now-b->stamp;
+    if(elapsed) {
+        // no overflow: the refill is capped by a burst in at most a second
+        b->tokens=elapsed<1000 && b->tokens+(int32_t)elapsed*rate<burst ?
+            b->tokens+(int32_t)elapsed*rate : burst;
+        b->stamp=now;
+    }
+    return *b;
+}
+
+// whether to serve a request of the type given from the source addr,
+// now is a millisecond clock
+bool ADMISSION::admit(const uint32_t addr, const int type, const uint32_t now) {
+    if(pressure && type==CACHE_CMD_NEW)
+        return false;
+    if(!rate)
+        return true;
+    BUCKET &b=bucket(addr, now);
+    if(b.tokens<(type==CACHE_CMD_GET ? 1000-burst : 1000))
+        return false;
+    b.tokens-=1000;
+    return true;
+}
+
+// end of admit.cpp
@@ -0,0 +1,69 @@
+// sessiond - SSL session cache daemon, file admit.h
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+#ifndef __ADMIT_H
+#define __ADMIT_H
+
+#include <stdint.h>
+
+#define ADMIT_SETS 1024 // sets of token buckets, a power of 2
+#define ADMIT_WAYS 4 // buckets per set
+
+// the requests a source may still send, refilled as time passes
+typedef struct {
+    uint32_t addr; // IPv4 address of the source, 0 for a free bucket
+    int32_t tokens; // in thousandths of a request
+    uint32_t stamp; // milliseconds, when last refilled
+} BUCKET;
+
+// ADMISSION class - admission control of a single worker
+//
+// Every source address gets a token bucket, refilled at rate requests per
+// second up to a burst of a second's worth.  The buckets are kept in a
+// fixed table of ADMIT_SETS sets of ADMIT_WAYS, a source missing from its
+// set takes the bucket used the longest ago, so a flood of spoofed
+// addresses cannot grow it.  A GET may borrow up to another burst, so a
+// source sending more NEWs than allowed still has its sessions resumed.
+// Under pressure, when the receive queue backs up, NEWs are shed first
+// whatever their source: a session not cached costs a full handshake
+// later, a GET not served costs one now.
+class ADMISSION {
+    BUCKET *buckets;
+    int32_t rate; // thousandths of a request per millisecond, 0 for none
+    int32_t burst; // in thousandths of a request
+    bool pressure;
+
+    BUCKET &bucket(const uint32_t, const uint32_t);
+public:
+    ADMISSION();
+    ~ADMISSION();
+    void limit(const unsigned);
+    void backlog(const bool b) {
+        pressure=b;
+    }
+    bool backlogged() const {
+        return pressure;
+    }
+    bool admit(const uint32_t, const int, const uint32_t);
+};
+
+#endif // __ADMIT_H
+
+// end of admit.h
@@ -0,0 +1,66 @@
+// sessiond - SSL session cache daemon, file arena.cpp
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+#include "arena.h"
+
+ARENA::ARENA() : free_head(ARENA_NONE), top(0), region(NULL) {
+    // the block table never moves, entries may be read concurrently
+    blocks.reserve(1u<<(32-ARENA_BLOCK_BITS));
+}
+
+ARENA::~ARENA() {
+    for(size_t i=0; i<blocks.size(); ++i)
+        if(!region || !region->owns(blocks[i]))
+            delete[] blocks[i];
+}
+
+uint32_t ARENA::alloc() {
+    uint32_t id;
+    if(free_head!=ARENA_NONE) {
+        id=free_head;
+        free_head=(*this)[id].next;
+    } else {
+        if(top==((uint64_t)blocks.size()<<ARENA_BLOCK_BITS)) { // new block
+            if(blocks.size()>=(1u<<(32-ARENA_BLOCK_BITS))-1)
+                return ARENA_NONE;
+            ENTRY *b=region ?
+                (ENTRY *)region->take(sizeof(ENTRY)<<ARENA_BLOCK_BITS) : NULL;
+            blocks.push_back(b ? b : new ENTRY[1u<<ARENA_BLOCK_BITS]);
+        }
+        id=top;
+        (*this)[id].seq=1; // free until written
+        __atomic_store_n(&top, top+1, __ATOMIC_RELEASE);
+    }
+    (*this)[id].flags=ENTRY_USED;
+    return id;
+}
+
+void ARENA::free(const uint32_t id) {
+    ENTRY &e=(*this)[id];
+    e.flags=0;
+    e.next=free_head;
+    free_head=id;
+}
+
+size_t ARENA::memory() const {
+    return blocks.size()*(sizeof(ENTRY)<<ARENA_BLOCK_BITS);
+}
+
+// end of arena.cpp
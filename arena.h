@@ -0,0 +1,73 @@
+// sessiond - SSL session cache daemon, file arena.h
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <time.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "protocol.h" // KEY_LEN
+#include "region.h"
+
+#define ARENA_NONE 0xffffffff
+#define ARENA_BLOCK_BITS 16 // 65536 entries per block
+
+#define ENTRY_USED 0x0001
+#define ENTRY_REFERENCED 0x0002 // found since the CLOCK hand last passed
+
+// a cached session: the key and the value reference kept in SLAB
+typedef struct {
+    unsigned char key[KEY_LEN];
+    time_t t; // expiry time
+    uint32_t val; // SLAB reference
+    uint16_t len; // value length
+    uint16_t flags;
+    uint32_t prev, next; // expiry list links, next is also the free list
+    uint32_t seq; // odd while free or being written, see DATA::read()
+} ENTRY;
+
+// ARENA class - fixed-size session entries with stable 32-bit IDs
+class ARENA {
+    std::vector<ENTRY *> blocks;
+    uint32_t free_head; // released entries
+    uint32_t top; // entries ever handed out
+    REGION *region; // preallocated blocks, or NULL
+public:
+    ARENA();
+    ~ARENA();
+    void place(REGION *r) { // take the blocks from r while it lasts
+        region=r;
+    }
+    uint32_t alloc();
+    void free(const uint32_t);
+    ENTRY &operator[](const uint32_t id) {
+        return blocks[id>>ARENA_BLOCK_BITS][id&((1u<<ARENA_BLOCK_BITS)-1)];
+    }
+    uint32_t end() const { // IDs below this have been handed out
+        return __atomic_load_n(&top, __ATOMIC_ACQUIRE);
+    }
+    size_t memory() const;
+};
+
+#endif // __ARENA_H
+
+// end of arena.h
@@ -0,0 +1,286 @@
+// sessiond - SSL session cache daemon, file batchbench.cpp
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+// Loopback benchmark of the request loop: for every batch size given on
+// the command line a sessiond instance is started with -b, populated with
+// sessions, and then kept busy with a window of outstanding GET requests.
+// With -u the instances serve through their io_uring event loop, and with
+// -o the GETs are packed into version 2 datagrams of that many operations.
+
+#include "protocol.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define KEYS 10000
+#define VAL_LEN 200 // a typical DER encoded session
+#define CHUNK 32 // packets per sendmmsg/recvmmsg call
+
+static const char *sessiond="./sessiond";
+static unsigned short port=54329;
+static unsigned seconds=2, window=64;
+static unsigned ops=1; // GETs per datagram, version 2 if more than one
+static unsigned long long packets=0; // sent and received
+static const char *mode="-f"; // or "-fu" for the io_uring event loop
+static unsigned char keys[KEYS][KEY_LEN];
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static void fill(CACHE_PACKET &p, const unsigned char type, const unsigned k) {
+    p.version=1;
+    p.type=type;
+    p.timeout=htons(3600);
+    memcpy(p.key, keys[k], KEY_LEN);
+}
+
+// wait up to ms milliseconds for a reply
+static bool wait_reply(const int sock, const int ms) {
+    struct pollfd pfd={sock, POLLIN, 0};
+    CACHE_PACKET p;
+    return poll(&pfd, 1, ms)==1 && recv(sock, &p, sizeof p, 0)>0;
+}
+
+// a version 2 datagram of n GETs for random keys, return its length
+static size_t fill_v2(unsigned char *d, const unsigned n) {
+    const CACHE_V2_HEADER h={CACHE_V2_VERSION, (u_char)n, 0};
+    memcpy(d, &h, sizeof h);
+    for(unsigned i=0; i<n; ++i) {
+        CACHE_OP op;
+        memset(&op, 0, sizeof op);
+        op.type=CACHE_CMD_GET;
+        op.id=htonl(i);
+        memcpy(op.key, keys[rand()%KEYS], KEY_LEN);
+        memcpy(d+sizeof h+i*sizeof op, &op, sizeof op);
+    }
+    return sizeof h+n*sizeof(CACHE_OP);
+}
+
+// send n GET requests for random keys
+static void send_gets(const int sock, unsigned n) {
+    static unsigned char datagrams[CHUNK][CACHE_DGRAM_LEN];
+    static unsigned count[CHUNK];
+    static struct iovec iov[CHUNK];
+    static struct mmsghdr msgs[CHUNK];
+    while(n) {
+        unsigned m=0;
+        for(unsigned left=n; m<CHUNK && left; ++m) {
+            count[m]=left<ops ? left : ops;
+            left-=count[m];
+            iov[m].iov_base=datagrams[m];
+            if(ops>1) {
+                iov[m].iov_len=fill_v2(datagrams[m], count[m]);
+            } else {
+                fill(*(CACHE_PACKET *)datagrams[m], CACHE_CMD_GET, rand()%KEYS);
+                iov[m].iov_len=CACHE_HDR_LEN;
+            }
+            memset(&msgs[m], 0, sizeof msgs[m]);
+            msgs[m].msg_hdr.msg_iov=&iov[m];
+            msgs[m].msg_hdr.msg_iovlen=1;
+        }
+        const int r=sendmmsg(sock, msgs, m, 0);
+        if(r<=0)
+            return;
+        packets+=r;
+        for(int i=0; i<r; ++i)
+            n-=count[i];
+    }
+}
+
+// receive whatever replies are queued, return the number of GETs answered
+static unsigned recv_replies(const int sock) {
+    static unsigned char datagrams[CHUNK][CACHE_DGRAM_LEN];
+    static struct iovec iov[CHUNK];
+    static struct mmsghdr msgs[CHUNK];
+    for(unsigned i=0; i<CHUNK; ++i) {
+        iov[i].iov_base=datagrams[i];
+        iov[i].iov_len=CACHE_DGRAM_LEN;
+        memset(&msgs[i], 0, sizeof msgs[i]);
+        msgs[i].msg_hdr.msg_iov=&iov[i];
+        msgs[i].msg_hdr.msg_iovlen=1;
+    }
+    const int r=recvmmsg(sock, msgs, CHUNK, MSG_DONTWAIT, NULL);
+    if(r<=0)
+        return 0;
+    packets+=r;
+    unsigned n=0;
+    for(int i=0; i<r; ++i)
+        n+=datagrams[i][0]==CACHE_V2_VERSION ? datagrams[i][1] : 1;
+    return n;
+}
+
+// the socket of a stopped io_uring server is released asynchronously
+static void wait_port() {
+    const int sock=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family=AF_INET;
+    addr.sin_port=htons(port);
+    addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+    for(int i=0; i<100 && bind(sock, (struct sockaddr *)&addr, sizeof addr)==-1; ++i)
+        usleep(50000);
+    close(sock);
+}
+
+static bool run(const unsigned batch) {
+    char batch_txt[16], port_txt[16];
+    wait_port();
+    snprintf(batch_txt, sizeof batch_txt, "%u", batch);
+    snprintf(port_txt, sizeof port_txt, "%u", port);
+    const pid_t pid=fork();
+    if(pid==-1) {
+        perror("fork");
+        return false;
+    }
+    if(!pid) { // start sessiond in the foreground
+        const int null=open("/dev/null", O_WRONLY);
+        dup2(null, 1);
+        execl(sessiond, sessiond, mode, "-b", batch_txt,
+            "127.0.0.1", port_txt, (char *)NULL);
+        perror(sessiond);
+        _exit(1);
+    }
+
+    const int sock=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family=AF_INET;
+    addr.sin_port=htons(port);
+    addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+    connect(sock, (struct sockaddr *)&addr, sizeof addr);
+
+    CACHE_PACKET p;
+    bool ready=false;
+    for(int i=0; i<100 && !ready; ++i) { // wait for the server to start
+        fill(p, CACHE_CMD_GET, 0);
+        send(sock, &p, CACHE_HDR_LEN, 0);
+        ready=wait_reply(sock, 50);
+        if(!ready) // possibly refused before the server has bound
+            usleep(50000);
+    }
+    if(!ready) {
+        fprintf(stderr, "sessiond did not start\n");
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        close(sock);
+        return false;
+    }
+
+    // populate, synchronizing every CHUNK packets to avoid overruns
+    memset(p.val, 0x30, VAL_LEN);
+    for(unsigned k=0; k<KEYS; ++k) {
+        fill(p, CACHE_CMD_NEW, k);
+        send(sock, &p, CACHE_HDR_LEN+VAL_LEN, 0);
+        if(k%CHUNK==CHUNK-1) {
+            fill(p, CACHE_CMD_GET, k);
+            send(sock, &p, CACHE_HDR_LEN, 0);
+            wait_reply(sock, 100);
+        }
+    }
+
+    // keep a window of GET requests outstanding
+    unsigned long long done=0, lost=0;
+    unsigned outstanding=0;
+    packets=0;
+    const double start=now(), end=start+seconds;
+    while(now()<end) {
+        if(outstanding<window) {
+            send_gets(sock, window-outstanding);
+            outstanding=window;
+        }
+        struct pollfd pfd={sock, POLLIN, 0};
+        if(poll(&pfd, 1, 100)!=1) { // assume the rest of the window is lost
+            lost+=outstanding;
+            outstanding=0;
+            continue;
+        }
+        const unsigned r=recv_replies(sock);
+        outstanding-=r<outstanding ? r : outstanding;
+        done+=r;
+    }
+    const double elapsed=now()-start;
+    printf("batch %4u: %10.0f transactions/s, %10.0f packets/s, %llu lost\n",
+        batch, done/elapsed, packets/elapsed, lost);
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    close(sock);
+    return true;
+}
+
+static void usage(const char *bin_path) {
+    fprintf(stderr, "Usage: %s [-u] [-o ops] [-s sessiond] [-p port] [-t seconds] [-w window] batch...\n", bin_path);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while((opt=getopt(argc, argv, "uo:s:p:t:w:"))!=-1) {
+        switch(opt) {
+        case 'u':
+            mode="-fu";
+            break;
+        case 'o':
+            ops=atoi(optarg);
+            break;
+        case 's':
+            sessiond=optarg;
+            break;
+        case 'p':
+            port=atoi(optarg);
+            break;
+        case 't':
+            seconds=atoi(optarg);
+            break;
+        case 'w':
+            window=atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if(optind==argc || !port || !seconds || !window || !ops ||
+            ops>(CACHE_DGRAM_LEN-sizeof(CACHE_V2_HEADER))/sizeof(CACHE_OP)) {
+        usage(argv[0]);
+        return 1;
+    }
+    srand(time(NULL));
+    for(unsigned k=0; k<KEYS; ++k)
+        for(unsigned i=0; i<KEY_LEN; ++i)
+            keys[k][i]=rand();
+    for(int i=optind; i<argc; ++i)
+        if(!run(atoi(argv[i])))
+            return 1;
+    return 0;
+}
+
+// end of batchbench.cpp
@@ -1,113 +1,152 @@
-/* UDP client in the internet domain */
+// sessiond - SSL session cache daemon, file client.cpp
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
 
+// Command line client built on libsessiond, e.g.
+//   client -s host:port -s host:port new key value
+//   client -s host:port -s host:port get key...
+//   client -s host:port stats
+//   client -s localhost:port busiest
+//   client -s localhost:port limit sessions
+//   client -l name -s host:port get key...
+// All the GETs are sent at once and reported as their replies arrive.
+
+#include "libsessiond.h"
 #include <stdio.h>
+#include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <string.h>
-#include "sockets.h"
-
-#define CACHE_CMD_NEW     0x00
-#define CACHE_CMD_GET     0x01
-#define CACHE_CMD_REMOVE  0x02
-#define CACHE_RESP_ERR    0x80
-#define CACHE_RESP_OK     0x81
-
-#define KEY_LEN 32
-#define MAX_VAL_LEN 512
-typedef struct {
-  u_char version, type;
-  u_short timeout;
-  u_char key[KEY_LEN];
-  u_char val[MAX_VAL_LEN];
-} CACHE_PACKET;
-
-void error(const char *);
-int main(int argc, char *argv[])
-{
-  int sock, n;
-  socklen_t server_addrlen, from_addrlen;
-  struct sockaddr_in server, from;
-  struct hostent *hp;
-  unsigned short port;
-  char buffer[256];
-
-  if (argc != 4) {
-    printf("Usage: server port <'new'|'get'|'remove'>\n");
-    exit(1);
-  }
-  sock= socket(AF_INET, SOCK_DGRAM, 0);
-  if (sock < 0) error("socket");
-
-  server.sin_family = AF_INET;
-  hp = gethostbyname(argv[1]);
-  if (hp==0) error("Unknown host");
+#include <poll.h>
 
-  port = atoi(argv[2]);
-  if ( port < 0 || port > 65535 )
-  {
-    perror("port range error");
-  }
+#define SESSION_TIMEOUT 500 // seconds
 
-  bcopy((char *)hp->h_addr, (char *)&server.sin_addr, hp->h_length);
-  server.sin_port = htons(port);
-  server_addrlen=sizeof(server);
-
-  CACHE_PACKET packet;
-  packet.version = 1;
-  int packet_len = sizeof(packet);
-  if ( strncmp(argv[3], "new", 4) == 0 )
-  {
-    packet.type = CACHE_CMD_NEW;
-    packet.timeout = 500; // seconds
-    strncpy((char*)packet.key, "testkey", KEY_LEN);
-    strncpy((char*)packet.val, "testvalue", MAX_VAL_LEN);
-  }
-  else if ( strncmp(argv[3], "get", 4) == 0 )
-  {
-    packet.type = CACHE_CMD_GET;
-    packet.timeout = 0;
-    strncpy((char*)packet.key, "testkey", KEY_LEN);
-    memset(&packet.val, 0, MAX_VAL_LEN);
-  }
-  else if ( strncmp(argv[3], "remove", 7) == 0 )
-  {
-    packet.type = CACHE_CMD_REMOVE;
-    packet.timeout = 0;
-    strncpy((char*)packet.key, "testkey", KEY_LEN);
-    memset(&packet.val, 0, MAX_VAL_LEN);
-  }
-  else { error("Unimplemented"); }
-
-  // now we want to send our packet
-  n=sendto(sock, (char *)&packet, packet_len, 0, (const struct sockaddr *)&server, server_addrlen);
-  if (n < 0) error("Sendto");
-  printf("Sent %d bytes.\n", n);
+static void usage(const char *bin_path) {
+    fprintf(stderr, "Usage: %s [-t ms] [-l name] -s host:port... <new key value|get key...|remove key|stats|busiest|limit n>\n", bin_path);
+    fprintf(stderr, "  -s host:port  sessiond server, repeated for each of them\n");
+    fprintf(stderr, "  -t ms         timeout of a GET (default %d)\n", CLIENT_TIMEOUT);
+    fprintf(stderr, "  -l name       look GETs up in the shared memory of a local sessiond -s name\n");
+}
 
-  // we will only get something back if we asked for a 'get'
-  if ( packet.type  == CACHE_CMD_GET )
-  {
-    printf("Waiting for GET packet response\n");
-    printf("recvfrom(key:%s, val:%s, type:%d, maxlen:%d)\n", packet.key, packet.val, packet.type, packet_len);
-    memset(&from, 0, sizeof(from));
-    from_addrlen = sizeof(from);
-    n = recvfrom(sock, (char *)&packet, packet_len, 0, (struct sockaddr *)&from, &from_addrlen);
-    printf("Recieved %d bytes\n", n);
-    if (n < 0) error("recvfrom");
+static void print_result(void *arg, const int result, const unsigned char *val,
+        const unsigned len) {
+    const char *key=(const char *)arg;
+    if(result==CLIENT_HIT)
+        printf("%s: '%.*s'\n", key, (int)len, val);
+    else
+        printf("%s: %s\n", key, result==CLIENT_MISS ? "miss" : "timed out");
+}
 
-    if ( n >= (packet_len-MAX_VAL_LEN) )
-    {
-      printf("Packet contents:\n");
-      printf("packet.type: %s\n", packet.type == CACHE_RESP_ERR ? "error" : packet.type == CACHE_RESP_OK ? "ok" : "unknown" );
-      printf("packet.key: '%s'\n", packet.key);
-      printf("packet.val: '%s'\n", packet.val);
+int main(int argc, char *argv[]) {
+    const char *servers[CLIENT_MAX_SERVERS];
+    unsigned nservers=0, timeout=CLIENT_TIMEOUT;
+    const char *local=NULL;
+    int opt;
+    while((opt=getopt(argc, argv, "s:t:l:"))!=-1) {
+        switch(opt) {
+        case 's':
+            if(nservers==CLIENT_MAX_SERVERS) {
+                fprintf(stderr, "too many servers.\n");
+                return 1;
+            }
+            servers[nservers++]=optarg;
+            break;
+        case 't':
+            timeout=atoi(optarg);
+            break;
+        case 'l':
+            local=optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if(!nservers || argc-optind<1) {
+        usage(argv[0]);
+        return 1;
+    }
+    CLIENT client(timeout);
+    for(unsigned i=0; i<nservers; ++i) {
+        char host[256];
+        const char *colon=strrchr(servers[i], ':');
+        if(!colon || !atoi(colon+1)) {
+            fprintf(stderr, "illegal server %s.\n", servers[i]);
+            return 1;
+        }
+        snprintf(host, sizeof host, "%.*s", (int)(colon-servers[i]), servers[i]);
+        if(!client.add_server(host, atoi(colon+1))) {
+            fprintf(stderr, "unknown host %s.\n", host);
+            return 1;
+        }
+    }
+    if(local && !client.attach(local))
+        perror(local); // the GETs are sent to the servers
+    const char *cmd=argv[optind];
+    const unsigned char *key=(const unsigned char *)argv[optind+1];
+    const bool busiest=!strcmp(cmd, "busiest");
+    if((busiest || !strcmp(cmd, "stats")) && argc-optind==1) {
+        for(unsigned i=0; i<nservers; ++i) {
+            static char txt[CACHE_STATS_LEN+1];
+            if((busiest ? client.busiest(i, txt, sizeof txt) :
+                    client.stats(i, txt, sizeof txt))<0) {
+                fprintf(stderr, "%s: no %s\n", servers[i],
+                    busiest ? "busiest requesters" : "statistics");
+                return 1;
+            }
+            if(nservers>1)
+                printf("# %s\n", servers[i]);
+            fputs(txt, stdout);
+        }
+    } else if(!strcmp(cmd, "limit") && argc-optind==2) {
+        const unsigned n=strtoul(argv[optind+1], NULL, 10);
+        for(unsigned i=0; i<nservers; ++i)
+            if(client.limit(i, n)) {
+                fprintf(stderr, "%s: limit refused\n", servers[i]);
+                return 1;
+            }
+    } else if(!strcmp(cmd, "new") && argc-optind==3) {
+        const char *val=argv[optind+2];
+        if(!client.store(key, strlen(argv[optind+1]),
+                (const unsigned char *)val, strlen(val), SESSION_TIMEOUT)) {
+            perror("new");
+            return 1;
+        }
+    } else if(!strcmp(cmd, "remove") && argc-optind==2) {
+        if(!client.remove(key, strlen(argv[optind+1]))) {
+            perror("remove");
+            return 1;
+        }
+    } else if(!strcmp(cmd, "get")) {
+        for(int i=optind+1; i<argc; ++i)
+            if(!client.get((const unsigned char *)argv[i], strlen(argv[i]),
+                    print_result, argv[i]))
+                printf("%s: not sent\n", argv[i]);
+        while(client.inflight()) {
+            struct pollfd pfd={client.fd(), POLLIN, 0};
+            poll(&pfd, 1, client.next_timeout());
+            client.process();
+        }
+    } else {
+        usage(argv[0]);
+        return 1;
     }
-  }
-  close(sock);
-  return 0;
+    return 0;
 }
 
-void error(const char *msg)
-{
-  perror(msg);
-  exit(0);
-}
\ No newline at end of file
+// end of client.cpp
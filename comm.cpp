@@ -18,55 +18,357 @@
 // a combined work based on sessiond. Thus, the terms and conditions of
 // the GNU General Public License cover the whole combination.
 
+#include "admit.h"
 #include "data.h"
 #include "log.h"
+#include "mirror.h"
+#include "protocol.h"
+#include "replica.h"
+#include "sketch.h"
+#include "snapshot.h"
+#include "tier.h"
+#include "trace.h"
+#include "uring.h"
 #include <stdio.h>
+#include <stdarg.h>
+#include <limits.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <algorithm>
 #ifdef __WIN32__
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #else
 #include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #endif
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <linux/sock_diag.h>
+#endif
 
 #ifdef __WIN32__
 static const char *winsock_error(); // defined in comm.cpp
 #endif
 
-static void mem2bytes(BYTES &dst, const unsigned char *src, const unsigned l);
-static void bytes2mem(unsigned char *dst, const BYTES &src);
-static void stats(LOG &);
+#define RING_SIZE 128 // requests queued from one worker to another
+#define MAX_PEERS 16 // instances replicated to
+#define ADMIT_PROBE 64 // requests served between checks of the receive queue
+#define LATENCY_BUCKETS 14 // service time histogram, the last one is +Inf
+#define SAMPLE_MISS CACHE_CMD_STATS // sketches of the GETs that missed
+#define SAMPLE_KINDS (SAMPLE_MISS+1) // and of each request type
+#define SKETCH_HALF 60 // seconds after which the busy counts are halved
+#define BUSIEST_SHOWN 10 // sources and session IDs reported of each kind
+
+#ifndef MSG_DONTWAIT
+#define MSG_DONTWAIT 0
+#endif
+
+// a receive buffer, large enough for any version of the protocol
+typedef union {
+    CACHE_PACKET packet;
+    unsigned char data[CACHE_DGRAM_LEN];
+} DATAGRAM;
+
+// upper bounds of the service time histogram buckets in nanoseconds
+static const unsigned long long latency_bounds[LATENCY_BUCKETS-1]={
+    1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000,
+    1000000, 2000000, 5000000, 10000000};
+
+// why a GET found no session, see GHOST
+static const char *const reasons[GHOST_REASONS]={
+    "unknown", "expired", "evicted", "removed"};
 
-#define CACHE_CMD_NEW     0x00
-#define CACHE_CMD_GET     0x01
-#define CACHE_CMD_REMOVE  0x02
-#define CACHE_RESP_ERR    0x80
-#define CACHE_RESP_OK     0x81
+// the requests sketched, by request type and then misses
+static const char *const kinds[SAMPLE_KINDS]={"new", "get", "remove", "miss"};
 
-#define KEY_LEN 32
-#define MAX_VAL_LEN 512
+// a request handed over to the worker owning its key
 typedef struct {
-    u_char version, type;
-    u_short timeout;
-    u_char key[KEY_LEN];
-    u_char val[MAX_VAL_LEN];
-} CACHE_PACKET;
-static DATA data;
-static unsigned long long delta_hits=0, delta_misses=0, delta_trans=0;
-
-void process_request(const int s, const unsigned short port, const unsigned long listen_address, LOG &log) {
     CACHE_PACKET packet;
+    ssize_t len;
+    struct sockaddr_in addr;
+    socklen_t addrlen;
+    bool v2; // an operation of a version 2 datagram
+    u_int id; // and its request ID
+    bool replicated; // an operation received from a peer, applied as is
+} REQUEST;
+
+// single producer, single consumer queue of requests
+typedef struct {
+    unsigned head; // advanced by the consumer
+    char pad[64-sizeof(unsigned)]; // keep head and tail in separate lines
+    unsigned tail; // advanced by the producer
+    REQUEST requests[RING_SIZE];
+} RING;
+
+// a serving thread: its socket, its shard of the cache and its counters
+class WORKER {
+public:
+    DATA data;
+    unsigned id;
+    int s;
+    int wake; // eventfd signalled when requests are queued for a sleeper
+    int sleeping;
+    RING *inbound; // one ring per sending worker
+    TIER *tier; // sessions evicted from data, NULL for none
+    REPLICA replica; // operations sent to and received from peers
+    ADMISSION admission; // requests shed under overload
+    unsigned probe; // requests until the receive queue is checked again
+    // batch buffers
+    DATAGRAM *packets;
+    struct sockaddr_in *addrs;
+    struct iovec *iov, *reply_iov; // a reply is its header and its value
+    struct mmsghdr *msgs, *replies;
+    // replies to a version 2 datagram
+    unsigned char reply[CACHE_DGRAM_LEN];
+    size_t reply_len;
+    unsigned reply_count;
+    unsigned char scratch[MAX_VAL_LEN]; // a value read from another shard
+#ifdef HAVE_URING
+    // io_uring event loop
+    URING *uring;
+    unsigned char *bufs; // provided receive buffers
+    struct msghdr recv_msg; // layout of received buffers
+    struct msghdr *send_msgs; // replies, one per buffer
+    struct iovec *send_iov; // their headers and values
+    unsigned short *sending; // buffers of the replies not yet submitted
+    unsigned nsending;
+#endif
+    // when serving the current datagram began, and its requests by type
+    unsigned long long received;
+    unsigned batch_ops[CACHE_CMD_STATS];
+    // statistics, written by this worker only
+    unsigned long long hits, misses, trans, forwarded, dropped;
+    unsigned long long entries, memory, overhead, evicted, expired;
+    unsigned long long tier_sessions, tier_bytes, demoted, promoted;
+    unsigned long long tier_dropped, skipped;
+    unsigned long long replicated, applied, malformed;
+    unsigned long long shed[CACHE_CMD_STATS];
+    unsigned long long missed[GHOST_REASONS]; // misses by why, see GHOST
+    unsigned long long larger[GHOST_LARGER]; // misses a larger cache finds
+    // service time histograms and sums by request type
+    unsigned long long latency[CACHE_CMD_STATS][LATENCY_BUCKETS];
+    unsigned long long latency_ns[CACHE_CMD_STATS];
+    // requests captured, not written to the trace yet
+    unsigned char *trace_buf;
+    size_t trace_len;
+    unsigned long long traced;
+    char report[CACHE_STATS_LEN]; // the reply to CACHE_CMD_STATS
+    size_t report_len; // 0 until built for the replies not yet sent
+    // the busiest sources and session IDs of each kind of request
+    SKETCH sources[SAMPLE_KINDS], keys[SAMPLE_KINDS];
+    time_t sketched, halved; // when they were last published and decayed
+    char busiest[CACHE_STATS_LEN]; // the reply to CACHE_CMD_BUSIEST
+    size_t busiest_len; // 0 until built for the replies not yet sent
+
+    WORKER(const size_t capacity, const size_t budget) :
+        data(capacity, budget), id(0), s(-1), wake(-1),
+        sleeping(0), inbound(NULL), tier(NULL), probe(1), packets(NULL), reply_len(0), reply_count(0),
+#ifdef HAVE_URING
+        uring(NULL), bufs(NULL), send_msgs(NULL), send_iov(NULL),
+        sending(NULL), nsending(0),
+#endif
+        received(0), hits(0), misses(0), trans(0), forwarded(0), dropped(0),
+        entries(0), memory(0), overhead(0), evicted(0), expired(0),
+        tier_sessions(0), tier_bytes(0), demoted(0), promoted(0),
+        tier_dropped(0), skipped(0), replicated(0), applied(0), malformed(0),
+        trace_buf(NULL), trace_len(0), traced(0), report_len(0),
+        sketched(0), halved(time(NULL)), busiest_len(0) {
+        memset(batch_ops, 0, sizeof batch_ops);
+        memset(shed, 0, sizeof shed);
+        memset(missed, 0, sizeof missed);
+        memset(larger, 0, sizeof larger);
+        memset(latency, 0, sizeof latency);
+        memset(latency_ns, 0, sizeof latency_ns);
+    }
+};
+
+static ssize_t serve(WORKER &, CACHE_PACKET &, ssize_t, const struct sockaddr *,
+    const unsigned short, const unsigned long, LOG &, const unsigned char *&);
+static ssize_t send_reply(const int, CACHE_PACKET &, const ssize_t,
+    const unsigned char *, const struct sockaddr *, const socklen_t);
+static void publish(WORKER &);
+static void flush(WORKER &);
+static time_t coarse_time();
+static unsigned long long monotonic_ns();
+static void account(WORKER &);
+static void replied(WORKER &);
+static size_t report(char *, const size_t);
+static size_t busiest(char *, const size_t);
+static void stats(LOG &);
+#ifndef __WIN32__
+static void checkpoint(LOG &);
+#endif
+static void apply(WORKER &, const CACHE_PACKET &, const ssize_t);
+
+static WORKER **workers=NULL;
+static unsigned nworkers=0;
+static TRACE *trace=NULL; // capture of the requests served
+static MIRROR *mirror=NULL; // sessions published to local clients
+static bool tiered=false; // GETs may need the disk tier of their owner
+static struct sockaddr_in peers[MAX_PEERS];
+static unsigned npeers=0;
+
+// the worker owning a key, the same function is run by the kernel
+// to steer packets between SO_REUSEPORT sockets (see sessiond.cpp)
+static inline unsigned shard(const unsigned char *k) {
+    return ((unsigned)k[0]<<24|(unsigned)k[1]<<16|(unsigned)k[2]<<8|k[3])%nworkers;
+}
+
+// capacity is the number of sessions of the whole cache, and budget
+// its memory limit in bytes, 0 for none
+void init_workers(const int *sockets, const unsigned n, const unsigned batch,
+        const size_t capacity, const size_t budget) {
+    nworkers=n;
+    workers=new WORKER *[n];
+    for(unsigned w=0; w<n; ++w) {
+        WORKER &wk=*(workers[w]=new WORKER(capacity/n, budget/n));
+        wk.id=w;
+        wk.s=sockets[w];
+#ifdef __linux__
+        if(n>1) {
+            wk.wake=eventfd(0, EFD_NONBLOCK);
+            wk.inbound=new RING[n];
+            for(unsigned i=0; i<n; ++i)
+                wk.inbound[i].head=wk.inbound[i].tail=0;
+        }
+        wk.packets=new DATAGRAM[batch];
+        wk.addrs=new struct sockaddr_in[batch];
+        wk.iov=new struct iovec[batch];
+        wk.reply_iov=new struct iovec[2*batch];
+        wk.msgs=new struct mmsghdr[batch];
+        wk.replies=new struct mmsghdr[batch];
+        memset(wk.msgs, 0, batch*sizeof(struct mmsghdr));
+        memset(wk.replies, 0, batch*sizeof(struct mmsghdr));
+#endif
+    }
+}
+
+// capture the requests served to a trace file (see TRACE)
+bool init_trace(const char *path) {
+    trace=new TRACE;
+    if(!trace->create(path, monotonic_ns())) {
+        delete trace;
+        trace=NULL;
+        return false;
+    }
+    for(unsigned w=0; w<nworkers; ++w)
+        workers[w]->trace_buf=new unsigned char[TRACE_BUFFER*TRACE_RECORD_LEN];
+    return true;
+}
+
+// start writing the trace from a thread of its own, once daemonised
+void start_trace() {
+    if(trace)
+        trace->launch();
+}
+
+// publish the sessions in a shared memory segment of about bytes,
+// for clients on the same host to look up (see MIRROR)
+bool init_mirror(const char *name, const size_t bytes) {
+    mirror=new MIRROR;
+    if(!mirror->create(name, bytes)) {
+        delete mirror;
+        mirror=NULL;
+        return false;
+    }
+    return true;
+}
+
+// demote the sessions evicted from memory to files on disk of about
+// bytes in all, one for each shard at path.<worker> (see TIER); GETs
+// are then served by the workers owning their keys
+bool init_tier(const char *path, const size_t bytes) {
+    for(unsigned w=0; w<nworkers; ++w) {
+        WORKER &wk=*workers[w];
+        char name[PATH_MAX];
+        snprintf(name, sizeof name, "%s.%u", path, w);
+        wk.tier=new TIER;
+        if(!wk.tier->create(name, bytes/nworkers))
+            return false;
+        wk.data.overflow(wk.tier);
+    }
+    tiered=true;
+    return true;
+}
+
+// reserve the memory of every shard up front (see REGION), called once
+// the process has daemonised, as locked memory is not inherited by fork()
+bool preallocate(const unsigned flags, LOG &log) {
+    unsigned long long bytes=0;
+    bool hugetlb=true;
+    for(unsigned w=0; w<nworkers; ++w) {
+        bool h;
+        if(!workers[w]->data.preallocate(flags)) {
+            log.err(LOG_ERR, "Cannot preallocate the cache memory");
+            return false;
+        }
+        bytes+=workers[w]->data.reserved(h);
+        hugetlb=hugetlb && h;
+        publish(*workers[w]);
+    }
+    log.msg(LOG_NOTICE, "Reserved %lluMB for %llu sessions in %s pages%s",
+        bytes>>20, (unsigned long long)workers[0]->data.limit()*nworkers,
+        hugetlb ? "huge" : "transparent huge",
+        flags&REGION_LOCK ? ", prefaulted and locked" : "");
+    return true;
+}
+
+// replicate the NEW and REMOVE operations served to the peers given,
+// called after init_workers()
+void init_replication(const struct sockaddr_in *p, const unsigned n) {
+    uint32_t node=0; // tells our own datagrams apart
+    FILE *f=fopen("/dev/urandom", "rb");
+    if(f) {
+        if(fread(&node, sizeof node, 1, f)!=1)
+            node=0;
+        fclose(f);
+    }
+    if(!node)
+        node=((uint32_t)time(NULL)^(uint32_t)getpid()<<16)|1;
+    for(npeers=0; npeers<n && npeers<MAX_PEERS; ++npeers)
+        peers[npeers]=p[npeers];
+    for(unsigned w=0; w<nworkers; ++w)
+        workers[w]->replica.origin(node, w);
+}
+
+// limit every source address to rate requests per second, 0 for none;
+// its requests are spread over the workers, so is the rate
+void init_admission(const unsigned rate) {
+    for(unsigned w=0; w<nworkers; ++w)
+        workers[w]->admission.limit(rate ? (rate+nworkers-1)/nworkers : 0);
+}
+
+void process_request(const unsigned w, const unsigned short port, const unsigned long listen_address, LOG &log) {
+    WORKER &wk=*workers[w];
+    DATAGRAM d;
+    CACHE_PACKET &packet=d.packet;
     struct sockaddr addr;
     socklen_t addrlen=sizeof addr;
-    //log.msg(LOG_DEBUG, "waiting for packet");
-    ssize_t len=recvfrom(s, (char *)&packet, sizeof packet, 0, &addr, &addrlen);
+    ssize_t len=-1;
+#ifndef __WIN32__
+    // replication is batched while requests keep coming, and flushed
+    // before waiting for the next one
+    if(wk.replica.pending())
+        len=recvfrom(wk.s, (char *)&d, sizeof d, MSG_DONTWAIT, &addr, &addrlen);
+#endif
+    if(len==-1) {
+        flush(wk);
+        //log.msg(LOG_DEBUG, "waiting for packet");
+        len=recvfrom(wk.s, (char *)&d, sizeof d, 0, &addr, &addrlen);
+    }
     //log.msg(LOG_DEBUG, "Recieved packet");
     if(len==-1) {
+#ifndef __WIN32__
+        if(errno==EINTR) // possibly asked to stop
+            return;
+#endif
         log.err(LOG_ERR, "recvfrom");
 #ifdef __WIN32__
         Sleep(1000); // limit the error rate
@@ -75,78 +377,1195 @@ void process_request(const int s, const unsigned short port, const unsigned long
 #endif
         return;
     }
-    const sockaddr_in *in_addr=(sockaddr_in *)&addr;
+    wk.received=monotonic_ns();
+    wk.data.tick(coarse_time()); // expire a bounded number of sessions
+    const unsigned char *val;
+    len=serve(wk, packet, len, &addr, port, listen_address, log, val);
+    account(wk);
+    if(len>0 && send_reply(wk.s, packet, len, val, &addr, addrlen)==-1)
+        log.err(LOG_ERR, "Sendto failed to send packet to %s", inet_ntoa(((sockaddr_in *)&addr)->sin_addr));
+    //else
+        //log.msg(LOG_DEBUG, "Sent packet");
+    replied(wk);
+    wk.data.reclaim();
+    publish(wk);
+}
+
+#ifdef __linux__
+
+// rebuild a forwarded version 2 operation as a datagram with just that
+// operation, return its length
+static size_t v2_datagram(unsigned char *d, const REQUEST &q) {
+    const CACHE_V2_HEADER h={CACHE_V2_VERSION, 1, 0};
+    CACHE_OP op;
+    memset(&op, 0, sizeof op);
+    op.type=q.packet.type;
+    op.len=htons(q.len-CACHE_HDR_LEN);
+    op.id=q.id;
+    op.timeout=q.packet.timeout;
+    memcpy(op.key, q.packet.key, KEY_LEN);
+    memcpy(d, &h, sizeof h);
+    memcpy(d+sizeof h, &op, sizeof op);
+    memcpy(d+sizeof h+sizeof op, q.packet.val, q.len-CACHE_HDR_LEN);
+    return sizeof h+sizeof op+q.len-CACHE_HDR_LEN;
+}
+
+// move requests queued by other workers into the batch buffers, apply
+// the operations received from peers
+static unsigned take_forwarded(WORKER &wk, const unsigned batch) {
+    unsigned n=0;
+    for(unsigned i=0; i<nworkers && n<batch; ++i) {
+        RING &r=wk.inbound[i];
+        const unsigned tail=__atomic_load_n(&r.tail, __ATOMIC_ACQUIRE);
+        unsigned head=r.head;
+        for(; head!=tail && n<batch; ++head) {
+            REQUEST &q=r.requests[head%RING_SIZE];
+            if(q.replicated) { // there is no reply
+                apply(wk, q.packet, q.len);
+                continue;
+            }
+            if(q.v2) { // a datagram of its own
+                wk.msgs[n].msg_len=v2_datagram(wk.packets[n].data, q);
+            } else {
+                memcpy(&wk.packets[n].packet, &q.packet, q.len);
+                wk.msgs[n].msg_len=q.len;
+            }
+            wk.addrs[n]=q.addr;
+            wk.msgs[n++].msg_hdr.msg_namelen=q.addrlen;
+        }
+        __atomic_store_n(&r.head, head, __ATOMIC_RELEASE);
+    }
+    return n;
+}
+
+// queue a request for the worker owning its key
+static void forward(WORKER &wk, const unsigned w, const unsigned owner,
+        const CACHE_PACKET &packet, const ssize_t len,
+        const struct sockaddr_in &addr, const socklen_t addrlen,
+        const bool v2=false, const u_int id=0, const bool replicated=false) {
+    WORKER &dst=*workers[owner];
+    RING &r=dst.inbound[w];
+    const unsigned head=__atomic_load_n(&r.head, __ATOMIC_ACQUIRE);
+    if(r.tail-head>=RING_SIZE) { // the owner is overloaded
+        ++wk.dropped;
+        return;
+    }
+    REQUEST &q=r.requests[r.tail%RING_SIZE];
+    q.len=len<(ssize_t)sizeof q.packet ? len : sizeof q.packet;
+    memcpy(&q.packet, &packet, q.len);
+    q.addr=addr;
+    q.addrlen=addrlen;
+    q.v2=v2;
+    q.id=id;
+    q.replicated=replicated;
+    __atomic_store_n(&r.tail, r.tail+1, __ATOMIC_SEQ_CST);
+    ++wk.forwarded;
+    if(__atomic_load_n(&dst.sleeping, __ATOMIC_SEQ_CST)) {
+        const uint64_t one=1;
+        if(write(dst.wake, &one, sizeof one)==-1) {
+            // the counter is already signalled
+        }
+    }
+}
+
+// block until a packet arrives or another worker queues a request
+static void idle(WORKER &wk) {
+    __atomic_store_n(&wk.sleeping, 1, __ATOMIC_SEQ_CST);
+    for(unsigned i=0; i<nworkers; ++i) // recheck to avoid a lost wakeup
+        if(__atomic_load_n(&wk.inbound[i].tail, __ATOMIC_SEQ_CST)!=
+                wk.inbound[i].head) {
+            __atomic_store_n(&wk.sleeping, 0, __ATOMIC_SEQ_CST);
+            return;
+        }
+    struct pollfd fds[2]={{wk.s, POLLIN, 0}, {wk.wake, POLLIN, 0}};
+    poll(fds, 2, -1);
+    __atomic_store_n(&wk.sleeping, 0, __ATOMIC_SEQ_CST);
+    uint64_t v;
+    if(fds[1].revents&POLLIN && read(wk.wake, &v, sizeof v)==-1) {
+        // nothing to reset
+    }
+}
+
+// receive up to batch requests with a single system call, serve them,
+// and send all the replies back with another one
+void process_batch(const unsigned w, const unsigned short port, const unsigned long listen_address, const unsigned batch, LOG &log) {
+    WORKER &wk=*workers[w];
+    for(unsigned i=0; i<batch; ++i) {
+        wk.iov[i].iov_base=&wk.packets[i];
+        wk.iov[i].iov_len=sizeof(DATAGRAM);
+        wk.msgs[i].msg_hdr.msg_name=&wk.addrs[i];
+        wk.msgs[i].msg_hdr.msg_namelen=sizeof(struct sockaddr_in);
+        wk.msgs[i].msg_hdr.msg_iov=&wk.iov[i];
+        wk.msgs[i].msg_hdr.msg_iovlen=1;
+    }
+    // requests forwarded by other workers come first
+    const unsigned f=nworkers>1 ? take_forwarded(wk, batch) : 0;
+    int n=0;
+    if(f<batch) {
+        // a single worker blocks for the first packet only, then takes
+        // whatever is queued; with several workers the sockets are
+        // non-blocking and idle() waits for either source of work
+        n=recvmmsg(wk.s, wk.msgs+f, batch-f,
+            nworkers>1 ? MSG_DONTWAIT : MSG_WAITFORONE, NULL);
+        if(n==-1) {
+            n=0;
+            if(errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=EINTR) {
+                log.err(LOG_ERR, "recvmmsg");
+                sleep(1); // limit the error rate
+                return;
+            }
+        }
+    }
+    if(f+n==0) {
+        if(nworkers>1) {
+            idle(wk);
+            wk.data.tick(coarse_time()); // woken up, maybe by set_limit()
+            publish(wk);
+        }
+        return;
+    }
+    wk.data.tick(coarse_time()); // expire a bounded number of sessions
+
+    unsigned r=0;
+    for(unsigned i=0; i<f+n; ++i) {
+        // control requests are answered by the worker receiving them
+        if(i>=f && nworkers>1 && wk.msgs[i].msg_len>=CACHE_HDR_LEN &&
+                wk.packets[i].packet.version==1 &&
+                wk.packets[i].packet.type<CACHE_CMD_STATS &&
+                (wk.packets[i].packet.type!=CACHE_CMD_GET || tiered)) {
+            const unsigned owner=shard(wk.packets[i].packet.key);
+            if(owner!=w) { // not steered by the kernel
+                forward(wk, w, owner, wk.packets[i].packet, wk.msgs[i].msg_len,
+                    wk.addrs[i], wk.msgs[i].msg_hdr.msg_namelen);
+                continue;
+            }
+        }
+        const unsigned char *val;
+        wk.received=monotonic_ns();
+        const ssize_t len=serve(wk, wk.packets[i].packet, wk.msgs[i].msg_len,
+            (struct sockaddr *)&wk.addrs[i], port, listen_address, log, val);
+        account(wk);
+        if(len<=0)
+            continue;
+        struct iovec *iov=&wk.reply_iov[2*r];
+        iov[0].iov_base=&wk.packets[i];
+        iov[0].iov_len=CACHE_HDR_LEN;
+        iov[1].iov_base=(void *)val;
+        iov[1].iov_len=len-CACHE_HDR_LEN;
+        wk.replies[r].msg_hdr.msg_name=&wk.addrs[i];
+        wk.replies[r].msg_hdr.msg_namelen=wk.msgs[i].msg_hdr.msg_namelen;
+        wk.replies[r].msg_hdr.msg_iov=iov;
+        wk.replies[r].msg_hdr.msg_iovlen=len>(ssize_t)CACHE_HDR_LEN ? 2 : 1;
+        ++r;
+    }
+    for(unsigned sent=0; sent<r; ) {
+        const int m=sendmmsg(wk.s, wk.replies+sent, r-sent, 0);
+        if(m==-1) { // skip the reply that failed
+            if(errno!=EAGAIN && errno!=EWOULDBLOCK)
+                log.err(LOG_ERR, "Sendto failed to send packet to %s",
+                    inet_ntoa(((sockaddr_in *)wk.replies[sent].msg_hdr.msg_name)->sin_addr));
+            ++sent;
+        } else {
+            sent+=m;
+        }
+    }
+    replied(wk);
+    wk.data.reclaim(); // the values have been sent
+    flush(wk);
+    publish(wk);
+}
+
+#ifdef HAVE_URING
+
+#define URING_ENTRIES 1024 // submission queue entries
+#define URING_BUFFERS 1024 // receive buffers per worker, a power of 2
+#define URING_BUF_SIZE 2048 // io_uring_recvmsg_out, address and datagram
+
+// completion types kept in the upper half of user_data
+#define URING_RECV 1
+#define URING_SEND 2
+#define URING_WAKE 3
+#define URING_DATA(type, bid) ((uint64_t)(type)<<32|(bid))
+
+// submit the queued entries and wait for n completions; replies are
+// sent with MSG_DONTWAIT, so they have completed on return, their
+// buffers are handed back to the kernel (once provided() is called)
+// and the cached values they referred to can be freed
+static int submit(WORKER &wk, const unsigned n) {
+    URING &u=*wk.uring;
+    const int r=u.enter(n);
+    for(unsigned i=0; i<wk.nsending; ++i)
+        u.provide(wk.bufs+wk.sending[i]*URING_BUF_SIZE, URING_BUF_SIZE,
+            wk.sending[i]);
+    wk.nsending=0;
+    replied(wk);
+    wk.data.reclaim();
+    return r;
+}
+
+// a submission queue entry, flushing the queue if it is full
+static struct io_uring_sqe *uring_sqe(WORKER &wk) {
+    struct io_uring_sqe *sqe;
+    while(!(sqe=wk.uring->sqe()))
+        submit(wk, 0);
+    return sqe;
+}
+
+// a single multishot receive keeps posting packets into provided buffers
+static void arm_recv(WORKER &wk) {
+    struct io_uring_sqe *sqe=uring_sqe(wk);
+    sqe->opcode=IORING_OP_RECVMSG;
+    sqe->fd=0; // the registered socket
+    sqe->flags=IOSQE_FIXED_FILE|IOSQE_BUFFER_SELECT;
+    sqe->ioprio=IORING_RECV_MULTISHOT;
+    sqe->addr=(unsigned long)&wk.recv_msg;
+    sqe->buf_group=0;
+    sqe->user_data=URING_DATA(URING_RECV, 0);
+}
+
+// wake up when another worker queues a request; the eventfd is
+// non-blocking, so it is polled rather than read by the kernel
+static void arm_wake(WORKER &wk) {
+    struct io_uring_sqe *sqe=uring_sqe(wk);
+    sqe->opcode=IORING_OP_POLL_ADD;
+    sqe->fd=wk.wake;
+    sqe->poll32_events=POLLIN;
+    sqe->user_data=URING_DATA(URING_WAKE, 0);
+}
+
+static void free_uring(WORKER &wk) {
+    delete wk.uring;
+    delete[] wk.bufs;
+    delete[] wk.send_msgs;
+    delete[] wk.send_iov;
+    delete[] wk.sending;
+    wk.uring=NULL;
+}
+
+// set up the io_uring event loop of a worker, called from its own thread;
+// false means the kernel lacks a required feature
+bool init_uring(const unsigned w) {
+    WORKER &wk=*workers[w];
+    wk.uring=new URING;
+    wk.bufs=new unsigned char[URING_BUFFERS*URING_BUF_SIZE];
+    wk.send_msgs=new struct msghdr[URING_BUFFERS];
+    wk.send_iov=new struct iovec[2*URING_BUFFERS];
+    wk.sending=new unsigned short[URING_BUFFERS];
+    URING &u=*wk.uring;
+    if(!u.init(URING_ENTRIES) || !u.register_file(wk.s) ||
+            !u.register_buffers(0, URING_BUFFERS)) { // Linux 5.19
+        free_uring(wk);
+        return false;
+    }
+    for(unsigned bid=0; bid<URING_BUFFERS; ++bid)
+        u.provide(wk.bufs+bid*URING_BUF_SIZE, URING_BUF_SIZE, bid);
+    u.provided();
+    memset(&wk.recv_msg, 0, sizeof wk.recv_msg);
+    wk.recv_msg.msg_namelen=sizeof(struct sockaddr_in);
+    arm_recv(wk);
+    if(nworkers>1)
+        arm_wake(wk);
+    u.enter(0);
+    // multishot receive is refused at once before Linux 6.0
+    struct io_uring_cqe *cqe=u.peek();
+    if(cqe && cqe->user_data==URING_DATA(URING_RECV, 0) && cqe->res<0) {
+        free_uring(wk);
+        return false;
+    }
+    return true;
+}
+
+// serve a packet received into buffer bid, the reply is sent from the
+// same buffer, which is handed back to the kernel by the next submit()
+static void uring_packet(WORKER &wk, const unsigned w, const unsigned bid,
+        const unsigned short port, const unsigned long listen_address, LOG &log) {
+    URING &u=*wk.uring;
+    unsigned char *buf=wk.bufs+bid*URING_BUF_SIZE;
+    const struct io_uring_recvmsg_out *out=(struct io_uring_recvmsg_out *)buf;
+    struct sockaddr_in *addr=(struct sockaddr_in *)(out+1);
+    CACHE_PACKET *packet=(CACHE_PACKET *)((unsigned char *)addr+
+        wk.recv_msg.msg_namelen+wk.recv_msg.msg_controllen);
+    ssize_t len=out->payloadlen;
+    if(len>(ssize_t)sizeof(DATAGRAM)) // truncated like recvfrom does
+        len=sizeof(DATAGRAM);
+
+    // control requests are answered by the worker receiving them
+    if(nworkers>1 && len>=(ssize_t)CACHE_HDR_LEN && packet->version==1 &&
+            packet->type<CACHE_CMD_STATS &&
+            (packet->type!=CACHE_CMD_GET || tiered)) {
+        const unsigned owner=shard(packet->key);
+        if(owner!=w) { // not steered by the kernel
+            forward(wk, w, owner, *packet, len, *addr, out->namelen);
+            u.provide(buf, URING_BUF_SIZE, bid);
+            return;
+        }
+    }
+    const unsigned char *val;
+    wk.received=monotonic_ns();
+    len=serve(wk, *packet, len, (struct sockaddr *)addr, port, listen_address, log, val);
+    account(wk);
+    if(len<=0) {
+        u.provide(buf, URING_BUF_SIZE, bid);
+        return;
+    }
+    struct iovec *iov=&wk.send_iov[2*bid];
+    iov[0].iov_base=packet;
+    iov[0].iov_len=CACHE_HDR_LEN;
+    iov[1].iov_base=(void *)val;
+    iov[1].iov_len=len-CACHE_HDR_LEN;
+    struct msghdr &m=wk.send_msgs[bid];
+    memset(&m, 0, sizeof m);
+    m.msg_name=addr;
+    m.msg_namelen=out->namelen;
+    m.msg_iov=iov;
+    m.msg_iovlen=len>(ssize_t)CACHE_HDR_LEN ? 2 : 1;
+    // success is not reported, failures are logged by process_uring()
+    struct io_uring_sqe *sqe=uring_sqe(wk);
+    sqe->opcode=IORING_OP_SENDMSG;
+    sqe->fd=0;
+    sqe->flags=IOSQE_FIXED_FILE|IOSQE_CQE_SKIP_SUCCESS;
+    sqe->addr=(unsigned long)&m;
+    sqe->msg_flags=MSG_DONTWAIT;
+    sqe->user_data=URING_DATA(URING_SEND, bid);
+    wk.sending[wk.nsending++]=bid;
+}
+
+// submit the replies queued so far and serve all completed receives,
+// with a single system call per iteration
+void process_uring(const unsigned w, const unsigned short port, const unsigned long listen_address, const unsigned batch, LOG &log) {
+    WORKER &wk=*workers[w];
+    URING &u=*wk.uring;
+
+    // requests forwarded by other workers are rare, reply synchronously
+    const unsigned f=nworkers>1 ? take_forwarded(wk, batch) : 0;
+    if(f)
+        wk.data.tick(coarse_time());
+    for(unsigned i=0; i<f; ++i) {
+        const unsigned char *val;
+        wk.received=monotonic_ns();
+        const ssize_t len=serve(wk, wk.packets[i].packet, wk.msgs[i].msg_len,
+            (struct sockaddr *)&wk.addrs[i], port, listen_address, log, val);
+        account(wk);
+        if(len>0 && send_reply(wk.s, wk.packets[i].packet, len, val,
+                (struct sockaddr *)&wk.addrs[i], wk.msgs[i].msg_hdr.msg_namelen)==-1 &&
+                errno!=EAGAIN && errno!=EWOULDBLOCK)
+            log.err(LOG_ERR, "Sendto failed to send packet to %s", inet_ntoa(wk.addrs[i].sin_addr));
+    }
+
+    flush(wk); // the operations served since the last iteration
+
+    unsigned wait=!f && !u.peek();
+    if(wait && nworkers>1) {
+        __atomic_store_n(&wk.sleeping, 1, __ATOMIC_SEQ_CST);
+        for(unsigned i=0; i<nworkers; ++i) // recheck to avoid a lost wakeup
+            if(__atomic_load_n(&wk.inbound[i].tail, __ATOMIC_SEQ_CST)!=
+                    wk.inbound[i].head)
+                wait=0;
+    }
+    if(submit(wk, wait)<0) {
+        log.err(LOG_ERR, "io_uring_enter");
+        sleep(1); // limit the error rate
+    }
+    __atomic_store_n(&wk.sleeping, 0, __ATOMIC_SEQ_CST);
+    if(!u.peek()) {
+        u.provided();
+        return;
+    }
+    // the replies are sent by the next submit(), which is not waited for
+    wk.data.tick(coarse_time()); // expire a bounded number of sessions
+
+    bool rearm=false;
+    for(struct io_uring_cqe *cqe; (cqe=u.peek()); u.seen()) {
+        const unsigned bid=cqe->flags>>IORING_CQE_BUFFER_SHIFT;
+        switch(cqe->user_data>>32) {
+        case URING_RECV:
+            if(!(cqe->flags&IORING_CQE_F_MORE)) // the receive has ended
+                rearm=true;
+            if(cqe->res<0) {
+                if(cqe->res!=-ENOBUFS) { // not just out of buffers
+                    errno=-cqe->res;
+                    log.err(LOG_ERR, "recvmsg");
+                }
+                break;
+            }
+            uring_packet(wk, w, bid, port, listen_address, log);
+            break;
+        case URING_SEND: // the buffer is intact until provided() is called
+            if(cqe->res!=-EAGAIN) {
+                const struct io_uring_recvmsg_out *out=(struct io_uring_recvmsg_out *)
+                    (wk.bufs+(cqe->user_data&0xffffffff)*URING_BUF_SIZE);
+                errno=-cqe->res;
+                log.err(LOG_ERR, "Sendto failed to send packet to %s",
+                    inet_ntoa(((sockaddr_in *)(out+1))->sin_addr));
+            }
+            break;
+        case URING_WAKE: {
+            uint64_t v;
+            if(read(wk.wake, &v, sizeof v)==-1) {
+                // nothing to reset
+            }
+            arm_wake(wk);
+            break;
+        }
+        }
+    }
+    if(rearm)
+        arm_recv(wk);
+    u.provided(); // hand the recycled buffers back
+    publish(wk);
+}
+
+#endif // HAVE_URING
+
+#endif // defined __linux__
+
+// write the requests captured by a worker to the trace
+static void flush_trace(WORKER &wk) {
+    if(wk.trace_len && !trace->write(wk.trace_buf, wk.trace_len))
+        wk.traced-=wk.trace_len/TRACE_RECORD_LEN; // not written after all
+    wk.trace_len=0;
+}
+
+// record a client request in the trace, without its value
+static inline void capture(WORKER &wk, const unsigned type,
+        const unsigned char *k, const unsigned len, const unsigned timeout) {
+    if(!trace)
+        return;
+    trace->encode(wk.trace_buf+wk.trace_len, type, k, len, timeout,
+        wk.received, wk.id);
+    wk.trace_len+=TRACE_RECORD_LEN;
+    ++wk.traced;
+    if(wk.trace_len==TRACE_BUFFER*TRACE_RECORD_LEN)
+        flush_trace(wk);
+}
+
+// count a request in the sketches of its kind, by source and by key
+static inline void sample(WORKER &wk, const unsigned kind,
+        const unsigned char *k, const struct sockaddr_in *addr) {
+    wk.sources[kind].add((const unsigned char *)&addr->sin_addr,
+        sizeof addr->sin_addr);
+    wk.keys[kind].add(k, KEY_LEN);
+}
+
+// publish a session stored in the cache to the local clients
+static inline void mirror_new(const unsigned char *k, const unsigned char *v,
+        const unsigned len, const unsigned timeout) {
+    if(!mirror)
+        return;
+    const time_t now=coarse_time();
+    mirror->store(k, v, len, now+timeout, now);
+}
+
+// withdraw a session removed from the cache
+static inline void mirror_erase(const unsigned char *k) {
+    if(mirror)
+        mirror->erase(k);
+}
+
+// whether the receive queue backs up: more than half of the socket buffer
+// taken sets the pressure, less than a quarter clears it
+static void check_backlog(WORKER &wk) {
+#if defined(__linux__) && defined(SO_MEMINFO)
+    uint32_t meminfo[SK_MEMINFO_VARS];
+    socklen_t len=sizeof meminfo;
+    if(getsockopt(wk.s, SOL_SOCKET, SO_MEMINFO, meminfo, &len) ||
+            len<=SK_MEMINFO_RCVBUF*sizeof(uint32_t))
+        return;
+    const uint32_t queued=meminfo[SK_MEMINFO_RMEM_ALLOC];
+    if(queued>meminfo[SK_MEMINFO_RCVBUF]/2)
+        wk.admission.backlog(true);
+    else if(queued<meminfo[SK_MEMINFO_RCVBUF]/4)
+        wk.admission.backlog(false);
+#endif
+}
+
+// whether to serve a client request, or to shed it
+static bool admit(WORKER &wk, const int type, const struct sockaddr_in *addr) {
+    if(!--wk.probe) {
+        wk.probe=ADMIT_PROBE;
+        check_backlog(wk);
+    }
+    if(wk.admission.admit(addr->sin_addr.s_addr, type, wk.received/1000000))
+        return true;
+    ++wk.shed[type];
+    return false;
+}
+
+// look a session up in the shard owning it: a GET is served by whichever
+// worker received it, from another shard with its lock-free read path,
+// which copies the value into buf; with a disk tier, only by its owner
+static bool lookup(WORKER &wk, const unsigned char *k, const unsigned char *&v,
+        unsigned &len, unsigned char *buf) {
+    const unsigned owner=nworkers>1 ? shard(k) : wk.id;
+    if(owner==wk.id)
+        return wk.data.find(k, v, len);
+    v=buf;
+    return workers[owner]->data.read(k, buf, len, wk.id);
+}
+
+// count a GET of key k that found no session by why, and the larger
+// caches that would have kept it
+static void miss(WORKER &wk, const unsigned char *k,
+        const struct sockaddr_in *addr) {
+    sample(wk, SAMPLE_MISS, k, addr);
+    const unsigned owner=nworkers>1 ? shard(k) : wk.id;
+    uint64_t since=0;
+    const int reason=workers[owner]->data.missed(k, since);
+    ++wk.missed[reason];
+    if(reason!=GHOST_EVICTED)
+        return;
+    const unsigned long long size=
+        __atomic_load_n(&workers[owner]->entries, __ATOMIC_RELAXED);
+    for(unsigned i=0; i<GHOST_LARGER; ++i)
+        if((since+1)*100<=size*ghost_larger[i])
+            ++wk.larger[i];
+}
+
+// control packets are only taken from this host
+static inline bool local(const struct sockaddr_in *addr) {
+    return (ntohl(addr->sin_addr.s_addr)>>24)==127;
+}
+
+// change the number of sessions cached at most as asked by a control
+// packet, only taken from this host, as it could empty the cache
+static bool set_limit(const CACHE_PACKET &packet, const ssize_t len,
+        const struct sockaddr_in *addr, LOG &log) {
+    uint32_t n;
+    if(!local(addr) || len!=(ssize_t)(CACHE_HDR_LEN+sizeof n))
+        return false;
+    memcpy(&n, packet.val, sizeof n);
+    n=ntohl(n);
+    if(n<nworkers || n>ARENA_NONE-(1u<<ARENA_BLOCK_BITS))
+        return false;
+    for(unsigned w=0; w<nworkers; ++w) { // adopted by each worker on its tick
+        workers[w]->data.limit(n/nworkers);
+#ifdef __linux__
+        // an idle worker is woken up to tick
+        if(nworkers>1 &&
+                __atomic_load_n(&workers[w]->sleeping, __ATOMIC_SEQ_CST)) {
+            const uint64_t one=1;
+            if(write(workers[w]->wake, &one, sizeof one)==-1) {
+                // the counter is already signalled
+            }
+        }
+#endif
+    }
+    log.msg(LOG_NOTICE, "Session limit set to %u", n);
+    return true;
+}
+
+// apply an operation received from a peer, it is not replicated further;
+// peers only send NEW and REMOVE
+static void apply(WORKER &wk, const CACHE_PACKET &packet, const ssize_t len) {
+    if(packet.type==CACHE_CMD_NEW) {
+        wk.data.insert(packet.key, packet.val, len-CACHE_HDR_LEN,
+            ntohs(packet.timeout));
+        mirror_new(packet.key, packet.val, len-CACHE_HDR_LEN,
+            ntohs(packet.timeout));
+    } else if(packet.type==CACHE_CMD_REMOVE) {
+        wk.data.erase(packet.key);
+        mirror_erase(packet.key);
+    } else {
+        ++wk.malformed;
+        return;
+    }
+    ++wk.applied;
+}
+
+// whether a datagram comes from one of the peers, the only sources whose
+// operations are applied unchecked
+static bool peer(const struct sockaddr_in *addr) {
+    for(unsigned p=0; p<npeers; ++p)
+        if(peers[p].sin_addr.s_addr==addr->sin_addr.s_addr &&
+                peers[p].sin_port==addr->sin_port)
+            return true;
+    return false;
+}
+
+// apply the operations of a replication datagram from a peer, each in
+// its own shard; those from other sources are dropped as malformed
+static void replicated(WORKER &wk, const unsigned char *d, const ssize_t len,
+        const struct sockaddr_in *addr, LOG &log) {
+    if(!peer(addr) || !wk.replica.accept(d, len)) {
+        ++wk.malformed;
+        log.msg(LOG_ERR, "Malformed packet received from %s", inet_ntoa(addr->sin_addr));
+        return;
+    }
+    CACHE_PACKET packet;
+    unsigned l;
+    while(wk.replica.next(packet, l)) {
+#ifdef __linux__
+        const unsigned owner=nworkers>1 ? shard(packet.key) : wk.id;
+        if(owner!=wk.id) {
+            forward(wk, wk.id, owner, packet, l, *addr, sizeof *addr,
+                false, 0, true);
+            continue;
+        }
+#endif
+        apply(wk, packet, l);
+    }
+}
+
+// queue an operation served to a client for the peers
+static void replicate(WORKER &wk, const CACHE_PACKET &packet, const ssize_t len) {
+    if(!npeers)
+        return;
+    if(!wk.replica.add(packet, len)) { // the datagram is full
+        flush(wk);
+        wk.replica.add(packet, len);
+    }
+    ++wk.replicated;
+}
+
+// send the replies collected for a version 2 datagram
+static void send_v2(WORKER &wk, const struct sockaddr_in *addr, LOG &log) {
+    if(!wk.reply_count)
+        return;
+    const CACHE_V2_HEADER h={CACHE_V2_VERSION, (u_char)wk.reply_count, 0};
+    memcpy(wk.reply, &h, sizeof h);
+    if(sendto(wk.s, (const char *)wk.reply, wk.reply_len, 0,
+            (const struct sockaddr *)addr, sizeof *addr)==-1
+#ifndef __WIN32__
+            && errno!=EAGAIN && errno!=EWOULDBLOCK
+#endif
+            )
+        log.err(LOG_ERR, "Sendto failed to send packet to %s", inet_ntoa(addr->sin_addr));
+    wk.reply_len=sizeof h;
+    wk.reply_count=0;
+}
+
+// serve the operations of a version 2 datagram, each in its own shard;
+// the replies to the GETs are copied into datagrams sent as they fill up
+static void serve_v2(WORKER &wk, const unsigned char *d, const ssize_t len,
+        const struct sockaddr_in *addr, LOG &log) {
+    CACHE_V2_HEADER h;
+    memcpy(&h, d, sizeof h);
+    wk.reply_len=sizeof h;
+    wk.reply_count=0;
+    size_t pos=sizeof h;
+    for(unsigned i=0; i<h.count; ++i) {
+        CACHE_OP op;
+        if(pos+sizeof op>(size_t)len) {
+            ++wk.malformed;
+            log.msg(LOG_ERR, "Malformed packet received from %s", inet_ntoa(addr->sin_addr));
+            break;
+        }
+        memcpy(&op, d+pos, sizeof op);
+        const unsigned l=ntohs(op.len);
+        const unsigned char *val=d+pos+sizeof op;
+        pos+=sizeof op+l;
+        if(l>MAX_VAL_LEN || pos>(size_t)len) {
+            ++wk.malformed;
+            log.msg(LOG_ERR, "Malformed packet received from %s", inet_ntoa(addr->sin_addr));
+            break;
+        }
+        if(op.type!=CACHE_CMD_NEW && op.type!=CACHE_CMD_GET &&
+                op.type!=CACHE_CMD_REMOVE)
+            continue;
+        CACHE_PACKET packet; // as a version 1 request
+        packet.version=1;
+        packet.type=op.type;
+        packet.timeout=op.timeout;
+        memcpy(packet.key, op.key, KEY_LEN);
+#ifdef __linux__
+        const unsigned owner=nworkers>1 ? shard(op.key) : wk.id;
+        if(owner!=wk.id && (op.type!=CACHE_CMD_GET || tiered)) {
+            memcpy(packet.val, val, l);
+            forward(wk, wk.id, owner, packet, CACHE_HDR_LEN+l, *addr,
+                sizeof *addr, true, op.id);
+            continue;
+        }
+#endif
+        capture(wk, op.type, op.key, l, ntohs(op.timeout));
+        sample(wk, op.type, op.key, addr);
+        const bool admitted=admit(wk, op.type, addr);
+        if(!admitted && op.type!=CACHE_CMD_GET)
+            continue;
+        if(op.type==CACHE_CMD_GET) {
+            const unsigned char *v;
+            unsigned vl=0;
+            op.type=CACHE_RESP_ERR; // a shed GET is a miss at once
+            if(admitted) {
+                ++wk.trans;
+                ++wk.batch_ops[CACHE_CMD_GET];
+                if(lookup(wk, op.key, v, vl, wk.scratch)) {
+                    ++wk.hits;
+                    op.type=CACHE_RESP_OK;
+                } else {
+                    ++wk.misses;
+                    miss(wk, op.key, addr);
+                }
+            }
+            if(wk.reply_len+sizeof op+vl>sizeof wk.reply || wk.reply_count==255)
+                send_v2(wk, addr, log);
+            op.len=htons(vl);
+            op.timeout=0;
+            memcpy(wk.reply+wk.reply_len, &op, sizeof op);
+            if(vl)
+                memcpy(wk.reply+wk.reply_len+sizeof op, v, vl);
+            wk.reply_len+=sizeof op+vl;
+            ++wk.reply_count;
+            continue;
+        }
+        ++wk.trans;
+        ++wk.batch_ops[op.type];
+        if(op.type==CACHE_CMD_NEW) {
+            wk.data.insert(op.key, val, l, ntohs(op.timeout));
+            mirror_new(op.key, val, l, ntohs(op.timeout));
+        } else {
+            wk.data.erase(op.key);
+            mirror_erase(op.key);
+        }
+        if(npeers) {
+            memcpy(packet.val, val, l);
+            replicate(wk, packet, CACHE_HDR_LEN+l);
+        }
+    }
+    send_v2(wk, addr, log);
+}
+
+// process a single request in place, return the length of the reply
+// to be sent back, or 0 if there is none; the reply is the header of
+// the packet followed by the value at val, which is left in the cache
+static ssize_t serve(WORKER &wk, CACHE_PACKET &packet, ssize_t len, const struct sockaddr *addr,
+        const unsigned short port, const unsigned long listen_address, LOG &log,
+        const unsigned char *&val) {
+    const sockaddr_in *in_addr=(sockaddr_in *)addr;
+    val=NULL;
     // check for logging packet
     if( len == 0 &&
             in_addr->sin_family==AF_INET &&
             in_addr->sin_port==htons(port) &&
             in_addr->sin_addr.s_addr==listen_address ) {
         stats(log);
-        return;
+#ifndef __WIN32__
+        checkpoint(log);
+#endif
+        return 0;
+    }
+    if(len>=(ssize_t)sizeof(CACHE_V2_HEADER) && packet.version==CACHE_V2_VERSION) {
+        serve_v2(wk, (unsigned char *)&packet, len, in_addr, log);
+        return 0;
     }
-    if(len<(int)(sizeof(packet)-MAX_VAL_LEN) || packet.version != 1) {
+    if(len>0 && packet.version==CACHE_REPL_VERSION) {
+        replicated(wk, (unsigned char *)&packet, len, in_addr, log);
+        return 0;
+    }
+    if(len>(ssize_t)sizeof packet) // truncated like recvfrom into a packet
+        len=sizeof packet;
+    if(len<(int)CACHE_HDR_LEN || packet.version != 1) {
+        ++wk.malformed;
         log.msg(LOG_ERR, "Malformed packet received from %s", inet_ntoa(in_addr->sin_addr));
-        return;
+        return 0;
+    }
+    if(packet.type==CACHE_CMD_STATS) {
+        // the report is far longer than the request: answered on this
+        // host only, not to be a reflector for spoofed sources
+        if(!local(in_addr)) {
+            packet.type=CACHE_RESP_ERR;
+            return CACHE_HDR_LEN;
+        }
+        packet.type=CACHE_RESP_OK;
+        val=(const unsigned char *)wk.report;
+        if(!wk.report_len) // unsent replies may still refer to it
+            wk.report_len=report(wk.report, sizeof wk.report);
+        return CACHE_HDR_LEN+wk.report_len;
+    }
+    if(packet.type==CACHE_CMD_BUSIEST) { // it shows session IDs
+        if(!local(in_addr)) {
+            packet.type=CACHE_RESP_ERR;
+            return CACHE_HDR_LEN;
+        }
+        packet.type=CACHE_RESP_OK;
+        val=(const unsigned char *)wk.busiest;
+        if(!wk.busiest_len) { // unsent replies may still refer to it
+            wk.sketched=0; // its own sketches now, the others' once a second
+            publish(wk);
+            wk.busiest_len=busiest(wk.busiest, sizeof wk.busiest);
+        }
+        return CACHE_HDR_LEN+wk.busiest_len;
     }
-    ++delta_trans;
-	BYTES k(KEY_LEN);
-    mem2bytes(k, packet.key, KEY_LEN);
+    if(packet.type==CACHE_CMD_LIMIT) {
+        packet.type=CACHE_RESP_ERR;
+        if(set_limit(packet, len, in_addr, log)) {
+            wk.data.tick(coarse_time()); // this shard adopts it at once
+            packet.type=CACHE_RESP_OK;
+        }
+        return CACHE_HDR_LEN;
+    }
+    if(packet.type<CACHE_CMD_STATS) {
+        capture(wk, packet.type, packet.key, len-CACHE_HDR_LEN,
+            ntohs(packet.timeout));
+        sample(wk, packet.type, packet.key, in_addr);
+        if(!admit(wk, packet.type, in_addr)) {
+            if(packet.type!=CACHE_CMD_GET)
+                return 0;
+            packet.type=CACHE_RESP_ERR; // a miss at once rather than a timeout
+            return CACHE_HDR_LEN;
+        }
+        ++wk.batch_ops[packet.type];
+    }
+    ++wk.trans;
     if(packet.type==CACHE_CMD_NEW) {
-        BYTES v;
-		mem2bytes(v, packet.val, len-(sizeof packet-MAX_VAL_LEN));
-        data.insert(k, v, ntohs(packet.timeout));
+        wk.data.insert(packet.key, packet.val, len-CACHE_HDR_LEN,
+            ntohs(packet.timeout));
+        mirror_new(packet.key, packet.val, len-CACHE_HDR_LEN,
+            ntohs(packet.timeout));
+        replicate(wk, packet, len);
         //log.msg(LOG_DEBUG, "Added new value for key '%s'", packet.key);
     } else if(packet.type==CACHE_CMD_GET) {
         //log.msg(LOG_DEBUG, "Recieved GET packet.");
-        len=sizeof(packet)-(sizeof(u_char) * MAX_VAL_LEN);
-		BYTES v;
-        if(data.find(k, v)) {
-            ++delta_hits;
-            bytes2mem(packet.val, v);
-            len+=v.size();
+        len=CACHE_HDR_LEN;
+        unsigned l;
+        if(lookup(wk, packet.key, val, l, packet.val)) {
+            ++wk.hits;
+            len+=l;
             packet.type=CACHE_RESP_OK;
         } else {
-            ++delta_misses;
+            ++wk.misses;
+            miss(wk, packet.key, in_addr);
             packet.type=CACHE_RESP_ERR;
         }
         //log.msg(LOG_DEBUG, "Replying to GET packet for '%s' with '%s'. Packet size %d.", packet.key, packet.val, len);
-        if(sendto(s, (char *)&packet, len, 0, &addr, addrlen)==-1)
-            log.err(LOG_ERR, "Sendto failed to send packet to %s", inet_ntoa(in_addr->sin_addr));
-        //else
-            //log.msg(LOG_DEBUG, "Sent packet");
+        return len;
     } else if(packet.type==CACHE_CMD_REMOVE) {
-        data.erase(k);
+        wk.data.erase(packet.key);
+        mirror_erase(packet.key);
+        replicate(wk, packet, len);
         //log.msg(LOG_DEBUG, "Removed key '%s'", packet.key);
     } else {
         //log.msg(LOG_ERR, "Incorrect packet type");
-        --delta_trans;
+        --wk.trans;
     }
+    return 0;
+}
+
+#ifndef __WIN32__
+
+static unsigned parked=0; // worker threads that have stopped serving
+static const char *cache_path=NULL; // checkpointed to, see checkpoint()
+static pid_t checkpointing=0; // the process writing one, 0 for none
+
+// called by a worker thread once it has stopped serving,
+// its shard is left to the main thread from then on
+void park_worker() {
+    __atomic_add_fetch(&parked, 1, __ATOMIC_RELEASE);
+    for(;;)
+        pause();
 }
 
-static void mem2bytes(BYTES &dst, const unsigned char *src, const unsigned l) {
-    dst.clear();
-    for(unsigned int i=0; i<l; ++i)
-    {
-        dst.push_back(src[i]);
+// load the sessions saved by a previous instance into their shards,
+// which may be split differently, before the workers are started;
+// the cache is checkpointed to the same file from then on
+void load_cache(const char *path, LOG &log) {
+    cache_path=path;
+    SNAPSHOT snap(path);
+    if(!snap.open()) {
+        if(errno!=ENOENT)
+            log.err(LOG_ERR, "Cannot load the cache from %s", path);
+        return;
+    }
+    for(unsigned w=0; w<nworkers; ++w)
+        workers[w]->data.reserve(snap.sessions()/nworkers);
+    const unsigned char *k, *v;
+    unsigned len;
+    time_t t;
+    while(snap.next(k, v, len, t)) {
+        workers[shard(k)]->data.restore(k, v, len, t);
+        if(mirror)
+            mirror->store(k, v, len, t, coarse_time());
+    }
+    unsigned long long loaded=0;
+    for(unsigned w=0; w<nworkers; ++w) {
+        publish(*workers[w]);
+        loaded+=workers[w]->entries;
     }
+    log.msg(LOG_NOTICE, "Loaded %llu of %llu sessions from %s", loaded,
+        (unsigned long long)snap.sessions(), path);
 }
 
-static void bytes2mem(unsigned char *dst, const BYTES &src) {
-    const unsigned length=src.size();
-    for(unsigned i=0; i<length; ++i)
-    {
-        dst[i]=src[i];
+// write the live sessions of all the shards to a snapshot, with those
+// demoted to their disk tiers unless memory_only; its number of sessions
+// in count
+static bool write_snapshot(const char *path, const bool memory_only,
+        unsigned long long &count) {
+    SNAPSHOT snap(path);
+    bool ok=snap.create();
+    const time_t now=coarse_time();
+    for(unsigned w=0; ok && w<nworkers; ++w) {
+        DATA &data=workers[w]->data;
+        const unsigned char *k, *v;
+        unsigned len;
+        time_t t;
+        for(uint32_t id=0; ok && id<data.ids(); ++id)
+            if(data.get(id, k, v, len, t))
+                ok=snap.add(k, v, len, t);
+        size_t pos=0;
+        while(ok && !memory_only && workers[w]->tier &&
+                workers[w]->tier->next(pos, k, v, len, t, now))
+            ok=snap.add(k, v, len, t);
     }
+    count=snap.sessions();
+    return ok && snap.commit();
+}
+
+// reap the process writing the last checkpoint, false while it runs;
+// with stop, it is killed first
+static bool checkpointed(LOG &log, const bool stop) {
+    if(!checkpointing)
+        return true;
+    if(stop)
+        kill(checkpointing, SIGKILL);
+    int status;
+    const pid_t r=waitpid(checkpointing, &status, stop ? 0 : WNOHANG);
+    if(!r)
+        return false;
+    if(r==checkpointing && !stop &&
+            (!WIFEXITED(status) || WEXITSTATUS(status)))
+        log.msg(LOG_ERR, "Cannot checkpoint the cache to %s", cache_path);
+    checkpointing=0;
+    return true;
+}
+
+// save the sessions in memory every LOG_FREQ, for a restart after a crash
+// to lose no more than those served since: a child process writes them
+// from its copy-on-write image of this one, so that the workers go on
+// serving; the disk tiers are left out, their files are shared with it
+static void checkpoint(LOG &log) {
+    if(!cache_path || !checkpointed(log, false))
+        return;
+    const pid_t pid=fork();
+    if(pid==-1) {
+        log.err(LOG_ERR, "Cannot checkpoint the cache to %s", cache_path);
+        return;
+    }
+    if(!pid) { // only this thread is left, the workers are frozen
+        unsigned long long count;
+        _exit(write_snapshot(cache_path, true, count) ? 0 : 1);
+    }
+    checkpointing=pid;
+}
+
+// called by worker 0 once the stop has been requested: the other workers
+// are woken up to see it, and their state is only read after they have parked
+static void stop_workers() {
+#ifdef __linux__
+    for(unsigned w=1; w<nworkers; ++w) {
+        const uint64_t one=1;
+        if(write(workers[w]->wake, &one, sizeof one)==-1) {
+            // the worker is already awake
+        }
+    }
+#endif
+    while(__atomic_load_n(&parked, __ATOMIC_ACQUIRE)<nworkers-1)
+        usleep(1000);
+}
+
+// save the live sessions of all the shards, those demoted to their
+// disk tiers after those in memory, once the workers have stopped
+bool save_cache(const char *path, LOG &log) {
+    stop_workers();
+    checkpointed(log, true); // it would write the same file
+    unsigned long long count;
+    if(!write_snapshot(path, false, count)) {
+        log.err(LOG_ERR, "Cannot save the cache to %s", path);
+        return false;
+    }
+    log.msg(LOG_NOTICE, "Saved %llu sessions to %s", count, path);
+    return true;
+}
+
+// write out the rest of the trace, once the workers have stopped
+void close_trace(LOG &log) {
+    if(!trace)
+        return;
+    stop_workers();
+    trace->stop(); // the buffers queued before those left
+    unsigned long long traced=0;
+    for(unsigned w=0; w<nworkers; ++w) {
+        flush_trace(*workers[w]);
+        traced+=workers[w]->traced;
+    }
+    traced-=trace->lost();
+    if(trace->failed()) {
+        errno=trace->failed();
+        log.err(LOG_ERR, "Cannot write the trace, stopped");
+    }
+    delete trace;
+    trace=NULL;
+    log.msg(LOG_NOTICE, "Traced %llu requests", traced);
+}
+
+// withdraw the shared memory segment, once the workers have stopped
+void close_mirror() {
+    if(!mirror)
+        return;
+    stop_workers();
+    delete mirror;
+    mirror=NULL;
+}
+
+#endif // !defined __WIN32__
+
+// make the shard size visible to stats() running in another worker
+static void publish(WORKER &wk) {
+    wk.entries=wk.data.size();
+    wk.memory=wk.data.memory();
+    wk.overhead=wk.data.overhead()*wk.entries;
+    wk.evicted=wk.data.evicted();
+    wk.expired=wk.data.expired();
+    if(wk.tier) {
+        wk.tier_sessions=wk.tier->sessions();
+        wk.tier_bytes=wk.tier->bytes();
+        wk.demoted=wk.tier->demoted();
+        wk.promoted=wk.tier->promoted();
+        wk.tier_dropped=wk.tier->dropped();
+        wk.skipped=wk.tier->skipped();
+    }
+    const time_t now=coarse_time();
+    if(now==wk.sketched)
+        return;
+    wk.sketched=now; // once a second
+    const bool halve=now>=wk.halved+SKETCH_HALF;
+    if(halve)
+        wk.halved=now;
+    for(unsigned k=0; k<SAMPLE_KINDS; ++k) {
+        if(halve) {
+            wk.sources[k].decay();
+            wk.keys[k].decay();
+        }
+        wk.sources[k].publish();
+        wk.keys[k].publish();
+    }
+}
+
+// send the batched operations to every peer; the socket is never waited
+// for, a datagram it cannot take is lost, as it could be on the way
+static void flush(WORKER &wk) {
+    if(!wk.replica.pending())
+        return;
+    size_t len;
+    const unsigned char *d=wk.replica.seal(len);
+    for(unsigned p=0; p<npeers; ++p)
+        if(sendto(wk.s, (const char *)d, len, MSG_DONTWAIT,
+                (struct sockaddr *)&peers[p], sizeof peers[p])==-1) {
+            // counted as lost by the peer
+        }
+}
+
+// send a single reply with its value taken straight from the cache
+static ssize_t send_reply(const int s, CACHE_PACKET &packet, const ssize_t len,
+        const unsigned char *val, const struct sockaddr *addr, const socklen_t addrlen) {
+#ifdef __WIN32__
+    // a statistics report does not fit into the packet
+    static char buf[CACHE_HDR_LEN+CACHE_STATS_LEN];
+    memcpy(buf, &packet, CACHE_HDR_LEN);
+    memcpy(buf+CACHE_HDR_LEN, val, len-CACHE_HDR_LEN);
+    return sendto(s, buf, len, 0, addr, addrlen);
+#else
+    struct iovec iov[2]={{&packet, CACHE_HDR_LEN},
+        {(void *)val, (size_t)(len-CACHE_HDR_LEN)}};
+    struct msghdr m;
+    memset(&m, 0, sizeof m);
+    m.msg_name=(void *)addr;
+    m.msg_namelen=addrlen;
+    m.msg_iov=iov;
+    m.msg_iovlen=len>(ssize_t)CACHE_HDR_LEN ? 2 : 1;
+    return sendmsg(s, &m, 0);
+#endif
+}
+
+// the kernel keeps a coarse clock that can be read without a system call
+static time_t coarse_time() {
+#ifdef CLOCK_REALTIME_COARSE
+    struct timespec ts;
+    if(!clock_gettime(CLOCK_REALTIME_COARSE, &ts))
+        return ts.tv_sec;
+#endif
+    return time(NULL);
+}
+
+// a clock for measuring service times, 0 if there is none
+static unsigned long long monotonic_ns() {
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    if(!clock_gettime(CLOCK_MONOTONIC, &ts))
+        return ts.tv_sec*1000000000ULL+ts.tv_nsec;
+#endif
+    return 0;
+}
+
+// add the operations of the datagram just served to the service time
+// histograms: a version 1 request, or those of a version 2
+// datagram, which share the time it took evenly
+static void account(WORKER &wk) {
+    unsigned n=0;
+    for(unsigned op=0; op<CACHE_CMD_STATS; ++op)
+        n+=wk.batch_ops[op];
+    if(!n)
+        return;
+    const unsigned long long t=(monotonic_ns()-wk.received)/n;
+    unsigned b=0;
+    while(b<LATENCY_BUCKETS-1 && t>latency_bounds[b])
+        ++b;
+    for(unsigned op=0; op<CACHE_CMD_STATS; ++op)
+        if(wk.batch_ops[op]) {
+            wk.latency[op][b]+=wk.batch_ops[op];
+            wk.latency_ns[op]+=t*wk.batch_ops[op];
+            wk.batch_ops[op]=0;
+        }
+}
+
+// the replies queued so far have been sent, so the reports they referred
+// to may be built again for the next ones
+static void replied(WORKER &wk) {
+    wk.report_len=0;
+    wk.busiest_len=0;
 }
 
 static unsigned long long total_hits=0, total_misses=0, total_trans=0;
 static time_t start_time=time(NULL); // initialized at startup
 static time_t prev_time=start_time;
 
+// sum a counter over all workers, they are only written by their owners
+#define SUM(field, total) \
+    for(unsigned w=0; w<nworkers; ++w) \
+        total+=__atomic_load_n(&workers[w]->field, __ATOMIC_RELAXED)
+
 static void stats(LOG &log) {
-    total_hits+=delta_hits;
-    total_misses+=delta_misses;
-    total_trans+=delta_trans;
+    unsigned long long hits=0, misses=0, trans=0, forwarded=0, dropped=0;
+    unsigned long long entries=0, memory=0, overhead=0, evicted=0;
+    unsigned long long tier_sessions=0, replicated=0, applied=0, lost=0, shed=0;
+    unsigned long long missed[GHOST_REASONS], larger[GHOST_LARGER];
+    SUM(hits, hits);
+    SUM(misses, misses);
+    SUM(trans, trans);
+    SUM(forwarded, forwarded);
+    SUM(dropped, dropped);
+    SUM(entries, entries);
+    SUM(memory, memory);
+    SUM(overhead, overhead);
+    SUM(evicted, evicted);
+    SUM(tier_sessions, tier_sessions);
+    SUM(replicated, replicated);
+    SUM(applied, applied);
+    SUM(replica.lost, lost);
+    for(unsigned op=0; op<CACHE_CMD_STATS; ++op)
+        SUM(shed[op], shed);
+    for(unsigned r=0; r<GHOST_REASONS; ++r) {
+        missed[r]=0;
+        SUM(missed[r], missed[r]);
+    }
+    for(unsigned i=0; i<GHOST_LARGER; ++i) {
+        larger[i]=0;
+        SUM(larger[i], larger[i]);
+    }
+    const unsigned long long delta_hits=hits-total_hits;
+    const unsigned long long delta_misses=misses-total_misses;
+    const unsigned long long delta_trans=trans-total_trans;
+    total_hits=hits;
+    total_misses=misses;
+    total_trans=trans;
 
     const time_t now=time(NULL);
     const time_t start_diff=now>start_time ? now-start_time : 1;
@@ -154,23 +1573,249 @@ static void stats(LOG &log) {
     const unsigned long long delta_get=delta_hits+delta_misses;
     const unsigned long long total_get=total_hits+total_misses;
 
-    data.cleanup(now);
+    // the hit ratio of larger caches, over the whole run
+    double ratio[GHOST_LARGER];
+    for(unsigned i=0; i<GHOST_LARGER; ++i)
+        ratio[i]=total_get>0 ? 100.0*(total_hits+larger[i])/total_get : 0.0;
 
-    char stats_txt[256];
+    char stats_txt[1024];
     snprintf(stats_txt, sizeof stats_txt,
-        "cache entries=%u, transactions=%llu/%llu, "
-        "tps=%.2f/%.2f, hit ratio=%2.2f%%/%2.2f%%",
-        data.size(),
-        total_trans, delta_trans,
+        "cache entries=%llu, memory=%lluKB, overhead=%lluB/entry, "
+        "evicted=%llu, on disk=%llu, transactions=%llu/%llu, "
+        "tps=%.2f/%.2f, hit ratio=%2.2f%%/%2.2f%%, "
+        "misses expired/evicted/removed/unknown=%llu/%llu/%llu/%llu, "
+        "hit ratio if larger by %u/%u/%u/%u%%=%2.2f%%/%2.2f%%/%2.2f%%/%2.2f%%, "
+        "workers=%u, forwarded=%llu, dropped=%llu, "
+        "replicated=%llu, applied=%llu, lost=%llu, shed=%llu",
+        entries, memory>>10, entries ? overhead/entries : 0, evicted,
+        tier_sessions, total_trans, delta_trans,
         1.0*total_trans/start_diff, 1.0*delta_trans/prev_diff,
         total_get>0 ? 100.0*total_hits/total_get : 0.0,
-        delta_get>0 ? 100.0*delta_hits/delta_get : 0.0);
-    log.msg(LOG_INFO, stats_txt); // log statistics
+        delta_get>0 ? 100.0*delta_hits/delta_get : 0.0,
+        missed[GHOST_EXPIRED], missed[GHOST_EVICTED], missed[GHOST_REMOVED],
+        missed[GHOST_UNKNOWN], ghost_larger[0], ghost_larger[1],
+        ghost_larger[2], ghost_larger[3], ratio[0], ratio[1], ratio[2],
+        ratio[3], nworkers, forwarded, dropped, replicated, applied, lost, shed);
+    log.msg(LOG_INFO, "%s", stats_txt); // log statistics
 
-    delta_hits=delta_misses=delta_trans=0L;
     prev_time=now;
 }
 
+// append to the text at txt of length n, which cannot exceed size-1
+static void append(char *txt, size_t &n, const size_t size, const char *format, ...) {
+    if(n+1>=size)
+        return;
+    va_list ap;
+    va_start(ap, format);
+    const int r=vsnprintf(txt+n, size-n, format, ap);
+    va_end(ap);
+    n=r<0 || n+r>=size ? size-1 : n+r;
+}
+
+// packets dropped by the kernel for lack of socket buffer, counted
+// since the socket was created
+static unsigned long long kernel_drops() {
+    unsigned long long drops=0;
+#if defined(__linux__) && defined(SO_MEMINFO) // Linux 4.12
+    for(unsigned w=0; w<nworkers; ++w) {
+        uint32_t meminfo[SK_MEMINFO_VARS];
+        socklen_t len=sizeof meminfo;
+        if(!getsockopt(workers[w]->s, SOL_SOCKET, SO_MEMINFO, meminfo, &len) &&
+                len>SK_MEMINFO_DROPS*sizeof(uint32_t))
+            drops+=meminfo[SK_MEMINFO_DROPS];
+    }
+#endif
+    return drops;
+}
+
+// write the statistics of all the workers in the Prometheus text format,
+// return the length of the text
+static size_t report(char *txt, const size_t size) {
+    static const char *const names[CACHE_CMD_STATS]={"new", "get", "remove"};
+    unsigned long long hits=0, misses=0, forwarded=0, dropped=0;
+    unsigned long long entries=0, limit=0, memory=0, evicted=0, expired=0;
+    unsigned long long tier_sessions=0, tier_bytes=0, demoted=0, promoted=0;
+    unsigned long long tier_dropped=0, skipped=0;
+    unsigned long long replicated=0, applied=0, lost=0, malformed=0;
+    unsigned long long shed[CACHE_CMD_STATS], backlogged=0;
+    unsigned long long missed[GHOST_REASONS], larger[GHOST_LARGER];
+    unsigned long long latency[CACHE_CMD_STATS][LATENCY_BUCKETS];
+    unsigned long long latency_ns[CACHE_CMD_STATS];
+    unsigned long long served[CACHE_CMD_STATS]; // requests of each type
+    SUM(hits, hits);
+    SUM(misses, misses);
+    SUM(forwarded, forwarded);
+    SUM(dropped, dropped);
+    SUM(entries, entries);
+    for(unsigned w=0; w<nworkers; ++w) // set by any thread, see limit()
+        limit+=workers[w]->data.limit();
+    SUM(memory, memory);
+    SUM(evicted, evicted);
+    SUM(expired, expired);
+    SUM(tier_sessions, tier_sessions);
+    SUM(tier_bytes, tier_bytes);
+    SUM(demoted, demoted);
+    SUM(promoted, promoted);
+    SUM(tier_dropped, tier_dropped);
+    SUM(skipped, skipped);
+    SUM(replicated, replicated);
+    SUM(applied, applied);
+    SUM(replica.lost, lost);
+    SUM(malformed, malformed);
+    for(unsigned w=0; w<nworkers; ++w)
+        backlogged+=workers[w]->admission.backlogged();
+    for(unsigned r=0; r<GHOST_REASONS; ++r) {
+        missed[r]=0;
+        SUM(missed[r], missed[r]);
+    }
+    for(unsigned i=0; i<GHOST_LARGER; ++i) {
+        larger[i]=0;
+        SUM(larger[i], larger[i]);
+    }
+    for(unsigned op=0; op<CACHE_CMD_STATS; ++op) {
+        latency_ns[op]=served[op]=shed[op]=0;
+        SUM(shed[op], shed[op]);
+        SUM(latency_ns[op], latency_ns[op]);
+        for(unsigned b=0; b<LATENCY_BUCKETS; ++b) {
+            latency[op][b]=0;
+            SUM(latency[op][b], latency[op][b]);
+            served[op]+=latency[op][b];
+        }
+    }
+    const struct {
+        const char *name, *type, *help;
+        unsigned long long value;
+        bool tier; // left out without a disk tier
+    } metrics[]={
+        {"hits_total", "counter", "GET requests finding a session", hits},
+        {"misses_total", "counter", "GET requests finding no session", misses},
+        {"inserts_total", "counter", "NEW requests served", served[CACHE_CMD_NEW]},
+        {"removes_total", "counter", "REMOVE requests served", served[CACHE_CMD_REMOVE]},
+        {"evictions_total", "counter", "Sessions dropped to stay within the limits", evicted},
+        {"expirations_total", "counter", "Sessions dropped once expired", expired},
+        {"tier_demotions_total", "counter", "Sessions evicted to the disk tier", demoted, true},
+        {"tier_promotions_total", "counter", "Sessions taken back from the disk tier", promoted, true},
+        {"tier_drops_total", "counter", "Sessions dropped from the full disk tier", tier_dropped, true},
+        {"tier_skips_total", "counter", "Disk tier segments skipped by their Bloom filter", skipped, true},
+        {"malformed_total", "counter", "Packets ignored as malformed", malformed},
+        {"kernel_drops_total", "counter", "Packets dropped by the kernel", kernel_drops()},
+        {"forwarded_total", "counter", "Requests queued for the owner of their key", forwarded},
+        {"forward_drops_total", "counter", "Requests dropped by overloaded owners", dropped},
+        {"replicated_total", "counter", "Operations sent to the peers", replicated},
+        {"applied_total", "counter", "Operations received from the peers", applied},
+        {"replication_lost_total", "counter", "Replication datagrams lost", lost},
+        {"entries", "gauge", "Sessions cached", entries},
+        {"entries_limit", "gauge", "Sessions cached at most", limit},
+        {"memory_bytes", "gauge", "Memory allocated for the sessions", memory},
+        {"tier_sessions", "gauge", "Sessions on the disk tier, maybe expired", tier_sessions, true},
+        {"tier_bytes", "gauge", "Disk space taken by the disk tier", tier_bytes, true},
+        {"workers", "gauge", "Serving threads", nworkers},
+        {"backlogged_workers", "gauge", "Workers shedding NEW requests", backlogged},
+        {"start_time_seconds", "gauge", "Time the instance was started", (unsigned long long)start_time},
+    };
+    size_t n=0;
+    for(unsigned i=0; i<sizeof metrics/sizeof metrics[0]; ++i)
+        if(tiered || !metrics[i].tier)
+            append(txt, n, size, "# HELP sessiond_%s %s\n# TYPE sessiond_%s %s\n"
+                "sessiond_%s %llu\n", metrics[i].name, metrics[i].help,
+                metrics[i].name, metrics[i].type, metrics[i].name, metrics[i].value);
+    append(txt, n, size, "# HELP sessiond_shed_total Requests shed by "
+        "admission control\n# TYPE sessiond_shed_total counter\n");
+    for(unsigned op=0; op<CACHE_CMD_STATS; ++op)
+        append(txt, n, size, "sessiond_shed_total{op=\"%s\"} %llu\n",
+            names[op], shed[op]);
+    append(txt, n, size, "# HELP sessiond_miss_reasons_total GET misses, by "
+        "why the session is gone\n"
+        "# TYPE sessiond_miss_reasons_total counter\n");
+    for(unsigned r=0; r<GHOST_REASONS; ++r)
+        append(txt, n, size, "sessiond_miss_reasons_total{reason=\"%s\"} %llu\n",
+            reasons[r], missed[r]);
+    append(txt, n, size, "# HELP sessiond_larger_hits_total Misses a cache "
+        "larger by the ratio would have hit\n"
+        "# TYPE sessiond_larger_hits_total counter\n");
+    for(unsigned i=0; i<GHOST_LARGER; ++i)
+        append(txt, n, size, "sessiond_larger_hits_total{larger=\"%g\"} %llu\n",
+            ghost_larger[i]/100.0, larger[i]);
+    append(txt, n, size, "# HELP sessiond_service_seconds Time taken to serve "
+        "a request\n"
+        "# TYPE sessiond_service_seconds histogram\n");
+    for(unsigned op=0; op<CACHE_CMD_STATS; ++op) {
+        unsigned long long count=0;
+        for(unsigned b=0; b<LATENCY_BUCKETS; ++b) {
+            count+=latency[op][b];
+            if(b<LATENCY_BUCKETS-1 && !latency[op][b])
+                continue; // the count of the previous bucket, left out
+            if(b<LATENCY_BUCKETS-1)
+                append(txt, n, size, "sessiond_service_seconds_bucket"
+                    "{op=\"%s\",le=\"%g\"} %llu\n", names[op],
+                    latency_bounds[b]/1e9, count);
+            else
+                append(txt, n, size, "sessiond_service_seconds_bucket"
+                    "{op=\"%s\",le=\"+Inf\"} %llu\n", names[op], count);
+        }
+        append(txt, n, size, "sessiond_service_seconds_sum{op=\"%s\"} %.9f\n"
+            "sessiond_service_seconds_count{op=\"%s\"} %llu\n",
+            names[op], latency_ns[op]/1e9, names[op], count);
+    }
+    return n;
+}
+
+static bool same_item(const SKETCH_ENTRY &a, const SKETCH_ENTRY &b) {
+    return a.hash==b.hash && a.len==b.len && !memcmp(a.item, b.item, a.len);
+}
+
+static bool by_hash(const SKETCH_ENTRY &a, const SKETCH_ENTRY &b) {
+    return a.hash<b.hash;
+}
+
+static bool by_count(const SKETCH_ENTRY &a, const SKETCH_ENTRY &b) {
+    return a.count>b.count;
+}
+
+// write the busiest sources and session IDs of each kind of request,
+// their counts summed over all the workers, return the length of the text
+static size_t busiest(char *txt, const size_t size) {
+    size_t n=0;
+    append(txt, n, size, "# estimated requests, halved every %d seconds\n",
+        SKETCH_HALF);
+    vector<SKETCH_ENTRY> all;
+    SKETCH_ENTRY part[SKETCH_TOP];
+    for(unsigned by=0; by<2; ++by)
+        for(unsigned k=0; k<SAMPLE_KINDS; ++k) {
+            all.clear();
+            for(unsigned w=0; w<nworkers; ++w) {
+                const SKETCH &s=by ? workers[w]->keys[k] : workers[w]->sources[k];
+                all.insert(all.end(), part, part+s.read(part));
+            }
+            // an item busy on several workers is summed
+            sort(all.begin(), all.end(), by_hash);
+            size_t m=0;
+            for(size_t i=0; i<all.size(); ++i)
+                if(m && same_item(all[m-1], all[i]))
+                    all[m-1].count+=all[i].count;
+                else
+                    all[m++]=all[i];
+            all.resize(m);
+            sort(all.begin(), all.end(), by_count);
+            for(size_t i=0; i<all.size() && i<BUSIEST_SHOWN; ++i) {
+                const SKETCH_ENTRY &e=all[i];
+                if(by) {
+                    char hex[2*KEY_LEN+1];
+                    for(unsigned j=0; j<KEY_LEN; ++j)
+                        snprintf(hex+2*j, 3, "%02x", e.item[j]);
+                    append(txt, n, size, "session %s %s %u\n", kinds[k],
+                        hex, e.count);
+                } else {
+                    struct in_addr a;
+                    memcpy(&a, e.item, sizeof a);
+                    append(txt, n, size, "source %s %s %u\n", kinds[k],
+                        inet_ntoa(a), e.count);
+                }
+            }
+        }
+    return n;
+}
+
 void my_perror(const char *txt) {
 #ifdef __WIN32__
     fprintf(stderr, "%s: error %d: %s\n",
@@ -19,14 +19,431 @@
 // the GNU General Public License cover the whole combination.
 
 #include "data.h"
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define GROUP_SIZE 16
+#define INITIAL_GROUPS 64
+#define CTRL_EMPTY ((int8_t)-128)
+#define CTRL_DELETED ((int8_t)-2)
+
+// session IDs are random, so the key bits themselves are used as the hash:
+// the low bits select the first group, the top 7 bits are kept in ctrl
+static inline uint64_t key_hash(const unsigned char *k) {
+    uint64_t w[KEY_LEN/8];
+    memcpy(w, k, KEY_LEN);
+    return w[0]^w[1]^w[2]^w[3];
+}
+
+static inline int8_t key_tag(const uint64_t h) {
+    return (int8_t)(h>>57);
+}
+
+// bit mask of control bytes within the group equal to c
+static inline unsigned match(const int8_t *g, const int8_t c) {
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(
+        _mm_loadu_si128((const __m128i *)g), _mm_set1_epi8(c)));
+#else
+    unsigned m=0;
+    for(unsigned i=0; i<GROUP_SIZE; ++i)
+        if(g[i]==c)
+            m|=1u<<i;
+    return m;
+#endif
+}
+
+// bit mask of empty or deleted control bytes (both have the sign bit set)
+static inline unsigned match_free(const int8_t *g) {
+#ifdef __SSE2__
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)g));
+#else
+    unsigned m=0;
+    for(unsigned i=0; i<GROUP_SIZE; ++i)
+        if(g[i]<0)
+            m|=1u<<i;
+    return m;
+#endif
+}
+
+static void key2mem(unsigned char *dst, const BYTES &k) {
+    const size_t l=k.size()<KEY_LEN ? k.size() : KEY_LEN;
+    memset(dst, 0, KEY_LEN);
+    if(l)
+        memcpy(dst, &k[0], l);
+}
+
+DATA::DATA(const size_t n, const size_t b, const int p) : capacity(n), requested(n), budget(b),
+        charged(0), policy(p), hand(0), evictions(0), expirations(0), groups(INITIAL_GROUPS), used(0),
+        deleted(0), old_groups(0), old_ctrl(NULL), old_slots(NULL), migrated(0),
+        generation(0), index_groups(0), spare_ctrl(NULL), spare_slots(NULL), payload(0),
+        wheel(entries, time(NULL)), now(time(NULL)), tier(NULL), ghosts(n) {
+    ctrl=new int8_t[groups*GROUP_SIZE];
+    memset(ctrl, CTRL_EMPTY, groups*GROUP_SIZE);
+    slots=new uint32_t[groups*GROUP_SIZE];
+    memset(readers, 0, sizeof readers);
+}
+
+DATA::~DATA() {
+    if(!index_memory.owns(ctrl)) {
+        delete[] ctrl;
+        delete[] slots;
+    }
+    if(old_ctrl && !index_memory.owns(old_ctrl)) {
+        delete[] old_ctrl;
+        delete[] old_slots;
+    }
+    for(size_t i=0; i<graves.size(); ++i) {
+        delete[] graves[i].ctrl;
+        delete[] graves[i].slots;
+    }
+}
+
+uint32_t DATA::lookup(const unsigned char *k) {
+    const uint64_t h=key_hash(k);
+    const uint32_t id=probe(k, h, ctrl, slots, groups, 0);
+    if(id!=ARENA_NONE || !old_ctrl)
+        return id;
+    return probe(k, h, old_ctrl, old_slots, old_groups, migrated);
+}
+
+// the entry of key k in an index of n groups, those below from excepted
+// (they have been migrated, what they still hold is stale)
+uint32_t DATA::probe(const unsigned char *k, const uint64_t h, const int8_t *c,
+        const uint32_t *s, const size_t n, const size_t from) {
+    const int8_t tag=key_tag(h);
+    size_t g=h&(n-1);
+    for(size_t step=1; ; ++step) { // triangular probing visits every group
+        const int8_t *cg=c+g*GROUP_SIZE;
+        if(g>=from)
+            for(unsigned m=match(cg, tag); m; m&=m-1) {
+                const uint32_t id=s[g*GROUP_SIZE+__builtin_ctz(m)];
+                if(!memcmp(entries[id].key, k, KEY_LEN))
+                    return id;
+            }
+        if(match(cg, CTRL_EMPTY)) // the key was never pushed past this group
+            return ARENA_NONE;
+        g=(g+step)&(n-1);
+    }
+}
+
+// index an entry in the current index; used is counted by the caller
+void DATA::place(const uint64_t h, const uint32_t id) {
+    size_t g=h&(groups-1);
+    for(size_t step=1; ; ++step) {
+        const unsigned m=match_free(ctrl+g*GROUP_SIZE);
+        if(m) {
+            const size_t n=g*GROUP_SIZE+__builtin_ctz(m);
+            if(ctrl[n]==CTRL_DELETED)
+                --deleted;
+            ctrl[n]=key_tag(h);
+            slots[n]=id;
+            return;
+        }
+        g=(g+step)&(groups-1);
+    }
+}
+
+// start moving the index into a new one of n groups: new entries go
+// there, and migrate() moves the old groups over a few at a time, so
+// that no single operation rebuilds the whole index
+void DATA::rehash(const size_t n) {
+    if(old_ctrl) // still migrating, which the load factors make unlikely
+        migrate(old_groups);
+
+    // readers retry the lookups missing while the indexes are swapped
+    __atomic_store_n(&generation, generation+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    old_groups=groups;
+    old_ctrl=ctrl;
+    old_slots=slots;
+    migrated=0;
+    groups=n;
+    deleted=0;
+    if(n==index_groups && spare_ctrl) { // the preallocated copy
+        ctrl=spare_ctrl;
+        slots=spare_slots;
+        spare_ctrl=NULL;
+    } else {
+        ctrl=new int8_t[groups*GROUP_SIZE];
+        slots=new uint32_t[groups*GROUP_SIZE];
+    }
+    memset(ctrl, CTRL_EMPTY, groups*GROUP_SIZE);
+    __atomic_store_n(&generation, generation+1, __ATOMIC_RELEASE);
+}
+
+// move up to budget groups of the old index into the current one; their
+// control bytes are left as they were, so that the probes through them
+// still end where they did, and readers still find the entries there
+void DATA::migrate(size_t budget) {
+    if(!old_ctrl)
+        return;
+    for(; budget && migrated<old_groups; --budget, ++migrated)
+        for(size_t i=migrated*GROUP_SIZE; i<(migrated+1)*GROUP_SIZE; ++i)
+            if(old_ctrl[i]>=0)
+                place(key_hash(entries[old_slots[i]].key), old_slots[i]);
+    if(migrated<old_groups)
+        return;
+    int8_t *c=old_ctrl;
+    uint32_t *s=old_slots;
+    __atomic_store_n(&generation, generation+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    old_ctrl=NULL;
+    old_slots=NULL;
+    old_groups=migrated=0;
+    __atomic_store_n(&generation, generation+1, __ATOMIC_RELEASE);
+    if(index_memory.owns(c)) { // to be used by the next rehash
+        spare_ctrl=c;
+        spare_slots=s;
+    } else {
+        bury(c, s);
+    }
+}
+
+// free old index arrays once the readers that may be scanning them are gone
+void DATA::bury(int8_t *old_ctrl, uint32_t *old_slots) {
+    GRAVE g;
+    g.ctrl=old_ctrl;
+    g.slots=old_slots;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST); // the new index is published
+    for(unsigned r=0; r<DATA_READERS; ++r)
+        g.seen[r]=__atomic_load_n(&readers[r].active, __ATOMIC_ACQUIRE);
+    graves.push_back(g);
+}
+
+// drop entry id of key hash h from an index of n groups, those below
+// from excepted; -1 if it is not there, 1 if a tombstone was left
+int DATA::unindex(const uint64_t h, const uint32_t id, int8_t *c,
+        const uint32_t *s, const size_t n, const size_t from) {
+    size_t g=h&(n-1);
+    for(size_t step=1; ; ++step) { // find the slot holding this entry
+        if(g>=from)
+            for(unsigned m=match(c+g*GROUP_SIZE, key_tag(h)); m; m&=m-1) {
+                const size_t i=g*GROUP_SIZE+__builtin_ctz(m);
+                if(s[i]!=id)
+                    continue;
+                // a group with an empty slot never ended a probe,
+                // so no tombstone is needed
+                if(match(c+g*GROUP_SIZE, CTRL_EMPTY)) {
+                    c[i]=CTRL_EMPTY;
+                    return 0;
+                }
+                c[i]=CTRL_DELETED;
+                return 1;
+            }
+        if(match(c+g*GROUP_SIZE, CTRL_EMPTY))
+            return -1;
+        g=(g+step)&(n-1);
+    }
+}
+
+// drop an entry from the index and free its storage
+void DATA::release(const uint32_t id) {
+    ENTRY &e=entries[id];
+    const uint64_t h=key_hash(e.key);
+    const int r=unindex(h, id, ctrl, slots, groups, 0);
+    if(r>0)
+        ++deleted;
+    else if(r<0) // not migrated yet
+        unindex(h, id, old_ctrl, old_slots, old_groups, migrated);
+    --used;
+    payload-=KEY_LEN+e.len;
+    charged-=charge(e.len);
+    const RETIRED v={e.val, e.len};
+    retired.push_back(v); // freed by reclaim()
+    __atomic_store_n(&e.seq, e.seq+1, __ATOMIC_RELEASE); // odd: free
+    entries.free(id);
+}
+
+// unlink an entry from the wheel and release it
+void DATA::remove(const uint32_t id) {
+    wheel.unlink(id);
+    release(id);
+}
+
+// drop an entry to stay within the limits, demoting it to the tier if
+// any; false for ARENA_NONE
+bool DATA::evict(const uint32_t id) {
+    if(id==ARENA_NONE)
+        return false;
+    const ENTRY &e=entries[id];
+    ghosts.prefetch(e.key);
+    if(tier)
+        tier->store(e.key, values.ptr(e.val, e.len), e.len, e.t, now);
+    remove(id);
+    ghosts.add(e.key, GHOST_EVICTED, ++evictions);
+    return true;
+}
+
+// release an entry that has expired, a free entry keeps its key
+void DATA::expire(const uint32_t id) {
+    ghosts.prefetch(entries[id].key); // fetched while the entry is unlinked
+    remove(id);
+    ghosts.add(entries[id].key, GHOST_EXPIRED, evictions);
+    ++expirations;
+}
+
+// take the session of key k back from the tier, false if it is not there;
+// it stays on the tier unless it could be stored in memory
+bool DATA::promote(const unsigned char *k) {
+    unsigned char v[MAX_VAL_LEN];
+    unsigned len;
+    time_t t;
+    if(!tier || !tier->find(k, v, len, t, now))
+        return false;
+    store(k, v, len, t, true);
+    return true;
+}
+
+// bytes taken by a session with a value of len bytes
+size_t DATA::charge(const unsigned len) const {
+    return sizeof(ENTRY)+values.chunk_size(len);
+}
+
+// would the index and the entries exceed the budget with extra bytes more
+bool DATA::over_budget(const size_t extra) const {
+    return budget &&
+        groups*GROUP_SIZE*(sizeof(int8_t)+sizeof(uint32_t))+charged+extra>budget;
+}
+
+// the session to drop when a limit is reached, used>0; ARENA_NONE
+// if none was found within a bounded time
+uint32_t DATA::victim() {
+    if(policy==EVICT_EXPIRY)
+        return wheel.earliest();
+    // CLOCK: sessions found since the hand last passed get another round,
+    // new ones are not referenced, so a burst of them cannot flush the rest;
+    // the hand moves CLOCK_SWEEP entries at most, then the next session
+    // goes regardless, or if it is in a run of free entries (those left
+    // by a lowered limit), none does this time
+    for(unsigned step=0; ; ++step) {
+        if(hand>=entries.end())
+            hand=0;
+        const uint32_t id=hand++;
+        ENTRY &e=entries[id];
+        if(!(e.flags&ENTRY_USED)) {
+            if(step>=CLOCK_SWEEP)
+                return ARENA_NONE;
+            continue;
+        }
+        if(!(e.flags&ENTRY_REFERENCED) || step>=CLOCK_SWEEP)
+            return id;
+        __atomic_fetch_and(&e.flags, (uint16_t)~ENTRY_REFERENCED, __ATOMIC_RELAXED);
+    }
+}
 
 const bool DATA::find(const BYTES &k, BYTES &v) {
-	map<BYTES, ITEM>::iterator it = storage.find(k);
-	if (it == storage.end()) return false;
-	
-	v = (*it).second.v;
-	return true;
-    //return storage[k].v;
+    unsigned char key[KEY_LEN];
+    key2mem(key, k);
+    const unsigned char *p;
+    unsigned len;
+    if(!find(key, p, len))
+        return false;
+    v.assign(p, p+len);
+    return true;
+}
+
+// point v at the cached value of key k, the value stays in place
+// until reclaim() is called, even if the session is removed before
+const bool DATA::find(const unsigned char *k, const unsigned char *&v, unsigned &len) {
+    uint32_t id=lookup(k);
+    if(id!=ARENA_NONE && entries[id].t<now) { // expired, but not reaped yet
+        expire(id);
+        id=ARENA_NONE;
+    }
+    if(id==ARENA_NONE && (!promote(k) || (id=lookup(k))==ARENA_NONE))
+        return false;
+    ENTRY &e=entries[id];
+    __atomic_fetch_or(&e.flags, ENTRY_REFERENCED, __ATOMIC_RELAXED);
+    v=values.ptr(e.val, e.len);
+    len=e.len;
+    return true;
+}
+
+// look key k up from a thread other than the owner, numbered reader,
+// and copy its value into v; nothing seen in the index is trusted
+// without the entry it leads to, an index being migrated is scanned
+// after the current one, and a miss is retried if either was swapped
+// meanwhile
+const bool DATA::read(const unsigned char *k, unsigned char *v, unsigned &len,
+        const unsigned reader) {
+    READER &r=readers[reader];
+    __atomic_add_fetch(&r.active, 1, __ATOMIC_SEQ_CST); // odd: inside
+    const uint64_t h=key_hash(k);
+    int found;
+    for(;;) {
+        const unsigned gen=__atomic_load_n(&generation, __ATOMIC_SEQ_CST);
+        if(gen&1)
+            continue;
+        const size_t n=__atomic_load_n(&groups, __ATOMIC_RELAXED);
+        const int8_t *c=__atomic_load_n(&ctrl, __ATOMIC_RELAXED);
+        const uint32_t *s=__atomic_load_n(&slots, __ATOMIC_RELAXED);
+        const size_t on=__atomic_load_n(&old_groups, __ATOMIC_RELAXED);
+        const int8_t *oc=__atomic_load_n(&old_ctrl, __ATOMIC_RELAXED);
+        const uint32_t *os=__atomic_load_n(&old_slots, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&generation, __ATOMIC_RELAXED)!=gen)
+            continue;
+        found=scan(k, h, n, c, s, v, len);
+        if(!found && oc)
+            found=scan(k, h, on, oc, os, v, len);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(found || __atomic_load_n(&generation, __ATOMIC_RELAXED)==gen)
+            break;
+    }
+    __atomic_add_fetch(&r.active, 1, __ATOMIC_RELEASE); // even: outside
+    return found>0;
+}
+
+// probe an index of n groups as read() does, return 1 if the key was
+// copied, 0 if it is not in that index, -1 if it is not live
+int DATA::scan(const unsigned char *k, const uint64_t h, const size_t n,
+        const int8_t *c, const uint32_t *s, unsigned char *v, unsigned &len) {
+    const int8_t tag=key_tag(h);
+    const uint32_t top=entries.end();
+    size_t g=h&(n-1);
+    for(size_t step=1; step<=n; ++step) { // bounded, the arrays may be reused
+        const int8_t *cg=c+g*GROUP_SIZE;
+        for(unsigned m=match(cg, tag); m; m&=m-1) {
+            const uint32_t id=s[g*GROUP_SIZE+__builtin_ctz(m)];
+            if(id<top) {
+                const int r=copy(id, k, v, len);
+                if(r)
+                    return r;
+            }
+        }
+        if(match(cg, CTRL_EMPTY))
+            return 0;
+        g=(g+step)&(n-1);
+    }
+    return 0;
+}
+
+// copy entry id out if it holds the live session of key k: 1 if so,
+// 0 if it holds another key, -1 if it is being changed or has expired
+int DATA::copy(const uint32_t id, const unsigned char *k, unsigned char *v,
+        unsigned &len) {
+    ENTRY &e=entries[id];
+    const uint32_t seq=__atomic_load_n(&e.seq, __ATOMIC_ACQUIRE);
+    if(seq&1) // free, or written by the owner right now
+        return 0;
+    if(memcmp(e.key, k, KEY_LEN))
+        return 0;
+    const uint32_t val=e.val;
+    const unsigned l=e.len;
+    const time_t t=e.t;
+    const bool valid=values.holds(val, l);
+    if(valid && l)
+        memcpy(v, values.ptr(val, l), l);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(__atomic_load_n(&e.seq, __ATOMIC_RELAXED)!=seq || !valid ||
+            t<__atomic_load_n(&now, __ATOMIC_RELAXED))
+        return -1; // removed or expired meanwhile
+    __atomic_fetch_or(&e.flags, ENTRY_REFERENCED, __ATOMIC_RELAXED);
+    len=l;
+    return 1;
 }
 
 /*const unsigned DATA::count(const BYTES &k) {
@@ -34,47 +451,261 @@ const bool DATA::find(const BYTES &k, BYTES &v) {
 }*/
 
 const unsigned DATA::size() {
-    return storage.size();
+    return used;
 }
 
 void DATA::insert(const BYTES &k, const BYTES &v, const unsigned timeout) {
-    const time_t t=time(NULL);
-    cleanup(t); // purge expired entries
-    if(storage.count(k)) // the session is already in cache
+    unsigned char key[KEY_LEN];
+    key2mem(key, k);
+    insert(key, v.empty() ? NULL : &v[0], v.size(), timeout);
+}
+
+void DATA::insert(const unsigned char *k, const unsigned char *v,
+        const unsigned len, const unsigned timeout) {
+    restore(k, v, len, now+timeout);
+}
+
+// insert a session expiring at time t, as saved by a previous instance
+void DATA::restore(const unsigned char *k, const unsigned char *v,
+        const unsigned len, const time_t t) {
+    store(k, v, len, t, false);
+}
+
+// insert a session expiring at time t, removing the copies of the key
+// on the tier once it is stored; promoted if it was taken from there
+void DATA::store(const unsigned char *k, const unsigned char *v,
+        const unsigned len, const time_t t, const bool promoted) {
+    if(t<now) // expired while sessiond was down
+        return;
+    uint32_t id=lookup(k);
+    if(id!=ARENA_NONE) {
+        if(entries[id].t>=now) // the session is already in cache
+            return;
+        remove(id); // replace an expired session
+        ++expirations;
+    }
+    if(len>MAX_VAL_LEN)
+        return;
+    migrate(REHASH_STEP);
+    // enforce cache size limits (DoS protection), one session at a time;
+    // what a lowered limit leaves over is worked off by later calls
+    for(unsigned n=0; used && n<EVICT_BUDGET &&
+            (used>=capacity || over_budget(charge(len))); ++n)
+        if(!evict(victim()))
+            break;
+    id=entries.alloc();
+    if(id==ARENA_NONE)
         return;
-    ITEM i={t+timeout, v};
-    storage[k]=i;
-    log[t+timeout].insert(k);
+    const uint32_t val=values.alloc(len);
+    if(val==SLAB_NONE) { // out of memory
+        entries.free(id);
+        return;
+    }
+    ENTRY &e=entries[id];
+    // the entry is free (odd) since its release, which readers must see
+    // before the entry and its value chunk are written again
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    e.val=val;
+    memcpy(e.key, k, KEY_LEN);
+    if(len)
+        memcpy(values.ptr(e.val, len), v, len);
+    e.len=len;
+    e.t=t;
+    __atomic_store_n(&e.seq, e.seq+1, __ATOMIC_RELEASE); // even: live
+    charged+=charge(len);
+
+    // keep the load factor (including tombstones) below 7/8
+    if((used+deleted+1)*8>groups*GROUP_SIZE*7)
+        rehash((used+1)*2>groups*GROUP_SIZE ? groups*2 : groups);
+    place(key_hash(k), id);
+    ++used;
+    payload+=KEY_LEN+len;
+    wheel.link(id);
+    ghosts.forget(k);
+    if(tier) // an older copy may have been demoted
+        tier->erase(k, now, promoted);
+}
+
+// size the index for n sessions, so that loading them does not rehash
+void DATA::reserve(const size_t n) {
+    size_t g=groups;
+    while((n+1)*8>g*GROUP_SIZE*7)
+        g*=2;
+    if(g>groups) {
+        rehash(g);
+        migrate(~(size_t)0); // before serving
+    }
+}
+
+// reserve the memory of capacity sessions up front: the index at its
+// final size, the entries, and the values (the memory limit left, or
+// PREALLOC_VALUE bytes per session without one); false with errno set
+bool DATA::preallocate(const unsigned flags) {
+    size_t g=INITIAL_GROUPS;
+    while((capacity+1)*8>g*GROUP_SIZE*7)
+        g*=2;
+    const size_t ctrl_bytes=g*GROUP_SIZE*sizeof(int8_t);
+    const size_t slot_bytes=g*GROUP_SIZE*sizeof(uint32_t);
+    const size_t blocks=(capacity+1+(1u<<ARENA_BLOCK_BITS)-1)>>ARENA_BLOCK_BITS;
+    const size_t entry_bytes=blocks*(sizeof(ENTRY)<<ARENA_BLOCK_BITS);
+    size_t value_bytes=capacity*PREALLOC_VALUE;
+    if(budget)
+        value_bytes=budget>ctrl_bytes+slot_bytes+entry_bytes ?
+            budget-ctrl_bytes-slot_bytes-entry_bytes : 0;
+    if(!index_memory.map(2*(ctrl_bytes+slot_bytes), flags) ||
+            !entry_memory.map(entry_bytes, flags) ||
+            !value_memory.map(value_bytes, flags))
+        return false;
+    entries.place(&entry_memory);
+    values.place(&value_memory);
+    index_groups=g;
+    spare_ctrl=(int8_t *)index_memory.take(ctrl_bytes);
+    spare_slots=(uint32_t *)index_memory.take(slot_bytes);
+    rehash(g);
+    migrate(~(size_t)0);
+    spare_ctrl=(int8_t *)index_memory.take(ctrl_bytes);
+    spare_slots=(uint32_t *)index_memory.take(slot_bytes);
+    return true;
+}
+
+const size_t DATA::reserved(bool &hugetlb) {
+    hugetlb=index_memory.hugetlb() && entry_memory.hugetlb() &&
+        (value_memory.hugetlb() || !value_memory.bytes());
+    return index_memory.bytes()+entry_memory.bytes()+value_memory.bytes();
+}
+
+const size_t DATA::limit() {
+    return __atomic_load_n(&capacity, __ATOMIC_RELAXED);
+}
+
+// change the number of sessions kept at most, from any thread: the
+// owner adopts it on its next tick(), and evicts the sessions above it
+// and shrinks the index a bounded amount at a time
+void DATA::limit(const size_t n) {
+    __atomic_store_n(&requested, n, __ATOMIC_RELAXED);
+}
+
+const int DATA::missed(const unsigned char *k, uint64_t &since) {
+    return ghosts.find(k, __atomic_load_n(&evictions, __ATOMIC_RELAXED), since);
+}
+
+void DATA::overflow(TIER *t) {
+    tier=t;
+}
+
+const uint32_t DATA::ids() {
+    return entries.end();
+}
+
+// the session with the given ID, false if it is not live
+const bool DATA::get(const uint32_t id, const unsigned char *&k,
+        const unsigned char *&v, unsigned &len, time_t &t) {
+    const ENTRY &e=entries[id];
+    if(!(e.flags&ENTRY_USED) || e.t<now)
+        return false;
+    k=e.key;
+    v=values.ptr(e.val, e.len);
+    len=e.len;
+    t=e.t;
+    return true;
 }
 
 void DATA::erase(const BYTES &k) {
-    if(!storage.count(k)) // the session is not in cache
-        return;
-    const time_t t=storage[k].t;
-    log[t].erase(k);
-    if(log[t].empty()) // no more entries for this second
-        log.erase(t);
-    storage.erase(k);
+    unsigned char key[KEY_LEN];
+    key2mem(key, k);
+    erase(key);
 }
 
+void DATA::erase(const unsigned char *k) {
+    ghosts.prefetch(k);
+    const uint32_t id=lookup(k);
+    if(id!=ARENA_NONE) {
+        remove(id);
+        ghosts.add(k, GHOST_REMOVED, evictions);
+    }
+    if(tier) // an older copy may have been demoted
+        tier->erase(k, now);
+}
+
+// advance the clock and release a bounded number of expired entries
+void DATA::tick(const time_t t) {
+    if(t>now) // never let the clock go backwards
+        __atomic_store_n(&now, t, __ATOMIC_RELAXED);
+    __atomic_store_n(&capacity, __atomic_load_n(&requested, __ATOMIC_RELAXED),
+        __ATOMIC_RELAXED);
+    unsigned budget=EXPIRE_BUDGET;
+    for(uint32_t id; (id=wheel.expired(now, budget))!=ARENA_NONE; )
+        expire(id);
+    for(unsigned n=0; used && n<EVICT_BUDGET && used>capacity; ++n)
+        if(!evict(victim()))
+            break;
+    migrate(REHASH_STEP);
+    // halve an index left mostly empty, down to its preallocated size
+    if(!old_ctrl && groups>INITIAL_GROUPS && groups>index_groups &&
+            (used+1)*32<groups*GROUP_SIZE*7)
+        rehash(groups/2);
+    if(tier)
+        tier->tick(now);
+}
+
+// advance the clock and release all expired entries
 void DATA::cleanup(const time_t t) {
-    typedef map<time_t, set<BYTES> >::iterator log_iterator;
-    typedef set<BYTES>::iterator set_iterator;
-
-    // erase expired entries
-    log_iterator begin=log.begin(), end=log.lower_bound(t);
-    for(log_iterator i=begin; i!=end; ++i) // erase expired data entries
-        for(set_iterator j=i->second.begin(); j!=i->second.end(); ++j)
-            storage.erase(*j);
-    log.erase(begin, end); // erase all log entries expiring within the range
-
-    // enforce cache size limit (DoS protection)
-    while(storage.size()>MAX_CONCURRENT_SESSIONS) {
-        log_iterator i=log.begin(); // earliest second
-        for(set_iterator j=i->second.begin(); j!=i->second.end(); ++j)
-            storage.erase(*j);
-        log.erase(i); // erase all log entires expiring within 1 second
+    if(t>now)
+        __atomic_store_n(&now, t, __ATOMIC_RELAXED);
+    __atomic_store_n(&capacity, __atomic_load_n(&requested, __ATOMIC_RELAXED),
+        __ATOMIC_RELAXED);
+    unsigned budget=~0u;
+    for(uint32_t id; (id=wheel.expired(now, budget))!=ARENA_NONE; )
+        expire(id);
+
+    // enforce cache size limits (DoS protection)
+    while(used && (used>capacity || over_budget(0)))
+        evict(victim());
+    if(tier)
+        tier->tick(now);
+}
+
+// free the values released since the last call, once no reply
+// referring to them is being sent any more
+void DATA::reclaim() {
+    if(!retired.empty()) // the entries were freed before their chunks
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    for(size_t i=0; i<retired.size(); ++i)
+        values.free(retired[i].val, retired[i].len);
+    retired.clear(); // the capacity is kept
+    for(size_t i=0; i<graves.size(); ) {
+        GRAVE &g=graves[i];
+        unsigned r=0;
+        for(; r<DATA_READERS; ++r)
+            if(g.seen[r]&1 && __atomic_load_n(&readers[r].active,
+                    __ATOMIC_ACQUIRE)==g.seen[r])
+                break; // still inside the same read()
+        if(r<DATA_READERS) {
+            ++i;
+            continue;
+        }
+        delete[] g.ctrl;
+        delete[] g.slots;
+        g=graves.back();
+        graves.pop_back();
     }
 }
 
+const size_t DATA::memory() {
+    return (groups+old_groups)*GROUP_SIZE*(sizeof(int8_t)+sizeof(uint32_t))+
+        entries.memory()+values.memory();
+}
+
+const size_t DATA::overhead() {
+    return used ? (memory()-payload)/used : 0;
+}
+
+const unsigned long long DATA::evicted() {
+    return evictions;
+}
+
+const unsigned long long DATA::expired() {
+    return expirations;
+}
+
 // end of data.cpp
@@ -20,34 +20,192 @@
 
 // common headers
 #include <time.h>
+#include <stdint.h>
+#include "arena.h"
+#include "slab.h"
+#include "wheel.h"
+#include "tier.h"
+#include "ghost.h"
 
 // STL headers
 #include <vector>
-#include <set>
-#include <map>
 using namespace std;
 
 // We need to be able to handle up to 2.5 million concurrent SSL connections
 static const size_t MAX_CONCURRENT_SESSIONS = 2500000;
 
+// bytes reserved per session for its value when preallocating without
+// a memory limit, a typical DER encoded session in its SLAB chunk
+#define PREALLOC_VALUE 256
+
+// expired entries released per tick, the rest is left for later ticks
+#define EXPIRE_BUDGET 32
+
+// entries evicted per insert or tick: enough to make room for the largest
+// session, the excess of a lowered limit is worked off over later calls
+#define EVICT_BUDGET 8
+
+// entries the CLOCK hand passes at most to find a victim
+#define CLOCK_SWEEP 1024
+
+// groups of an index being resized moved to the new one per insert or tick
+#define REHASH_STEP 8
+
+// eviction policies, applied when a limit would be exceeded
+#define EVICT_EXPIRY 0 // the session expiring first
+#define EVICT_CLOCK 1 // a session not found since the hand last passed it
+
+// threads that may read() a cache while its owner modifies it
+#define DATA_READERS 64
+
 // data definitions
 typedef vector<unsigned char> BYTES;
 
+// a thread reading a cache concurrently: active is odd while it is
+// inside read(), so that the index arrays it may scan are not freed
+typedef struct {
+    unsigned active;
+    char pad[64-sizeof(unsigned)];
+} READER;
+
+// index arrays replaced by rehash(), freed by reclaim() once every
+// reader inside read() at the time has left it
+typedef struct {
+    int8_t *ctrl;
+    uint32_t *slots;
+    unsigned seen[DATA_READERS]; // their active counts then
+} GRAVE;
+
+// a value released while a reply may still be sending it
+typedef struct {
+    uint32_t val; // SLAB reference
+    uint16_t len;
+} RETIRED;
+
 // DATA class
+//
+// A cache has a single writer, the worker owning it, which alone calls
+// the methods modifying it, find() included.  Other threads may look
+// sessions up at the same time with read(), which takes no lock and
+// writes nothing but the CLOCK reference bit: entries carry a sequence
+// number checked before and after their value is copied out, the index
+// a generation changed when it is swapped, and replaced index arrays are
+// only freed once no reader can still be scanning them.
+//
+// The index is resized incrementally: rehash() starts a new one, and
+// every insert and tick moves REHASH_STEP groups of the old one over,
+// so that no operation stalls for the whole index; lookups probe both
+// until the old one is empty.
+//
+// The sessions that leave the cache are remembered as GHOST fingerprints,
+// as many as the initial capacity, so that misses can be classified.
+//
+// Given an overflow TIER, the sessions evicted are demoted to it rather
+// than dropped, and find() takes those it misses back into memory;
+// read() only sees the sessions in memory.
 class DATA {
-    typedef struct {
-        time_t t;
-        BYTES v;
-    } ITEM;
-    map<BYTES, ITEM> storage;
-    map<time_t, set<BYTES> > log;
+    // open addressing hash table with SSE2 probed control bytes:
+    // slots are split into groups of 16, each with 16 control bytes,
+    // and hold the IDs of the session entries kept in the arena
+    size_t capacity; // maximum number of live entries
+    size_t requested; // the capacity set by limit(), adopted by tick()
+    size_t budget; // maximum bytes charged, 0 for no limit
+    size_t charged; // bytes of live entries and their value chunks
+    int policy;
+    uint32_t hand; // CLOCK hand, an entry ID
+    unsigned long long evictions;
+    unsigned long long expirations;
+    size_t groups; // always a power of 2
+    size_t used; // live entries
+    size_t deleted; // tombstones
+    int8_t *ctrl;
+    uint32_t *slots;
+    // the index being resized from, NULL when none: its groups below
+    // migrated have been moved to the current one
+    size_t old_groups;
+    int8_t *old_ctrl;
+    uint32_t *old_slots;
+    size_t migrated;
+    unsigned generation; // odd while the indexes are being swapped
+    READER readers[DATA_READERS];
+    vector<GRAVE> graves;
+    // preallocated memory, it outlives the allocators using it; the index
+    // has two copies, so that rehashing at the same size stays in place
+    REGION index_memory, entry_memory, value_memory;
+    size_t index_groups; // of either copy
+    int8_t *spare_ctrl; // the copy not in use
+    uint32_t *spare_slots;
+    ARENA entries; // keys and metadata
+    SLAB values; // DER encoded sessions
+    size_t payload; // bytes of keys and values stored
+    WHEEL wheel; // expiry times
+    time_t now; // coarse clock, advanced by tick()
+    // values released since the last reclaim(), they may still be sent
+    vector<RETIRED> retired;
+    TIER *tier; // where evicted sessions are demoted to, NULL for none
+    GHOST ghosts; // the keys of the sessions gone, to tell misses apart
+
+    uint32_t lookup(const unsigned char *);
+    uint32_t probe(const unsigned char *, const uint64_t, const int8_t *,
+        const uint32_t *, const size_t, const size_t);
+    int unindex(const uint64_t, const uint32_t, int8_t *, const uint32_t *,
+        const size_t, const size_t);
+    int scan(const unsigned char *, const uint64_t, const size_t,
+        const int8_t *, const uint32_t *, unsigned char *, unsigned &);
+    int copy(const uint32_t, const unsigned char *, unsigned char *, unsigned &);
+    void bury(int8_t *, uint32_t *);
+    void place(const uint64_t, const uint32_t);
+    void rehash(const size_t);
+    void migrate(size_t);
+    void release(const uint32_t);
+    void remove(const uint32_t);
+    void expire(const uint32_t);
+    bool evict(const uint32_t);
+    bool promote(const unsigned char *);
+    void store(const unsigned char *, const unsigned char *, const unsigned,
+        const time_t, const bool);
+    size_t charge(const unsigned) const;
+    bool over_budget(const size_t) const;
+    uint32_t victim();
 public:
+    DATA(const size_t=MAX_CONCURRENT_SESSIONS, const size_t=0,
+        const int=EVICT_CLOCK);
+    ~DATA();
     const bool find(const BYTES &, BYTES &);
+    const bool find(const unsigned char *, const unsigned char *&, unsigned &);
+    // from another thread than the owner, numbered below DATA_READERS,
+    // into a buffer of MAX_VAL_LEN bytes
+    const bool read(const unsigned char *, unsigned char *, unsigned &,
+        const unsigned);
+    // from any thread, why key k is not cached: a GHOST reason and, for
+    // an evicted session, the sessions evicted since
+    const int missed(const unsigned char *, uint64_t &);
     //const unsigned count(const BYTES &);
     const unsigned size();
     void insert(const BYTES &, const BYTES &, const unsigned);
+    void insert(const unsigned char *, const unsigned char *, const unsigned,
+        const unsigned);
+    void restore(const unsigned char *, const unsigned char *, const unsigned,
+        const time_t);
+    void reserve(const size_t);
+    bool preallocate(const unsigned);
+    const size_t reserved(bool &); // bytes preallocated, and if hugetlb
+    const size_t limit(); // sessions kept at most, as adopted by tick()
+    void limit(const size_t); // from any thread
+    void overflow(TIER *); // demote the sessions evicted to a tier on disk
+    // the live sessions are get(id) for some id below ids()
+    const uint32_t ids();
+    const bool get(const uint32_t, const unsigned char *&,
+        const unsigned char *&, unsigned &, time_t &);
     void erase(const BYTES &);
+    void erase(const unsigned char *);
+    void tick(const time_t);
     void cleanup(const time_t);
+    void reclaim();
+    const size_t memory(); // bytes allocated
+    const size_t overhead(); // bytes per session beyond its key and value
+    const unsigned long long evicted(); // sessions dropped to stay in limits
+    const unsigned long long expired(); // sessions dropped once expired
 };
 
 // end of data.h
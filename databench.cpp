@@ -0,0 +1,229 @@
+// sessiond - SSL session cache daemon, file databench.cpp
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+// Microbenchmarks of the DATA store: for every number of entries given on
+// the command line a fresh process fills a DATA instance and times its
+// operations in ns/op, and the growth of its resident set is reported per
+// entry.  The clock is simulated, so expiry is the same on every run:
+//   insert    N new sessions
+//   hit, miss find() of present and absent keys in random order
+//   erase     erase() of every session
+//   cleanup   cleanup() of N sessions expiring over 100 seconds,
+//             per session released
+//   expiry    insert() and tick() with sessions expiring after 1-60
+//             seconds, a second passing every N/60 inserts
+//   evict     insert() of 2N sessions into a capacity of N, timed once
+//             the cache is full, with the CLOCK and the expiry policies
+
+#include "data.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define RECLAIM 32 // operations between reclaim() calls, as in a batch
+#define TIMEOUT 3600
+#define SPREAD 100 // seconds over which the cleanup sessions expire
+#define EXPIRY 60 // maximum timeout of the expiry scenario
+
+static unsigned char *keys; // 2N keys, the second half is never inserted
+static unsigned char val[MAX_VAL_LEN];
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static long rss() { // bytes
+    long pages=0, resident=0;
+    FILE *f=fopen("/proc/self/statm", "r");
+    if(f) {
+        if(fscanf(f, "%ld %ld", &pages, &resident)!=2)
+            resident=0;
+        fclose(f);
+    }
+    return resident*sysconf(_SC_PAGESIZE);
+}
+
+// session IDs are random, the same session always gets the same key
+static void session_key(unsigned char *k, uint64_t x) {
+    for(unsigned i=0; i<KEY_LEN/8; ++i) { // splitmix64
+        uint64_t z=(x+=0x9e3779b97f4a7c15ULL);
+        z=(z^(z>>30))*0xbf58476d1ce4e5b9ULL;
+        z=(z^(z>>27))*0x94d049bb133111ebULL;
+        z^=z>>31;
+        memcpy(k+8*i, &z, 8);
+    }
+}
+
+static inline const unsigned char *key(const size_t i) {
+    return keys+i*KEY_LEN;
+}
+
+static inline unsigned len(const size_t i) { // DER sized
+    return 100+i*7919%151;
+}
+
+// a permutation of 0..n-1 visiting the keys in random order
+static inline size_t shuffled(const size_t i, const size_t n) {
+    return (i*2654435761u+12345)%n;
+}
+
+// start the simulated clock of a new instance, which is set to the
+// real time when constructed
+static time_t start_clock(DATA &data) {
+    const time_t t=time(NULL)+1;
+    data.tick(t);
+    return t;
+}
+
+static void fill(DATA &data, const size_t n, const unsigned timeout) {
+    for(size_t i=0; i<n; ++i)
+        data.insert(key(i), val, len(i), timeout);
+}
+
+static void run(const size_t n) {
+    session_key(val, 0);
+    keys=new unsigned char[2*n*KEY_LEN];
+    for(size_t i=0; i<2*n; ++i)
+        session_key(keys+i*KEY_LEN, i+1);
+    double insert, hit, miss, erase, cleanup, expiry, evict[2];
+    long rss_entry;
+    {
+        const long before=rss();
+        DATA data;
+        start_clock(data);
+        double start=now();
+        fill(data, n, TIMEOUT);
+        insert=(now()-start)*1e9/n;
+        rss_entry=(rss()-before)/(long)n;
+
+        const unsigned char *v;
+        unsigned l;
+        size_t found=0;
+        start=now();
+        for(size_t i=0; i<n; ++i)
+            found+=data.find(key(shuffled(i, n)), v, l);
+        hit=(now()-start)*1e9/n;
+        start=now();
+        for(size_t i=0; i<n; ++i)
+            found+=data.find(key(n+shuffled(i, n)), v, l);
+        miss=(now()-start)*1e9/n;
+        if(found!=n)
+            fprintf(stderr, "%lu of %lu sessions found\n",
+                (unsigned long)found, (unsigned long)n);
+
+        start=now();
+        for(size_t i=0; i<n; ++i) {
+            data.erase(key(shuffled(i, n)));
+            if(i%RECLAIM==RECLAIM-1)
+                data.reclaim();
+        }
+        erase=(now()-start)*1e9/n;
+        data.reclaim();
+    }
+    {
+        DATA data;
+        const time_t t0=start_clock(data);
+        for(size_t i=0; i<n; ++i)
+            data.insert(key(i), val, len(i), 1+i%SPREAD);
+        const double start=now();
+        for(time_t t=t0+1; t<=t0+SPREAD+1; ++t) { // expired once past
+            data.cleanup(t);
+            data.reclaim();
+        }
+        cleanup=(now()-start)*1e9/n;
+        if(data.size())
+            fprintf(stderr, "%u sessions left after cleanup\n", data.size());
+    }
+    {
+        DATA data;
+        time_t t=start_clock(data);
+        const size_t second=n/EXPIRY>0 ? n/EXPIRY : 1;
+        double start=0;
+        // fill the cache to its steady state first
+        for(size_t i=0; i<2*n; ++i) {
+            if(i==n)
+                start=now();
+            if(i%second==0)
+                data.tick(++t);
+            data.insert(key(i), val, len(i), 1+i%EXPIRY);
+            if(i%RECLAIM==RECLAIM-1)
+                data.reclaim();
+        }
+        expiry=(now()-start)*1e9/n;
+    }
+    for(int policy=EVICT_EXPIRY; policy<=EVICT_CLOCK; ++policy) {
+        DATA data(n, 0, policy);
+        start_clock(data);
+        fill(data, n, TIMEOUT);
+        const double start=now();
+        for(size_t i=n; i<2*n; ++i) {
+            data.insert(key(i), val, len(i), TIMEOUT);
+            if(i%RECLAIM==RECLAIM-1)
+                data.reclaim();
+        }
+        evict[policy]=(now()-start)*1e9/n;
+        if(data.evicted()!=n)
+            fprintf(stderr, "%llu sessions evicted\n", data.evicted());
+    }
+    printf("%9lu %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %8ld\n",
+        (unsigned long)n, insert, hit, miss, erase, cleanup, expiry,
+        evict[EVICT_CLOCK], evict[EVICT_EXPIRY], rss_entry);
+    delete[] keys;
+}
+
+int main(int argc, char *argv[]) {
+    if(argc<2) {
+        fprintf(stderr, "Usage: %s entries...\n", argv[0]);
+        return 1;
+    }
+    printf("%9s %8s %8s %8s %8s %8s %8s %8s %8s %8s\n", "entries",
+        "insert", "hit", "miss", "erase", "cleanup", "expiry",
+        "ev.clock", "ev.expir", "RSS/ent");
+    printf("%9s %62s %8s\n", "", "ns/op", "bytes");
+    fflush(stdout);
+    for(int i=1; i<argc; ++i) {
+        const size_t n=atol(argv[i]);
+        if(!n || n>MAX_CONCURRENT_SESSIONS) {
+            fprintf(stderr, "illegal number of entries: %s\n", argv[i]);
+            return 1;
+        }
+        const pid_t pid=fork(); // a fresh heap for the resident set size
+        if(pid==-1) {
+            perror("fork");
+            return 1;
+        }
+        if(!pid) {
+            run(n);
+            fflush(stdout);
+            _exit(0);
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        if(!WIFEXITED(status) || WEXITSTATUS(status))
+            return 1;
+    }
+    return 0;
+}
+
+// end of databench.cpp
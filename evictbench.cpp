@@ -0,0 +1,198 @@
+// sessiond - SSL session cache daemon, file evictbench.cpp
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+// Trace replay of the eviction policies: for every memory limit given on
+// the command line (in megabytes) the trace is replayed against a DATA
+// instance with each policy, and the GET hit ratios are compared.
+//
+// A trace has one request per line: "<second> <N|G|R> <session> <length>".
+// A GET that misses is followed by a full handshake, so the session is
+// inserted again.  Without -t a synthetic trace is used: returning clients
+// with Zipf distributed popularity, mixed with one-off clients that never
+// resume their sessions.
+
+#include "data.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <math.h>
+#include <algorithm>
+
+#define CLIENTS 200000 // returning clients
+#define ZIPF 0.9
+#define ONE_OFF 30 // percentage of handshakes by clients never seen again
+#define REQUESTS 2000000
+#define RATE 2000 // requests per second
+#define TIMEOUT 3600
+
+typedef struct {
+    uint32_t t; // seconds since the start of the trace
+    char op; // 'N', 'G' or 'R'
+    uint32_t session;
+    uint16_t len;
+} REQUEST;
+
+static vector<REQUEST> trace;
+
+// session IDs are random, the same session always gets the same key
+static void session_key(unsigned char *k, uint32_t session) {
+    uint64_t x=session;
+    for(unsigned i=0; i<KEY_LEN/8; ++i) { // splitmix64
+        uint64_t z=(x+=0x9e3779b97f4a7c15ULL);
+        z=(z^(z>>30))*0xbf58476d1ce4e5b9ULL;
+        z=(z^(z>>27))*0x94d049bb133111ebULL;
+        z^=z>>31;
+        memcpy(k+8*i, &z, 8);
+    }
+}
+
+static void add(const uint32_t t, const char op, const uint32_t session, const uint16_t len) {
+    const REQUEST r={t, op, session, len};
+    trace.push_back(r);
+}
+
+static void synthesize() {
+    vector<double> cdf(CLIENTS);
+    double sum=0;
+    for(unsigned i=0; i<CLIENTS; ++i)
+        cdf[i]=sum+=1/pow(i+1, ZIPF);
+    vector<uint32_t> last(CLIENTS, 0); // the current session of each client
+    uint32_t next=1; // 0 is no session yet
+    srand(1);
+    for(unsigned i=0; i<REQUESTS; ) {
+        const uint32_t t=i/RATE;
+        const uint16_t len=100+rand()%200;
+        if(rand()%100<ONE_OFF) {
+            add(t, 'N', next++, len);
+            ++i;
+            continue;
+        }
+        const double u=sum*rand()/RAND_MAX;
+        const unsigned c=lower_bound(cdf.begin(), cdf.end(), u)-cdf.begin();
+        if(c>=CLIENTS)
+            continue;
+        if(last[c]) { // an attempt to resume
+            add(t, 'G', last[c], len);
+        } else {
+            last[c]=next++;
+            add(t, 'N', last[c], len);
+        }
+        ++i;
+    }
+}
+
+static bool load(const char *name) {
+    FILE *f=fopen(name, "r");
+    if(!f) {
+        perror(name);
+        return false;
+    }
+    unsigned t, session, len;
+    char op;
+    while(fscanf(f, "%u %c %u %u", &t, &op, &session, &len)==4)
+        add(t, op, session, len>MAX_VAL_LEN ? MAX_VAL_LEN : len);
+    fclose(f);
+    return true;
+}
+
+// replay the trace, return the GET hit ratio
+static double replay(const size_t budget, const int policy, unsigned long long &evicted) {
+    DATA data(MAX_CONCURRENT_SESSIONS, budget, policy);
+    static unsigned char val[MAX_VAL_LEN];
+    const time_t start=time(NULL);
+    unsigned long long hits=0, gets=0;
+    unsigned char key[KEY_LEN];
+    for(size_t i=0; i<trace.size(); ++i) {
+        const REQUEST &r=trace[i];
+        data.tick(start+r.t);
+        session_key(key, r.session);
+        if(r.op=='N') {
+            data.insert(key, val, r.len, TIMEOUT);
+        } else if(r.op=='G') {
+            const unsigned char *v;
+            unsigned l;
+            ++gets;
+            if(data.find(key, v, l))
+                ++hits;
+            else // a full handshake
+                data.insert(key, val, r.len, TIMEOUT);
+        } else if(r.op=='R') {
+            data.erase(key);
+        }
+        data.reclaim();
+    }
+    evicted=data.evicted();
+    return gets ? 100.0*hits/gets : 0.0;
+}
+
+static void usage(const char *bin_path) {
+    fprintf(stderr, "Usage: %s [-t trace | -g] megabytes...\n", bin_path);
+    fprintf(stderr, "  -t trace  replay this trace instead of a synthetic one\n");
+    fprintf(stderr, "  -g        write the synthetic trace to stdout\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *name=NULL;
+    bool dump=false;
+    int opt;
+    while((opt=getopt(argc, argv, "t:g"))!=-1) {
+        switch(opt) {
+        case 't':
+            name=optarg;
+            break;
+        case 'g':
+            dump=true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if(dump) {
+        synthesize();
+        for(size_t i=0; i<trace.size(); ++i)
+            printf("%u %c %u %u\n", trace[i].t, trace[i].op,
+                trace[i].session, trace[i].len);
+        return 0;
+    }
+    if(optind==argc) {
+        usage(argv[0]);
+        return 1;
+    }
+    if(name) {
+        if(!load(name))
+            return 1;
+    } else {
+        synthesize();
+    }
+    printf("%8s %22s %22s\n", "limit", "expiry hits/evicted", "clock hits/evicted");
+    for(int i=optind; i<argc; ++i) {
+        const size_t budget=(size_t)atol(argv[i])<<20;
+        unsigned long long e_expiry, e_clock;
+        const double h_expiry=replay(budget, EVICT_EXPIRY, e_expiry);
+        const double h_clock=replay(budget, EVICT_CLOCK, e_clock);
+        printf("%6sMB %12.2f%% %8llu %12.2f%% %8llu\n", argv[i],
+            h_expiry, e_expiry, h_clock, e_clock);
+    }
+    return 0;
+}
+
+// end of evictbench.cpp
@@ -0,0 +1,131 @@
+// sessiond - SSL session cache daemon, file ghost.cpp
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+#include "ghost.h"
+#include "protocol.h"
+#include <stdlib.h>
+#include <string.h>
+
+// stamps are kept modulo 2^14 units, 16 times the capacity at least
+#define STAMP_MASK 0x3fffu
+
+// room for n ghosts or up to twice that, lazily zeroed by the system
+GHOST::GHOST(const size_t n) : sets(1), shift(0), hand(0) {
+    while(sets*GHOST_WAYS<n)
+        sets*=2;
+    while(n>>shift>=1024)
+        ++shift;
+    slots=(uint32_t *)calloc(sets*GHOST_WAYS, sizeof(uint32_t));
+    if(!slots)
+        sets=0;
+}
+
+GHOST::~GHOST() {
+    free(slots);
+}
+
+// the set of key k and its fingerprint; the keys are random session IDs,
+// folded and mixed (the murmur3 finalizer) only not to trust that
+uint32_t *GHOST::set(const unsigned char *k, uint32_t &fp) const {
+    uint64_t w[KEY_LEN/8];
+    memcpy(w, k, KEY_LEN);
+    uint64_t h=w[0]^w[1]^w[2]^w[3];
+    h=(h^(h>>33))*0xff51afd7ed558ccdULL;
+    h=(h^(h>>33))*0xc4ceb9fe1a85ec53ULL;
+    h^=h>>33;
+    fp=(uint32_t)(h>>48);
+    return slots+(h&(sets-1))*GHOST_WAYS;
+}
+
+void GHOST::prefetch(const unsigned char *k) const {
+    uint32_t fp;
+    if(sets)
+        __builtin_prefetch(set(k, fp), 1);
+}
+
+// remember that the session of key k left for a reason, evictions being
+// the number of sessions evicted so far
+void GHOST::add(const unsigned char *k, const int reason,
+        const uint64_t evictions) {
+    if(!sets)
+        return;
+    uint32_t fp;
+    uint32_t *s=set(k, fp);
+    const uint32_t stamp=(uint32_t)(evictions>>shift)&STAMP_MASK;
+    unsigned way=GHOST_WAYS;
+    for(unsigned i=0; i<GHOST_WAYS; ++i)
+        if(s[i] && s[i]>>16==fp) { // left before
+            way=i;
+            break;
+        }
+    if(way==GHOST_WAYS) { // a free way, or else the oldest ghost
+        uint32_t age=0;
+        hand=(hand+1)&(GHOST_WAYS-1);
+        for(unsigned i=0; i<GHOST_WAYS; ++i) {
+            const unsigned j=(hand+i)&(GHOST_WAYS-1);
+            if(!s[j]) {
+                way=j;
+                break;
+            }
+            const uint32_t a=(stamp-(s[j]>>2))&STAMP_MASK;
+            if(way==GHOST_WAYS || a>age) {
+                age=a;
+                way=j;
+            }
+        }
+    }
+    __atomic_store_n(s+way, fp<<16|stamp<<2|reason, __ATOMIC_RELAXED);
+}
+
+// the session of key k is stored again
+void GHOST::forget(const unsigned char *k) {
+    if(!sets)
+        return;
+    uint32_t fp;
+    uint32_t *s=set(k, fp);
+    for(unsigned i=0; i<GHOST_WAYS; ++i)
+        if(s[i] && s[i]>>16==fp) {
+            __atomic_store_n(s+i, 0u, __ATOMIC_RELAXED);
+            return;
+        }
+}
+
+const int GHOST::find(const unsigned char *k, const uint64_t evictions,
+        uint64_t &since) const {
+    if(!sets)
+        return GHOST_UNKNOWN;
+    uint32_t fp;
+    const uint32_t *s=set(k, fp);
+    for(unsigned i=0; i<GHOST_WAYS; ++i) {
+        const uint32_t g=__atomic_load_n(s+i, __ATOMIC_RELAXED);
+        if(g && g>>16==fp) {
+            since=(uint64_t)((((uint32_t)(evictions>>shift))-(g>>2))&
+                STAMP_MASK)<<shift;
+            return (int)(g&3);
+        }
+    }
+    return GHOST_UNKNOWN;
+}
+
+const size_t GHOST::memory() const {
+    return sets*GHOST_WAYS*sizeof(uint32_t);
+}
+
+// end of ghost.cpp
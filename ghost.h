@@ -0,0 +1,75 @@
+// sessiond - SSL session cache daemon, file ghost.h
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+#ifndef __GHOST_H
+#define __GHOST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// ghosts per set, 4 bytes each: a set is a cache line
+#define GHOST_WAYS 16
+
+// why a session left the cache; a key never stored, or whose ghost has
+// been pushed out since, is unknown
+#define GHOST_UNKNOWN 0
+#define GHOST_EXPIRED 1
+#define GHOST_EVICTED 2
+#define GHOST_REMOVED 3
+#define GHOST_REASONS 4
+
+// percentages a cache could be larger by, the misses it would have found
+// are estimated from the ghosts of the sessions evicted: a session is
+// kept by a cache larger by the sessions evicted after it, and one more
+#define GHOST_LARGER 4
+static const unsigned ghost_larger[GHOST_LARGER]={10, 25, 50, 100};
+
+// GHOST class - fingerprints of the sessions that left a cache
+//
+// A session expired, evicted or removed leaves a word with a 16-bit
+// fingerprint of its key, the reason, and the number of evictions at the
+// time, so that a miss on its key can be told apart from a miss on a key
+// never stored, and a miss on an evicted key tells how many sessions
+// larger the cache would have needed to be to keep it: those evicted
+// since.  The count is kept in units of 1/1024 of the capacity or less.
+// The table is set associative, the oldest ghost of a full set makes
+// room, and a session stored again forgets its ghost.  It is written by
+// the owner of the cache only, and read from any thread a word at a time.
+class GHOST {
+    uint32_t *slots; // fingerprint<<16 | stamp<<2 | reason, 0 when free
+    size_t sets; // a power of 2, 0 if the table could not be allocated
+    unsigned shift; // evictions per stamp unit, log2
+    unsigned hand; // the way ties between ghosts as old start from
+
+    uint32_t *set(const unsigned char *, uint32_t &) const;
+public:
+    GHOST(const size_t);
+    ~GHOST();
+    void prefetch(const unsigned char *) const; // before add() or forget()
+    void add(const unsigned char *, const int, const uint64_t);
+    void forget(const unsigned char *);
+    // the reason and, if evicted, the evictions since, given the count now
+    const int find(const unsigned char *, const uint64_t, uint64_t &) const;
+    const size_t memory() const; // bytes allocated
+};
+
+#endif // __GHOST_H
+
+// end of ghost.h
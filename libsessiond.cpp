@@ -0,0 +1,480 @@
+// sessiond - SSL session cache daemon, file libsessiond.cpp
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+#include "libsessiond.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <algorithm>
+using namespace std;
+
+static int64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000+ts.tv_nsec/1000000;
+}
+
+// FNV-1a, the ring must be the same for every client
+static uint32_t fnv1a(const unsigned char *d, const size_t len) {
+    uint32_t h=2166136261u;
+    for(size_t i=0; i<len; ++i)
+        h=(h^d[i])*16777619u;
+    return h;
+}
+
+static bool point_less(const POINT &a, const POINT &b) {
+    return a.hash<b.hash || (a.hash==b.hash && a.server<b.server);
+}
+
+CLIENT::CLIENT(const unsigned t, const unsigned n) : timeout(t), nservers(0),
+        ring(NULL), npoints(0), capacity(n), used(0), free_list(0),
+        mirror_retry(0) {
+    mirror_name[0]='\0';
+    s=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(s!=-1)
+        fcntl(s, F_SETFL, fcntl(s, F_GETFL)|O_NONBLOCK);
+    pending=new PENDING[capacity];
+    for(unsigned i=0; i<capacity; ++i)
+        pending[i].next=i+1<capacity ? (int)i+1 : -1;
+    for(mask=1; mask<2*capacity; mask<<=1)
+        ;
+    buckets=new int[mask];
+    for(unsigned i=0; i<mask; ++i)
+        buckets[i]=-1;
+    --mask;
+    first[0]=first[1]=last[0]=last[1]=-1;
+}
+
+CLIENT::~CLIENT() {
+    if(s!=-1)
+        close(s);
+    delete[] ring;
+    delete[] pending;
+    delete[] buckets;
+}
+
+// place a server on the ring, false if it cannot be resolved
+bool CLIENT::add_server(const char *host, const unsigned short port) {
+    if(nservers==CLIENT_MAX_SERVERS)
+        return false;
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family=AF_INET;
+    hints.ai_socktype=SOCK_DGRAM;
+    if(getaddrinfo(host, NULL, &hints, &result))
+        return false;
+    SERVER &srv=servers[nservers];
+    srv.addr=*(struct sockaddr_in *)result->ai_addr;
+    srv.addr.sin_port=htons(port);
+    srv.failures=0;
+    srv.down_until=0;
+    freeaddrinfo(result);
+
+    POINT *r=new POINT[npoints+CLIENT_POINTS];
+    if(npoints)
+        memcpy(r, ring, npoints*sizeof *r);
+    for(unsigned i=0; i<CLIENT_POINTS; ++i) {
+        char name[64];
+        const int len=snprintf(name, sizeof name, "%s:%u-%u",
+            inet_ntoa(srv.addr.sin_addr), port, i);
+        r[npoints+i].hash=fnv1a((unsigned char *)name, len);
+        r[npoints+i].server=nservers;
+    }
+    npoints+=CLIENT_POINTS;
+    sort(r, r+npoints, point_less);
+    delete[] ring;
+    ring=r;
+    ++nservers;
+    return true;
+}
+
+// the owner of a key hash and its replica, skipping the servers that are
+// down unless all of them are
+bool CLIENT::pick(const uint32_t hash, const int64_t now, unsigned &server,
+        unsigned &replica) {
+    if(!nservers)
+        return false;
+    const POINT p={hash, 0};
+    const unsigned start=lower_bound(ring, ring+npoints, p, point_less)-ring;
+    for(int pass=0; pass<2; ++pass) {
+        int found=0;
+        for(unsigned i=0; i<npoints && found<2; ++i) {
+            const unsigned srv=ring[(start+i)%npoints].server;
+            if(!pass && servers[srv].down_until>now)
+                continue;
+            if(!found) {
+                server=replica=srv;
+                found=1;
+            } else if(srv!=server) {
+                replica=srv;
+                found=2;
+            }
+        }
+        if(found)
+            return true;
+    }
+    return false;
+}
+
+bool CLIENT::send(const unsigned server, const CACHE_PACKET &packet,
+        const unsigned len) {
+    return sendto(s, &packet, len, MSG_DONTWAIT,
+        (struct sockaddr *)&servers[server].addr,
+        sizeof servers[server].addr)==(ssize_t)len;
+}
+
+static void make_key(unsigned char *k, const unsigned char *id,
+        const unsigned len) {
+    const unsigned l=len<KEY_LEN ? len : KEY_LEN;
+    memcpy(k, id, l);
+    memset(k+l, 0, KEY_LEN-l);
+}
+
+bool CLIENT::store(const unsigned char *id, const unsigned id_len,
+        const unsigned char *val, const unsigned len, const unsigned t) {
+    CACHE_PACKET packet;
+    unsigned server, replica;
+    if(len>MAX_VAL_LEN)
+        return false;
+    make_key(packet.key, id, id_len);
+    if(!pick(fnv1a(packet.key, KEY_LEN), now_ms(), server, replica))
+        return false;
+    packet.version=1;
+    packet.type=CACHE_CMD_NEW;
+    packet.timeout=htons(t);
+    memcpy(packet.val, val, len);
+    return send(server, packet, CACHE_HDR_LEN+len);
+}
+
+bool CLIENT::remove(const unsigned char *id, const unsigned id_len) {
+    CACHE_PACKET packet;
+    unsigned server, replica;
+    make_key(packet.key, id, id_len);
+    if(!pick(fnv1a(packet.key, KEY_LEN), now_ms(), server, replica))
+        return false;
+    packet.version=1;
+    packet.type=CACHE_CMD_REMOVE;
+    packet.timeout=0;
+    return send(server, packet, CACHE_HDR_LEN);
+}
+
+// append a request to the list of a stage
+void CLIENT::link(const int i, const int stage) {
+    PENDING &p=pending[i];
+    p.stage=stage;
+    p.prev=last[stage];
+    p.next=-1;
+    if(last[stage]==-1)
+        first[stage]=i;
+    else
+        pending[last[stage]].next=i;
+    last[stage]=i;
+}
+
+void CLIENT::unlink(const int i) {
+    PENDING &p=pending[i];
+    if(p.prev==-1)
+        first[p.stage]=p.next;
+    else
+        pending[p.prev].next=p.next;
+    if(p.next==-1)
+        last[p.stage]=p.prev;
+    else
+        pending[p.next].prev=p.prev;
+}
+
+// send a GET, the callback runs from a later process() call; false if
+// too many are in flight or there is no server
+bool CLIENT::get(const unsigned char *id, const unsigned id_len,
+        CLIENT_CALLBACK callback, void *arg) {
+    if(mirror_name[0]) { // no round trip for a session found locally
+        unsigned char key[KEY_LEN], val[MAX_VAL_LEN];
+        unsigned len;
+        make_key(key, id, id_len);
+        if(local(key, val, len)) {
+            callback(arg, CLIENT_HIT, val, len);
+            return true;
+        }
+    }
+    if(free_list==-1)
+        return false;
+    const int i=free_list;
+    PENDING &p=pending[i];
+    make_key(p.key, id, id_len);
+    p.hash=fnv1a(p.key, KEY_LEN);
+    p.start=now_ms();
+    if(!pick(p.hash, p.start, p.server, p.replica))
+        return false;
+    free_list=p.next;
+    p.callback=callback;
+    p.arg=arg;
+    p.bucket_next=buckets[p.hash&mask];
+    buckets[p.hash&mask]=i;
+    link(i, 0);
+    ++used;
+
+    CACHE_PACKET packet;
+    packet.version=1;
+    packet.type=CACHE_CMD_GET;
+    packet.timeout=0;
+    memcpy(packet.key, p.key, KEY_LEN);
+    send(p.server, packet, CACHE_HDR_LEN); // or retried on failover
+    return true;
+}
+
+bool CLIENT::attach(const char *name) {
+    snprintf(mirror_name, sizeof mirror_name, "%s", name);
+    mirror_retry=now_ms()+CLIENT_RETRY;
+    return mirror.attach(mirror_name);
+}
+
+// look a key up in the sessions published on this host; once they are
+// withdrawn (sessiond stopped or restarted) attach again, at most once
+// per CLIENT_RETRY
+bool CLIENT::local(const unsigned char *key, unsigned char *val,
+        unsigned &len) {
+    const int found=mirror.find(key, val, len, time(NULL));
+    if(found>=0)
+        return found==1;
+    const int64_t now=now_ms();
+    if(now<mirror_retry)
+        return false;
+    mirror_retry=now+CLIENT_RETRY;
+    return mirror.attach(mirror_name) &&
+        mirror.find(key, val, len, time(NULL))==1;
+}
+
+// a server has not replied in time
+void CLIENT::fail(const unsigned server, const int64_t now) {
+    SERVER &srv=servers[server];
+    if(++srv.failures>=CLIENT_FAILURES)
+        srv.down_until=now+CLIENT_RETRY;
+}
+
+// complete a request and run its callback, which may send new ones
+void CLIENT::finish(const int i, const int result, const unsigned char *val,
+        const unsigned len) {
+    PENDING &p=pending[i];
+    int *b=&buckets[p.hash&mask];
+    while(*b!=i)
+        b=&pending[*b].bucket_next;
+    *b=p.bucket_next;
+    unlink(i);
+    p.next=free_list;
+    free_list=i;
+    --used;
+    p.callback(p.arg, result, val, len);
+}
+
+// ask the replicas of the requests half way to their timeout, and give up
+// on the requests that have reached it
+void CLIENT::expire(const int64_t now) {
+    while(first[0]!=-1 && now>=pending[first[0]].start+timeout/2) {
+        const int i=first[0];
+        PENDING &p=pending[i];
+        unlink(i);
+        link(i, 1);
+        if(p.replica==p.server)
+            continue;
+        fail(p.server, now);
+        CACHE_PACKET packet;
+        packet.version=1;
+        packet.type=CACHE_CMD_GET;
+        packet.timeout=0;
+        memcpy(packet.key, p.key, KEY_LEN);
+        send(p.replica, packet, CACHE_HDR_LEN);
+    }
+    while(first[1]!=-1 && now>=pending[first[1]].start+timeout) {
+        const int i=first[1];
+        fail(pending[i].replica, now);
+        finish(i, CLIENT_TIMEDOUT, NULL, 0);
+    }
+}
+
+// complete the first request for the key of a reply
+void CLIENT::reply(const CACHE_PACKET &packet, const ssize_t len,
+        const struct sockaddr_in &from) {
+    if(len<(ssize_t)CACHE_HDR_LEN || packet.version!=1 ||
+            (packet.type!=CACHE_RESP_OK && packet.type!=CACHE_RESP_ERR))
+        return;
+    unsigned server;
+    for(server=0; server<nservers; ++server)
+        if(servers[server].addr.sin_addr.s_addr==from.sin_addr.s_addr &&
+                servers[server].addr.sin_port==from.sin_port)
+            break;
+    if(server==nservers)
+        return;
+    servers[server].failures=0;
+    servers[server].down_until=0;
+    const uint32_t hash=fnv1a(packet.key, KEY_LEN);
+    for(int i=buckets[hash&mask]; i!=-1; i=pending[i].bucket_next) {
+        const PENDING &p=pending[i];
+        if(p.hash==hash && !memcmp(p.key, packet.key, KEY_LEN) &&
+                (p.server==server || p.replica==server)) {
+            if(packet.type==CACHE_RESP_OK)
+                finish(i, CLIENT_HIT, packet.val, len-CACHE_HDR_LEN);
+            else
+                finish(i, CLIENT_MISS, NULL, 0);
+            return;
+        }
+    }
+}
+
+int CLIENT::next_timeout() {
+    int64_t deadline=-1;
+    if(first[0]!=-1)
+        deadline=pending[first[0]].start+timeout/2;
+    if(first[1]!=-1 && (deadline==-1 ||
+            pending[first[1]].start+timeout<deadline))
+        deadline=pending[first[1]].start+timeout;
+    if(deadline==-1)
+        return -1;
+    const int64_t now=now_ms();
+    return deadline>now ? (int)(deadline-now) : 0;
+}
+
+// receive the replies available on the socket and handle the timeouts
+void CLIENT::process() {
+    CACHE_PACKET packet;
+    struct sockaddr_in from;
+    for(;;) {
+        socklen_t fromlen=sizeof from;
+        const ssize_t len=recvfrom(s, &packet, sizeof packet, MSG_DONTWAIT,
+            (struct sockaddr *)&from, &fromlen);
+        if(len==-1) {
+            if(errno==EINTR)
+                continue;
+            break;
+        }
+        reply(packet, len, from);
+    }
+    expire(now_ms());
+}
+
+typedef struct {
+    bool done;
+    int result;
+    unsigned char *val;
+    unsigned len;
+} SYNC_GET;
+
+static void sync_callback(void *arg, const int result, const unsigned char *val,
+        const unsigned len) {
+    SYNC_GET &g=*(SYNC_GET *)arg;
+    g.done=true;
+    g.result=result;
+    g.len=len;
+    if(len)
+        memcpy(g.val, val, len);
+}
+
+// the other requests in flight make progress in the meantime
+int CLIENT::get_sync(const unsigned char *id, const unsigned id_len,
+        unsigned char *val, unsigned &len) {
+    SYNC_GET g={false, CLIENT_MISS, val, 0};
+    if(!get(id, id_len, sync_callback, &g))
+        return CLIENT_MISS;
+    while(!g.done) {
+        struct pollfd pfd={s, POLLIN, 0};
+        poll(&pfd, 1, next_timeout());
+        process();
+    }
+    len=g.len;
+    return g.result;
+}
+
+// ask server number n for its statistics, wait for them up to the timeout;
+// return the length of the text stored at txt, or -1 on failure
+int CLIENT::stats(const unsigned n, char *txt, const unsigned size) {
+    return text(n, CACHE_CMD_STATS, txt, size);
+}
+
+int CLIENT::busiest(const unsigned n, char *txt, const unsigned size) {
+    return text(n, CACHE_CMD_BUSIEST, txt, size);
+}
+
+// send server n a request of type answered with text, and copy the text
+// into txt of size bytes, return its length or -1
+int CLIENT::text(const unsigned n, const int type, char *txt,
+        const unsigned size) {
+    if(n>=nservers || !size)
+        return -1;
+    // a socket of its own, not to be mistaken for a GET reply
+    const int sock=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(sock==-1)
+        return -1;
+    CACHE_PACKET packet;
+    memset(&packet, 0, CACHE_HDR_LEN);
+    packet.version=1;
+    packet.type=type;
+    int len=-1;
+    if(sendto(sock, &packet, CACHE_HDR_LEN, 0,
+            (struct sockaddr *)&servers[n].addr, sizeof servers[n].addr)==
+            (ssize_t)CACHE_HDR_LEN) {
+        struct pollfd pfd={sock, POLLIN, 0};
+        unsigned char reply[CACHE_HDR_LEN+CACHE_STATS_LEN];
+        ssize_t r;
+        if(poll(&pfd, 1, timeout)==1 &&
+                (r=recv(sock, reply, sizeof reply, 0))>=(ssize_t)CACHE_HDR_LEN &&
+                reply[1]==CACHE_RESP_OK) {
+            len=r-CACHE_HDR_LEN<(ssize_t)size ? r-CACHE_HDR_LEN : size-1;
+            memcpy(txt, reply+CACHE_HDR_LEN, len);
+            txt[len]='\0';
+        }
+    }
+    close(sock);
+    return len;
+}
+
+int CLIENT::limit(const unsigned n, const unsigned sessions) {
+    if(n>=nservers)
+        return -1;
+    const int sock=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(sock==-1)
+        return -1;
+    CACHE_PACKET packet;
+    memset(&packet, 0, CACHE_HDR_LEN);
+    packet.version=1;
+    packet.type=CACHE_CMD_LIMIT;
+    const uint32_t val=htonl(sessions);
+    memcpy(packet.val, &val, sizeof val);
+    int ret=-1;
+    if(sendto(sock, &packet, CACHE_HDR_LEN+sizeof val, 0,
+            (struct sockaddr *)&servers[n].addr, sizeof servers[n].addr)==
+            (ssize_t)(CACHE_HDR_LEN+sizeof val)) {
+        struct pollfd pfd={sock, POLLIN, 0};
+        unsigned char reply[CACHE_HDR_LEN];
+        if(poll(&pfd, 1, timeout)==1 &&
+                recv(sock, reply, sizeof reply, 0)==(ssize_t)CACHE_HDR_LEN &&
+                reply[1]==CACHE_RESP_OK)
+            ret=0;
+    }
+    close(sock);
+    return ret;
+}
+
+// end of libsessiond.cpp
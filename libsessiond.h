@@ -0,0 +1,151 @@
+// sessiond - SSL session cache daemon, file libsessiond.h
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+#ifndef __LIBSESSIOND_H
+#define __LIBSESSIOND_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include "protocol.h"
+#include "mirror.h"
+
+#define CLIENT_TIMEOUT 200 // milliseconds a GET may take, see README
+#define CLIENT_INFLIGHT 1024 // GETs waiting for their replies
+#define CLIENT_MAX_SERVERS 64
+#define CLIENT_POINTS 160 // points of each server on the hash ring
+#define CLIENT_FAILURES 3 // timeouts in a row that take a server down
+#define CLIENT_RETRY 1000 // milliseconds until a server down is tried again
+
+// results passed to a GET callback
+#define CLIENT_HIT 1
+#define CLIENT_MISS 0
+#define CLIENT_TIMEDOUT -1
+
+typedef void (*CLIENT_CALLBACK)(void *, const int, const unsigned char *,
+    const unsigned);
+
+typedef struct {
+    struct sockaddr_in addr;
+    unsigned failures; // timeouts since the last reply
+    int64_t down_until; // not asked before this time
+} SERVER;
+
+typedef struct {
+    uint32_t hash;
+    unsigned server;
+} POINT;
+
+// a GET waiting for its reply
+typedef struct {
+    unsigned char key[KEY_LEN];
+    uint32_t hash;
+    int64_t start;
+    unsigned server, replica; // asked first and on failover
+    int stage; // 0 asking the owner, 1 asking the replica as well
+    CLIENT_CALLBACK callback;
+    void *arg;
+    int bucket_next; // in the key hash table
+    int prev, next; // in the list of its stage, or the free list
+} PENDING;
+
+// CLIENT class - non-blocking client of a set of sessiond servers
+//
+// Session IDs are spread over the servers with consistent hashing: every
+// server is placed at CLIENT_POINTS points of a hash ring, derived from its
+// address and port only, so all the clients agree on the owner of a key,
+// and removing a server only moves the keys it owned.  The next server on
+// the ring is the replica of a key.
+//
+// Any number of GETs can be in flight.  A GET is sent to the owner of its
+// key, and to the replica once half of the timeout has passed without a
+// reply; after the full timeout its callback reports CLIENT_TIMEDOUT, to
+// be treated as a miss.  The socket is never waited for: fd() is polled by
+// the caller with next_timeout(), and process() then runs the callbacks.
+// NEW and REMOVE go to the owner, the servers replicate them (sessiond -r).
+//
+// A client on the same host as a sessiond publishing its sessions in shared
+// memory (sessiond -s) can attach() to them: a GET found there runs its
+// callback before get() returns, without any system call, and only a miss
+// is sent to the servers.
+class CLIENT {
+    int s;
+    unsigned timeout;
+    SERVER servers[CLIENT_MAX_SERVERS];
+    unsigned nservers;
+    POINT *ring;
+    unsigned npoints;
+    PENDING *pending;
+    unsigned capacity, used;
+    int *buckets; // heads of key hash chains
+    unsigned mask;
+    int first[2], last[2]; // in flight at each stage, oldest first
+    int free_list;
+    MIRROR mirror; // of a sessiond on this host
+    char mirror_name[256]; // empty if not attached
+    int64_t mirror_retry; // when to attach again to a withdrawn segment
+
+    bool pick(const uint32_t, const int64_t, unsigned &, unsigned &);
+    bool send(const unsigned, const CACHE_PACKET &, const unsigned);
+    void link(const int, const int);
+    void unlink(const int);
+    void fail(const unsigned, const int64_t);
+    void finish(const int, const int, const unsigned char *, const unsigned);
+    void expire(const int64_t);
+    void reply(const CACHE_PACKET &, const ssize_t,
+        const struct sockaddr_in &);
+    bool local(const unsigned char *, unsigned char *, unsigned &);
+    int text(const unsigned, const int, char *, const unsigned);
+public:
+    CLIENT(const unsigned=CLIENT_TIMEOUT, const unsigned=CLIENT_INFLIGHT);
+    ~CLIENT();
+    bool add_server(const char *, const unsigned short);
+    // look GETs up in the segment published by sessiond -s name first;
+    // false if it is not published yet, it is attached to once it is
+    bool attach(const char *);
+    int fd() const {
+        return s;
+    }
+    unsigned inflight() const {
+        return used;
+    }
+    unsigned server_count() const {
+        return nservers;
+    }
+    // the session ID is right-padded with zeros to KEY_LEN bytes
+    bool store(const unsigned char *, const unsigned, const unsigned char *,
+        const unsigned, const unsigned);
+    bool remove(const unsigned char *, const unsigned);
+    bool get(const unsigned char *, const unsigned, CLIENT_CALLBACK, void *);
+    int next_timeout(); // milliseconds, -1 with nothing in flight
+    void process();
+    // a GET waiting for its own reply, val holds MAX_VAL_LEN bytes
+    int get_sync(const unsigned char *, const unsigned, unsigned char *,
+        unsigned &);
+    // the statistics report of a server, see PROTOCOL
+    int stats(const unsigned, char *, const unsigned);
+    // the busiest sources and session IDs of a server on this host
+    int busiest(const unsigned, char *, const unsigned);
+    // set the sessions a server caches at most, 0 on success, see PROTOCOL
+    int limit(const unsigned, const unsigned);
+};
+
+#endif // __LIBSESSIOND_H
+
+// end of libsessiond.h
@@ -27,7 +27,8 @@
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
-#include <stdarg.h>
+#include <signal.h>
+#include <unistd.h>
 #endif // __WIN32__
 
 #ifdef __WIN32__
@@ -47,54 +48,175 @@ void LOG::err(const int priority, const char *txt) {
     my_perror(txt);
 }
 
+void LOG::start() {
+}
+
 #else // defined __WIN32__
 
-LOG::LOG() {
+LOG::LOG() : head(0), tail(0), lost(0), unreported(0), reported(0),
+        running(false), stopping(false) {
+    for(unsigned i=0; i<LOG_RING; ++i)
+        ring[i].seq=i;
+    memset(sources, 0, sizeof sources);
 #ifdef DAEMONISE
     openlog("sessiond", LOG_CONS, LOG_DAEMON);
 #endif
 }
 
 LOG::~LOG() {
+    if(running) {
+        __atomic_store_n(&stopping, true, __ATOMIC_RELAXED);
+        pthread_join(thread, NULL);
+    }
+    drain(); // whatever was queued since
+    for(unsigned i=0; i<LOG_SOURCES; ++i)
+        summarise(sources[i]);
+    reported=0;
+    drain(); // and the messages lost
 #ifdef DAEMONISE
     closelog();
 #endif
 }
 
-void LOG::msg(const int priority, const char *format, ...) {
-	char buffer[512];
-	buffer[0] = '\0';
-	va_list args;
-	va_start(args, format);
-
-	// assemble the users message into the buffer
-	vsprintf(buffer, format, args);
+// start the logging thread, after daemon() as it does not survive fork()
+void LOG::start() {
+    // signals are left to the main thread
+    sigset_t set, old;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    running=!pthread_create(&thread, NULL, run, this);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
 
-#ifdef DAEMONISE
-	// use syslog if we are daemonised
-	syslog(priority, buffer);
-#else
-	// just use plain printf, otherwise
-    printf("%d| %s\n", priority, buffer);
-#endif // DAEMONISE
+void *LOG::run(void *arg) {
+    LOG &log=*(LOG *)arg;
+    while(!__atomic_load_n(&log.stopping, __ATOMIC_RELAXED))
+        if(!log.drain())
+            usleep(10000); // the ring is checked 100 times per second
+    return NULL;
+}
 
+void LOG::msg(const int priority, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    queue(priority, -1, format, args);
     va_end(args);
 }
 
 void LOG::err(const int priority, const char *format, ...) {
-	char buffer[512];
-	va_list args;
-	va_start(args, format);
+    const int error=errno;
+    va_list args;
+    va_start(args, format);
+    queue(priority, error, format, args);
+    va_end(args);
+}
 
-	// assemble the users error into the buffer
-	vsprintf(buffer, format, args);
+// format a message into the next free entry of the ring, producers take
+// their entries in turn with a compare and swap, and release them in any
+// order; nothing is waited for, a full ring drops the message
+void LOG::queue(const int priority, const int error, const char *format,
+        va_list args) {
+    unsigned pos=__atomic_load_n(&head, __ATOMIC_RELAXED);
+    LOG_ENTRY *e;
+    for(;;) {
+        e=&ring[pos%LOG_RING];
+        const int diff=(int)(__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE)-pos);
+        if(!diff) {
+            if(__atomic_compare_exchange_n(&head, &pos, pos+1, true,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if(diff<0) { // not yet written out by the logging thread
+            __atomic_add_fetch(&lost, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos=__atomic_load_n(&head, __ATOMIC_RELAXED);
+        }
+    }
+    e->priority=priority;
+    e->format=format;
+    e->error=error;
+    vsnprintf(e->text, sizeof e->text, format, args);
+    __atomic_store_n(&e->seq, pos+1, __ATOMIC_RELEASE);
+}
+
+// write out the messages queued, rate limited by their format;
+// false if there were none
+bool LOG::drain() {
+    const time_t now=time(NULL);
+    bool any=false;
+    for(;;) {
+        LOG_ENTRY &e=ring[tail%LOG_RING];
+        if(__atomic_load_n(&e.seq, __ATOMIC_ACQUIRE)!=tail+1)
+            break;
+        any=true;
+        LOG_SOURCE *src=NULL, *oldest=&sources[0];
+        for(unsigned i=0; i<LOG_SOURCES && !src; ++i) {
+            if(sources[i].format==e.format)
+                src=&sources[i];
+            else if(sources[i].window<oldest->window)
+                oldest=&sources[i];
+        }
+        if(!src) { // reuse the slot of the format seen the longest ago
+            src=oldest;
+            summarise(*src);
+            src->format=e.format;
+            src->window=0;
+        }
+        if(now-src->window>=LOG_WINDOW) {
+            summarise(*src);
+            src->window=now;
+            src->written=0;
+        }
+        src->priority=e.priority;
+        if(src->written<LOG_BURST) {
+            ++src->written;
+            if(e.error<0) {
+                write(e.priority, e.text);
+            } else {
+                char txt[LOG_LINE+128];
+                snprintf(txt, sizeof txt, "%s: error %d: %s",
+                    e.text, e.error, strerror(e.error));
+                write(e.priority, txt);
+            }
+        } else {
+            ++src->suppressed;
+        }
+        __atomic_store_n(&e.seq, tail+LOG_RING, __ATOMIC_RELEASE);
+        ++tail;
+    }
+    for(unsigned i=0; i<LOG_SOURCES; ++i)
+        if(sources[i].suppressed && now-sources[i].window>=LOG_WINDOW)
+            summarise(sources[i]);
+    unreported+=__atomic_exchange_n(&lost, 0, __ATOMIC_RELAXED);
+    if(unreported && now-reported>=LOG_WINDOW) { // rate limited as well
+        char txt[64];
+        snprintf(txt, sizeof txt, "%llu log messages lost", unreported);
+        write(LOG_WARNING, txt);
+        unreported=0;
+        reported=now;
+    }
+    return any;
+}
 
+void LOG::write(const int priority, const char *txt) {
 #ifdef DAEMONISE
-    syslog(priority, "%s: error %d: %s", buffer, errno, strerror(errno));
+	// use syslog if we are daemonised
+    syslog(priority, "%s", txt);
 #else
-	fprintf(stderr, "%d| %s: error %d: %s\n", priority, buffer, errno, strerror(errno));
-#endif
+	// just use plain printf, otherwise
+    printf("%d| %s\n", priority, txt);
+#endif // DAEMONISE
+}
 
+// report the messages of a format suppressed in its last window
+void LOG::summarise(LOG_SOURCE &src) {
+    if(!src.suppressed)
+        return;
+    char txt[LOG_LINE];
+    snprintf(txt, sizeof txt, "%u similar messages suppressed: %s",
+        src.suppressed, src.format);
+    write(src.priority, txt);
+    src.suppressed=0;
 }
 
 #endif // defined __WIN32__
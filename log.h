@@ -18,6 +18,8 @@
 // a combined work based on sessiond. Thus, the terms and conditions of
 // the GNU General Public License cover the whole combination.
 
+#include <stdarg.h>
+
 #ifdef __WIN32__
 #define LOG_EMERG       0
 #define LOG_ALERT       1
@@ -33,11 +35,66 @@
 #define DAEMONISE
 #endif
 
+#ifndef __WIN32__
+#include <pthread.h>
+#include <time.h>
+#endif
+
+#define LOG_LINE 512 // longest message, longer ones are truncated
+#define LOG_RING 256 // messages queued for the logging thread
+#define LOG_SOURCES 32 // formats rate limited at the same time
+#define LOG_BURST 5 // messages of a format written per window
+#define LOG_WINDOW 10 // seconds
+
+// a message queued for the logging thread
+typedef struct {
+    unsigned seq; // the ticket of its producer or consumer
+    int priority;
+    const char *format; // messages of the same format are similar
+    int error; // errno for err(), -1 for msg()
+    char text[LOG_LINE];
+} LOG_ENTRY;
+
+// a format being rate limited
+typedef struct {
+    const char *format;
+    time_t window; // start of its current window
+    unsigned written, suppressed;
+    int priority;
+} LOG_SOURCE;
+
 // LOG class
+//
+// msg() and err() only format the message and queue it into a lock-free
+// ring, so they are safe to call from any serving thread and never wait
+// for syslog; a full ring drops the message.  A background thread, started
+// by start() once the process has daemonised, writes the messages out:
+// no more than LOG_BURST similar messages (with the same format) per
+// LOG_WINDOW seconds, the rest are counted and reported as suppressed.
 class LOG {
+#ifndef __WIN32__
+    LOG_ENTRY ring[LOG_RING];
+    unsigned head; // taken by producers
+    char pad[64-sizeof(unsigned)]; // keep head and tail in separate lines
+    unsigned tail; // advanced by the logging thread
+    unsigned lost; // messages dropped on a full ring
+    unsigned long long unreported; // of them, not yet reported
+    time_t reported; // when lost messages were last reported
+    LOG_SOURCE sources[LOG_SOURCES];
+    pthread_t thread;
+    bool running;
+    volatile bool stopping;
+
+    void queue(const int, const int, const char *, va_list);
+    bool drain();
+    void write(const int, const char *);
+    void summarise(LOG_SOURCE &);
+    static void *run(void *);
+#endif
 public:
     LOG();
     ~LOG();
+    void start();
     void msg(const int, const char *, ...);
     void err(const int, const char *, ...);
 };
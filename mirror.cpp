@@ -0,0 +1,281 @@
+// sessiond - SSL session cache daemon, file mirror.cpp
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+#include "mirror.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// splitmix64, mixing the key words into the salt
+static inline uint64_t mix(uint64_t z) {
+    z=(z^(z>>30))*0xbf58476d1ce4e5b9ULL;
+    z=(z^(z>>27))*0x94d049bb133111ebULL;
+    return z^(z>>31);
+}
+
+// the slots follow the header and the tags
+static inline size_t slots_offset(const uint64_t sets) {
+    return 64+((sets*MIRROR_WAYS*sizeof(uint32_t)+63)&~(size_t)63);
+}
+
+static inline void lock(MIRROR_SLOT &slot) {
+    for(;;) { // held by another worker for the time of a copy
+        uint32_t seq=__atomic_load_n(&slot.seq, __ATOMIC_RELAXED);
+        if(!(seq&1) && __atomic_compare_exchange_n(&slot.seq, &seq, seq+1,
+                false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE); // the odd seq before the data
+}
+
+static inline void unlock(MIRROR_SLOT &slot) {
+    __atomic_store_n(&slot.seq, slot.seq+1, __ATOMIC_RELEASE);
+}
+
+MIRROR::MIRROR() : header(NULL), tags(NULL), slots(NULL), size(0), mask(0),
+        owner(false) {
+    name[0]='\0';
+}
+
+MIRROR::~MIRROR() {
+    close();
+}
+
+// map the segment open at fd, and close it
+bool MIRROR::map(const int fd, const size_t len, const int prot) {
+    void *p=mmap(NULL, len, prot, MAP_SHARED, fd, 0);
+    const int error=errno;
+    ::close(fd);
+    if(p==MAP_FAILED) {
+        errno=error;
+        return false;
+    }
+    header=(MIRROR_HEADER *)p;
+    size=len;
+    return true;
+}
+
+uint64_t MIRROR::hash(const unsigned char *k) const {
+    uint64_t h=header->salt;
+    for(unsigned i=0; i<KEY_LEN; i+=8) {
+        uint64_t w;
+        memcpy(&w, k+i, 8);
+        h=mix(h^w);
+    }
+    return h;
+}
+
+// publish a segment of about bytes under name, replacing the one left
+// by a previous instance, whose readers are told to attach again
+bool MIRROR::create(const char *n, const size_t bytes) {
+    close();
+    snprintf(name, sizeof name, "%s%s", n[0]=='/' ? "" : "/", n);
+    int fd=shm_open(name, O_RDWR, 0);
+    if(fd!=-1) {
+        void *p=mmap(NULL, sizeof(MIRROR_HEADER), PROT_READ|PROT_WRITE,
+            MAP_SHARED, fd, 0);
+        ::close(fd);
+        if(p!=MAP_FAILED) {
+            MIRROR_HEADER *old=(MIRROR_HEADER *)p;
+            if(!memcmp(old->magic, MIRROR_MAGIC, sizeof old->magic))
+                __atomic_store_n(&old->live, 0, __ATOMIC_RELEASE);
+            munmap(p, sizeof(MIRROR_HEADER));
+        }
+        shm_unlink(name);
+    }
+    uint64_t sets=1;
+    while(sets*2*MIRROR_WAYS*(sizeof(uint32_t)+MIRROR_SLOT_LEN)<=bytes)
+        sets*=2;
+    fd=shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0640);
+    if(fd==-1)
+        return false;
+    const size_t len=slots_offset(sets)+sets*MIRROR_WAYS*MIRROR_SLOT_LEN;
+    if(ftruncate(fd, len)) { // zeroed: all the slots are free
+        const int error=errno;
+        ::close(fd);
+        shm_unlink(name);
+        errno=error;
+        return false;
+    }
+    if(!map(fd, len, PROT_READ|PROT_WRITE)) {
+        shm_unlink(name);
+        return false;
+    }
+    owner=true;
+    memcpy(header->magic, MIRROR_MAGIC, sizeof header->magic);
+    header->version=MIRROR_VERSION;
+    header->slot_len=MIRROR_SLOT_LEN;
+    header->ways=MIRROR_WAYS;
+    header->sets=sets;
+    const int r=::open("/dev/urandom", O_RDONLY);
+    if(r==-1 || read(r, &header->salt, sizeof header->salt)!=sizeof header->salt)
+        header->salt=mix((uint64_t)time(NULL)^(uint64_t)getpid()<<32);
+    if(r!=-1)
+        ::close(r);
+    mask=sets-1;
+    tags=(uint32_t *)((char *)header+64);
+    slots=(MIRROR_SLOT *)((char *)header+slots_offset(sets));
+    __atomic_store_n(&header->live, 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// map the segment published under name for reading
+bool MIRROR::attach(const char *n) {
+    close();
+    snprintf(name, sizeof name, "%s%s", n[0]=='/' ? "" : "/", n);
+    const int fd=shm_open(name, O_RDONLY, 0);
+    if(fd==-1)
+        return false;
+    struct stat st;
+    if(fstat(fd, &st) || st.st_size<(off_t)sizeof(MIRROR_HEADER)) {
+        ::close(fd);
+        errno=EINVAL;
+        return false;
+    }
+    if(!map(fd, st.st_size, PROT_READ))
+        return false;
+    const uint64_t sets=header->sets;
+    if(memcmp(header->magic, MIRROR_MAGIC, sizeof header->magic) ||
+            header->version!=MIRROR_VERSION ||
+            header->slot_len!=MIRROR_SLOT_LEN ||
+            header->ways!=MIRROR_WAYS || !sets || sets&(sets-1) ||
+            slots_offset(sets)+sets*MIRROR_WAYS*MIRROR_SLOT_LEN>size) {
+        close();
+        errno=EINVAL;
+        return false;
+    }
+    mask=sets-1;
+    tags=(uint32_t *)((char *)header+64);
+    slots=(MIRROR_SLOT *)((char *)header+slots_offset(sets));
+    return true;
+}
+
+void MIRROR::close() {
+    if(!header)
+        return;
+    if(owner) {
+        __atomic_store_n(&header->live, 0, __ATOMIC_RELEASE);
+        shm_unlink(name);
+        owner=false;
+    }
+    munmap(header, size);
+    header=NULL;
+}
+
+const size_t MIRROR::capacity() const {
+    return header ? (mask+1)*MIRROR_WAYS : 0;
+}
+
+// publish a session expiring at expiry, in place of the session of its
+// set expiring first; like DATA, a session still live at now is kept
+void MIRROR::store(const unsigned char *k, const unsigned char *v,
+        const unsigned len, const time_t expiry, const time_t now) {
+    if(!header || len>MAX_VAL_LEN)
+        return;
+    const uint64_t h=hash(k);
+    const uint32_t tag=(uint32_t)(h>>32)|1;
+    uint32_t *t=tags+(h&mask)*MIRROR_WAYS;
+    MIRROR_SLOT *s=slots+(h&mask)*MIRROR_WAYS;
+    unsigned way=0;
+    int64_t oldest=__atomic_load_n(&s[0].expiry, __ATOMIC_RELAXED);
+    for(unsigned w=0; w<MIRROR_WAYS; ++w) {
+        const int64_t e=__atomic_load_n(&s[w].expiry, __ATOMIC_RELAXED);
+        if(__atomic_load_n(t+w, __ATOMIC_RELAXED)==tag &&
+                !memcmp(s[w].key, k, KEY_LEN)) { // only written by us
+            if(e>=now)
+                return;
+            way=w;
+            break;
+        }
+        if(e<oldest) {
+            oldest=e;
+            way=w;
+        }
+    }
+    MIRROR_SLOT &slot=s[way];
+    lock(slot);
+    memcpy(slot.key, k, KEY_LEN);
+    slot.len=len;
+    memcpy(slot.val, v, len);
+    __atomic_store_n(&slot.expiry, (int64_t)expiry, __ATOMIC_RELAXED);
+    __atomic_store_n(t+way, tag, __ATOMIC_RELAXED);
+    unlock(slot);
+}
+
+void MIRROR::erase(const unsigned char *k) {
+    if(!header)
+        return;
+    const uint64_t h=hash(k);
+    const uint32_t tag=(uint32_t)(h>>32)|1;
+    uint32_t *t=tags+(h&mask)*MIRROR_WAYS;
+    MIRROR_SLOT *s=slots+(h&mask)*MIRROR_WAYS;
+    for(unsigned w=0; w<MIRROR_WAYS; ++w)
+        if(__atomic_load_n(t+w, __ATOMIC_RELAXED)==tag &&
+                !memcmp(s[w].key, k, KEY_LEN)) {
+            lock(s[w]);
+            __atomic_store_n(&s[w].expiry, (int64_t)0, __ATOMIC_RELAXED);
+            __atomic_store_n(t+w, (uint32_t)0, __ATOMIC_RELAXED);
+            unlock(s[w]);
+            return;
+        }
+}
+
+// look a session up without writing to the segment: a slot is copied
+// out, and the copy is only used if no writer has touched it meanwhile
+int MIRROR::find(const unsigned char *k, unsigned char *val, unsigned &len,
+        const time_t now) const {
+    if(!header || !__atomic_load_n(&header->live, __ATOMIC_ACQUIRE))
+        return -1;
+    const uint64_t h=hash(k);
+    const uint32_t tag=(uint32_t)(h>>32)|1;
+    const uint32_t *t=tags+(h&mask)*MIRROR_WAYS;
+    const MIRROR_SLOT *s=slots+(h&mask)*MIRROR_WAYS;
+    for(unsigned w=0; w<MIRROR_WAYS; ++w) {
+        if(__atomic_load_n(t+w, __ATOMIC_RELAXED)!=tag)
+            continue;
+        const MIRROR_SLOT &slot=s[w];
+        for(unsigned i=0; i<MIRROR_RETRIES; ++i) {
+            const uint32_t seq=__atomic_load_n(&slot.seq, __ATOMIC_ACQUIRE);
+            if(seq&1)
+                continue;
+            const bool same=!memcmp(slot.key, k, KEY_LEN);
+            const unsigned l=slot.len;
+            const int64_t expiry=slot.expiry;
+            if(same && l<=MAX_VAL_LEN)
+                memcpy(val, slot.val, l);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if(__atomic_load_n(&slot.seq, __ATOMIC_RELAXED)!=seq)
+                continue; // torn
+            if(!same)
+                break;
+            if(expiry<now)
+                return 0;
+            len=l;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// end of mirror.cpp
@@ -0,0 +1,98 @@
+// sessiond - SSL session cache daemon, file mirror.h
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+#ifndef __MIRROR_H
+#define __MIRROR_H
+
+#include <time.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "protocol.h" // KEY_LEN, MAX_VAL_LEN
+
+#define MIRROR_MAGIC "sdmirror"
+#define MIRROR_VERSION 1
+#define MIRROR_WAYS 8 // slots of a set, a key may be in any of them
+#define MIRROR_SLOT_LEN 576 // 9 cache lines
+#define MIRROR_RETRIES 64 // reads of a slot being written before a miss
+#define MIRROR_DEFAULT_MB 64
+
+// shared memory layout: this header in the first cache line, a uint32
+// tag for every slot (a hint of the key hash in it, 0 when free), then
+// the slots, 64-byte aligned; all the numbers are in host byte order
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t slot_len; // MIRROR_SLOT_LEN
+    uint32_t ways; // MIRROR_WAYS
+    uint32_t live; // cleared once sessiond stops or replaces the segment
+    uint64_t sets; // a power of 2
+    uint64_t salt; // of the key hash
+} MIRROR_HEADER;
+
+// a session, guarded by a sequence lock: seq is odd while the slot is
+// being written, readers copy it out and retry if seq has changed
+typedef struct {
+    uint32_t seq;
+    uint16_t len;
+    uint16_t unused;
+    int64_t expiry; // time of day, 0 for a free slot
+    unsigned char key[KEY_LEN];
+    unsigned char val[MAX_VAL_LEN];
+    unsigned char pad[MIRROR_SLOT_LEN-16-KEY_LEN-MAX_VAL_LEN];
+} MIRROR_SLOT;
+
+// MIRROR class - the sessions of a sessiond published in POSIX shared
+// memory, for clients on the same host to look up without system calls
+//
+// It is a cache of the cache: a session is written when it is stored
+// or replicated to sessiond, and only dropped when it is removed, expires,
+// or its slot is taken by another session of the same set, so a miss is
+// to be asked from sessiond.  Each key is only ever written by the worker
+// owning it, so the slot locks are only contended between different keys.
+class MIRROR {
+    MIRROR_HEADER *header;
+    uint32_t *tags;
+    MIRROR_SLOT *slots;
+    size_t size; // bytes mapped
+    uint64_t mask; // sets-1
+    bool owner; // created it, as opposed to attached to it
+    char name[256];
+
+    bool map(const int, const size_t, const int);
+    uint64_t hash(const unsigned char *) const;
+public:
+    MIRROR();
+    ~MIRROR();
+    bool create(const char *, const size_t); // for sessiond
+    bool attach(const char *); // for its clients, read only
+    void close(); // the segment is withdrawn once its owner closes it
+    const size_t capacity() const; // sessions held at most
+    void store(const unsigned char *, const unsigned char *, const unsigned,
+        const time_t, const time_t);
+    void erase(const unsigned char *);
+    // 1 if found, 0 if not, -1 if the segment is no longer published;
+    // val holds MAX_VAL_LEN bytes
+    int find(const unsigned char *, unsigned char *, unsigned &,
+        const time_t) const;
+};
+
+#endif // __MIRROR_H
+
+// end of mirror.h
@@ -0,0 +1,81 @@
+// sessiond - SSL session cache daemon, file protocol.h
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+#ifndef __PROTOCOL_H
+#define __PROTOCOL_H
+
+#include <sys/types.h>
+
+// see PROTOCOL for the description
+#define CACHE_CMD_NEW     0x00
+#define CACHE_CMD_GET     0x01
+#define CACHE_CMD_REMOVE  0x02
+#define CACHE_CMD_STATS   0x03
+#define CACHE_CMD_LIMIT   0x04
+#define CACHE_CMD_BUSIEST 0x05
+#define CACHE_RESP_ERR    0x80
+#define CACHE_RESP_OK     0x81
+
+#define KEY_LEN 32
+#define MAX_VAL_LEN 512
+typedef struct {
+    u_char version, type;
+    u_short timeout;
+    u_char key[KEY_LEN];
+    u_char val[MAX_VAL_LEN];
+} CACHE_PACKET;
+
+// length of a packet without its value
+#define CACHE_HDR_LEN (sizeof(CACHE_PACKET)-MAX_VAL_LEN)
+
+// the largest datagram of the versions below, it fits an Ethernet frame
+#define CACHE_DGRAM_LEN 1472
+
+// the longest value of a reply to CACHE_CMD_STATS, the text of the report:
+// enough for every counter up to 15 digits
+#define CACHE_STATS_LEN 8192
+
+// version 2 datagrams: a header followed by count operations, each
+// with its value; the replies to the GETs are datagrams of the same form
+#define CACHE_V2_VERSION 0x02
+typedef struct {
+    u_char version, count;
+    u_short reserved;
+} CACHE_V2_HEADER;
+
+typedef struct {
+    u_char type, reserved;
+    u_short len; // of the value following the operation
+    u_int id; // chosen by the client, echoed in the reply
+    u_short timeout, reserved2;
+    u_char key[KEY_LEN];
+} CACHE_OP;
+
+// replication datagrams sent between instances
+#define CACHE_REPL_VERSION 0x03
+typedef struct {
+    u_char version, count;
+    u_short worker;
+    u_int node, seq;
+} CACHE_REPL_HEADER;
+
+#endif // __PROTOCOL_H
+
+// end of protocol.h
@@ -0,0 +1,190 @@
+// sessiond - SSL session cache daemon, file readbench.cpp
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+// Scaling of concurrent GETs on a single DATA instance: for every number
+// of reader threads given on the command line, the readers look up random
+// live sessions for a second while one writer inserts new sessions and
+// erases the oldest ones, throttled to 5% of all the operations.  Each
+// run is done with the readers and the writer serialised on a mutex
+// around find(), and with the readers using the lock-free read().
+
+#include "data.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#define SESSIONS 1000000 // live at any time
+#define WRITE_SHARE 5 // percentage of the operations done by the writer
+#define DURATION 1 // seconds per run
+#define RECLAIM 32 // writes between reclaim() calls, as in a batch
+#define TIMEOUT 3600
+#define VAL_LEN 200
+
+typedef struct {
+    unsigned long long ops, hits;
+    char pad[64-2*sizeof(unsigned long long)];
+} COUNTER;
+
+static DATA *data;
+static pthread_mutex_t lock=PTHREAD_MUTEX_INITIALIZER;
+static bool serialised;
+static volatile int running;
+static uint64_t oldest; // the live sessions are oldest..oldest+SESSIONS-1
+static COUNTER counters[DATA_READERS];
+static unsigned nreaders;
+
+// session numbers are random, the same number always gets the same key
+static void session_key(unsigned char *k, uint64_t session) {
+    uint64_t x=session;
+    for(unsigned i=0; i<KEY_LEN/8; ++i) { // splitmix64
+        uint64_t z=(x+=0x9e3779b97f4a7c15ULL);
+        z=(z^(z>>30))*0xbf58476d1ce4e5b9ULL;
+        z=(z^(z>>27))*0x94d049bb133111ebULL;
+        z^=z>>31;
+        memcpy(k+8*i, &z, 8);
+    }
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+static unsigned long long reads() {
+    unsigned long long n=0;
+    for(unsigned r=0; r<nreaders; ++r)
+        n+=__atomic_load_n(&counters[r].ops, __ATOMIC_RELAXED);
+    return n;
+}
+
+static void *reader(void *arg) {
+    const unsigned r=(uintptr_t)arg;
+    COUNTER &c=counters[r];
+    unsigned char key[KEY_LEN], val[MAX_VAL_LEN];
+    uint64_t x=r+1;
+    while(running) {
+        x^=x<<13; // xorshift64
+        x^=x>>7;
+        x^=x<<17;
+        session_key(key, __atomic_load_n(&oldest, __ATOMIC_RELAXED)+x%SESSIONS);
+        unsigned len;
+        bool hit;
+        if(serialised) {
+            const unsigned char *v;
+            pthread_mutex_lock(&lock);
+            hit=data->find(key, v, len);
+            if(hit)
+                memcpy(val, v, len);
+            pthread_mutex_unlock(&lock);
+        } else {
+            hit=data->read(key, val, len, r);
+        }
+        c.hits+=hit;
+        __atomic_store_n(&c.ops, c.ops+1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+// replace the oldest session with a new one, two writes
+static unsigned long long write_loop() {
+    static unsigned char val[VAL_LEN];
+    unsigned char key[KEY_LEN];
+    unsigned long long writes=0;
+    const double end=now()+DURATION;
+    while(now()<end) {
+        for(unsigned i=0; i<RECLAIM; ++i) {
+            while(writes*(100-WRITE_SHARE)>reads()*WRITE_SHARE && running)
+                sched_yield();
+            if(serialised)
+                pthread_mutex_lock(&lock);
+            session_key(key, oldest+SESSIONS);
+            data->insert(key, val, VAL_LEN, TIMEOUT);
+            session_key(key, oldest);
+            data->erase(key);
+            if(serialised)
+                pthread_mutex_unlock(&lock);
+            __atomic_store_n(&oldest, oldest+1, __ATOMIC_RELAXED);
+            writes+=2;
+        }
+        if(serialised)
+            pthread_mutex_lock(&lock);
+        data->reclaim();
+        if(serialised)
+            pthread_mutex_unlock(&lock);
+    }
+    return writes;
+}
+
+// Mops/s of a run, and the hit ratio of its reads
+static double run(const unsigned n, const bool mutex, double &hit_ratio) {
+    serialised=mutex;
+    nreaders=n;
+    memset(counters, 0, sizeof counters);
+    running=1;
+    pthread_t threads[DATA_READERS];
+    for(unsigned r=0; r<n; ++r)
+        pthread_create(&threads[r], NULL, reader, (void *)(uintptr_t)r);
+    const double start=now();
+    const unsigned long long writes=write_loop();
+    running=0;
+    const double elapsed=now()-start;
+    unsigned long long ops=0, hits=0;
+    for(unsigned r=0; r<n; ++r) {
+        pthread_join(threads[r], NULL);
+        ops+=counters[r].ops;
+        hits+=counters[r].hits;
+    }
+    hit_ratio=ops ? 100.0*hits/ops : 0;
+    return (ops+writes)/elapsed/1e6;
+}
+
+int main(int argc, char *argv[]) {
+    if(argc<2) {
+        fprintf(stderr, "Usage: %s readers...\n", argv[0]);
+        return 1;
+    }
+    data=new DATA(2*SESSIONS);
+    static unsigned char val[VAL_LEN];
+    unsigned char key[KEY_LEN];
+    for(uint64_t s=0; s<SESSIONS; ++s) {
+        session_key(key, s);
+        data->insert(key, val, VAL_LEN, TIMEOUT);
+    }
+    printf("%7s %14s %14s %10s\n", "readers", "mutex Mops/s", "lock-free", "hits");
+    for(int i=1; i<argc; ++i) {
+        const unsigned n=atoi(argv[i]);
+        if(n<1 || n>DATA_READERS) {
+            fprintf(stderr, "%s: 1-%d readers\n", argv[i], DATA_READERS);
+            return 1;
+        }
+        double h_mutex, h_free;
+        const double mutex=run(n, true, h_mutex);
+        const double lock_free=run(n, false, h_free);
+        printf("%7u %14.2f %14.2f %9.2f%%\n", n, mutex, lock_free, h_free);
+    }
+    delete data;
+    return 0;
+}
+
+// end of readbench.cpp
@@ -0,0 +1,86 @@
+// sessiond - SSL session cache daemon, file region.cpp
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+#include "region.h"
+#include <stdint.h>
+#include <sys/mman.h>
+
+REGION::REGION() : base(NULL), size(0), used(0), huge(false) {
+}
+
+REGION::~REGION() {
+    if(base)
+        munmap(base, size);
+}
+
+// reserve n bytes, rounded up to whole huge pages; false with errno set
+// if the memory cannot be mapped or locked
+bool REGION::map(const size_t n, const unsigned flags) {
+    if(!n)
+        return true;
+    size=(n+REGION_ALIGN-1)&~(size_t)(REGION_ALIGN-1);
+    void *p=MAP_FAILED;
+#ifdef MAP_HUGETLB
+    int populate=0;
+#ifdef MAP_POPULATE
+    if(flags&REGION_PREFAULT)
+        populate=MAP_POPULATE;
+#endif
+    p=mmap(NULL, size, PROT_READ|PROT_WRITE,
+        MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB|populate, -1, 0);
+    huge=p!=MAP_FAILED;
+#endif
+    if(!huge) {
+        // aligned to a huge page, so that all of it can be promoted
+        p=mmap(NULL, size+REGION_ALIGN, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if(p==MAP_FAILED)
+            return false;
+        const uintptr_t start=(uintptr_t)p;
+        const uintptr_t aligned=(start+REGION_ALIGN-1)&~(uintptr_t)(REGION_ALIGN-1);
+        if(aligned>start)
+            munmap(p, aligned-start);
+        munmap((void *)(aligned+size), start+REGION_ALIGN-aligned);
+        p=(void *)aligned;
+#ifdef MADV_HUGEPAGE
+        madvise(p, size, MADV_HUGEPAGE);
+#endif
+        if(flags&REGION_PREFAULT) // after madvise(), to fault huge pages in
+            for(size_t i=0; i<size; i+=4096)
+                ((volatile unsigned char *)p)[i]=0;
+    }
+    base=(unsigned char *)p;
+    used=0;
+    if(flags&REGION_LOCK && mlock(base, size))
+        return false;
+    return true;
+}
+
+// n more bytes, cache line aligned, NULL once the region is exhausted
+void *REGION::take(const size_t n) {
+    const size_t len=(n+63)&~(size_t)63;
+    if(!base || len>size-used)
+        return NULL;
+    void *p=base+used;
+    used+=len;
+    return p;
+}
+
+// end of region.cpp
@@ -0,0 +1,61 @@
+// sessiond - SSL session cache daemon, file region.h
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+#ifndef __REGION_H
+#define __REGION_H
+
+#include <stddef.h>
+
+#define REGION_ALIGN (2u<<20) // the size of a huge page on x86-64
+
+// mapping flags
+#define REGION_PREFAULT 1 // fault all the pages in at once
+#define REGION_LOCK 2 // and lock them in memory
+
+// REGION class - memory reserved up front and carved out by an allocator
+//
+// The region is backed by huge pages where the system has them reserved
+// (MAP_HUGETLB), and by transparent huge pages otherwise, so a cache
+// spread over gigabytes needs few TLB entries.  Memory taken from it is
+// never given back, an allocator turns to the heap once it runs out.
+class REGION {
+    unsigned char *base;
+    size_t size, used;
+    bool huge; // backed by MAP_HUGETLB pages
+public:
+    REGION();
+    ~REGION();
+    bool map(const size_t, const unsigned);
+    void *take(const size_t);
+    bool owns(const void *p) const {
+        return (const unsigned char *)p>=base &&
+            (const unsigned char *)p<base+size;
+    }
+    size_t bytes() const {
+        return size;
+    }
+    bool hugetlb() const {
+        return huge;
+    }
+};
+
+#endif // __REGION_H
+
+// end of region.h
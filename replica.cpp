@@ -0,0 +1,127 @@
+// sessiond - SSL session cache daemon, file replica.cpp
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+#include "replica.h"
+#include <string.h>
+#ifdef __WIN32__
+#include <winsock2.h>
+#else
+#include <arpa/inet.h>
+#endif
+
+#define REPL_MAX_OPS 255 // operations counted in a datagram header
+
+REPLICA::REPLICA() : node(0), worker(0), seq(0), len(0), count(0),
+        norigins(0), oldest(0), in(NULL), left(0), ops(0), lost(0) {
+}
+
+// set the instance and the worker that datagrams are sent from
+void REPLICA::origin(const uint32_t n, const uint16_t w) {
+    node=n;
+    worker=w;
+}
+
+// batch an operation, false if it would not fit the current datagram
+bool REPLICA::add(const CACHE_PACKET &packet, const unsigned l) {
+    if(!count)
+        len=sizeof(CACHE_REPL_HEADER);
+    if(count==REPL_MAX_OPS || len+2+l>sizeof out)
+        return false;
+    out[len]=l>>8;
+    out[len+1]=l&0xff;
+    memcpy(out+len+2, &packet, l);
+    len+=2+l;
+    ++count;
+    return true;
+}
+
+// number the batched operations and start a new batch; the datagram
+// returned is valid until the next add()
+const unsigned char *REPLICA::seal(size_t &l) {
+    CACHE_REPL_HEADER h;
+    h.version=CACHE_REPL_VERSION;
+    h.count=count;
+    h.worker=htons(worker);
+    h.node=node;
+    h.seq=htonl(++seq);
+    memcpy(out, &h, sizeof h);
+    l=len;
+    count=0;
+    return out;
+}
+
+// check a datagram received from a peer, its operations are then
+// returned by next(); false if it is malformed
+bool REPLICA::accept(const unsigned char *d, const size_t l) {
+    CACHE_REPL_HEADER h;
+    ops=0;
+    if(l<sizeof h)
+        return false;
+    memcpy(&h, d, sizeof h);
+    if(h.node==node) // our own, sent back by a peer
+        return true;
+    const uint16_t w=ntohs(h.worker);
+    const uint32_t s=ntohl(h.seq);
+    unsigned i;
+    for(i=0; i<norigins; ++i)
+        if(origins[i].node==h.node && origins[i].worker==w)
+            break;
+    if(i<norigins) {
+        const int32_t ahead=s-origins[i].seq;
+        if(ahead<=0) // a duplicate or a late one
+            return true;
+        lost+=ahead-1;
+    } else if(norigins<REPL_ORIGINS) {
+        ++norigins;
+    } else { // follow the new one instead of the longest followed
+        i=oldest;
+        oldest=(oldest+1)%REPL_ORIGINS;
+    }
+    origins[i].node=h.node;
+    origins[i].worker=w;
+    origins[i].seq=s;
+    in=d+sizeof h;
+    left=l-sizeof h;
+    ops=h.count;
+    return true;
+}
+
+// the next operation of the accepted datagram
+bool REPLICA::next(CACHE_PACKET &packet, unsigned &l) {
+    if(!ops || left<2)
+        return false;
+    l=in[0]<<8|in[1];
+    if(l<CACHE_HDR_LEN || l>sizeof packet || l>left-2) {
+        ops=0;
+        return false;
+    }
+    memcpy(&packet, in+2, l);
+    in+=2+l;
+    left-=2+l;
+    --ops;
+    if(packet.version!=1 ||
+            (packet.type!=CACHE_CMD_NEW && packet.type!=CACHE_CMD_REMOVE)) {
+        ops=0;
+        return false;
+    }
+    return true;
+}
+
+// end of replica.cpp
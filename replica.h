@@ -0,0 +1,72 @@
+// sessiond - SSL session cache daemon, file replica.h
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+#ifndef __REPLICA_H
+#define __REPLICA_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "protocol.h"
+
+#define REPL_ORIGINS 64 // peer workers whose sequence numbers are followed
+
+// a worker of a peer sending replication datagrams to this one
+typedef struct {
+    uint32_t node;
+    uint16_t worker;
+    uint32_t seq; // of the last datagram accepted
+} ORIGIN;
+
+// REPLICA class - replication datagrams of a single worker
+//
+// NEW and REMOVE operations served by the worker are batched into an
+// outgoing datagram, numbered per worker once sealed.  A datagram received
+// from a peer is accepted unless it is older than one seen before from the
+// same worker, so operations are never applied out of order; the gaps in
+// the sequence are counted as lost datagrams.
+class REPLICA {
+    uint32_t node; // random ID of this instance
+    uint16_t worker;
+    uint32_t seq;
+    unsigned char out[CACHE_DGRAM_LEN];
+    size_t len;
+    unsigned count;
+    ORIGIN origins[REPL_ORIGINS];
+    unsigned norigins, oldest;
+    const unsigned char *in; // the operations of an accepted datagram
+    size_t left;
+    unsigned ops;
+public:
+    unsigned long long lost; // datagrams missing from the peer sequences
+
+    REPLICA();
+    void origin(const uint32_t, const uint16_t);
+    bool add(const CACHE_PACKET &, const unsigned);
+    unsigned pending() const { // operations not sent yet
+        return count;
+    }
+    const unsigned char *seal(size_t &);
+    bool accept(const unsigned char *, const size_t);
+    bool next(CACHE_PACKET &, unsigned &);
+};
+
+#endif // __REPLICA_H
+
+// end of replica.h
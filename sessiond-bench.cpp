@@ -0,0 +1,411 @@
+// sessiond - SSL session cache daemon, file sessiond-bench.cpp
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+// Open-loop load generator: every thread sends its share of the target
+// rate of NEW, GET and REMOVE requests on schedule, whether the replies
+// keep up or not, and the latency of a GET is measured from the time it
+// was due to be sent, so that a stalled server is not hidden by a stalled
+// client.  Keys are drawn uniformly or from a Zipf distribution, values
+// are sized like DER encoded sessions.  Unless -n is given, every key is
+// stored once before the run.
+
+#include "protocol.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <vector>
+using namespace std;
+
+#define MAX_THREADS 64
+#define SESSION_TIMEOUT 3600 // seconds
+#define LOST_AFTER 1000000000LL // nanoseconds without a reply
+#define SWEEP 100000000LL // nanoseconds between checks for lost GETs
+#define BURST 64 // requests sent with a single sendmmsg call
+#define SUB_BITS 7 // histogram precision, below 1%
+
+static struct sockaddr_in server;
+static unsigned nthreads=1, seconds=10, nkeys=100000;
+static double rate=10000, zipf=0;
+static unsigned mix[3]={10, 85, 5}; // NEW, GET and REMOVE percentages
+static unsigned min_len=100, max_len=250;
+static vector<double> cdf; // of the Zipf distribution
+static int64_t start;
+
+static int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+
+// a random key spread over the workers by its first 4 bytes,
+// with its number in the next 4 bytes
+static void make_key(unsigned char *k, const uint32_t n) {
+    uint64_t x=n;
+    for(unsigned i=0; i<KEY_LEN/8; ++i) { // splitmix64
+        uint64_t z=(x+=0x9e3779b97f4a7c15ULL);
+        z=(z^(z>>30))*0xbf58476d1ce4e5b9ULL;
+        z=(z^(z>>27))*0x94d049bb133111ebULL;
+        z^=z>>31;
+        memcpy(k+8*i, &z, 8);
+    }
+    k[4]=n>>24;
+    k[5]=n>>16;
+    k[6]=n>>8;
+    k[7]=n;
+}
+
+static uint32_t key_number(const unsigned char *k) {
+    return (uint32_t)k[4]<<24|(uint32_t)k[5]<<16|(uint32_t)k[6]<<8|k[7];
+}
+
+// HISTOGRAM class - log-linear buckets, like an HDR histogram
+class HISTOGRAM {
+    vector<unsigned long long> counts;
+    unsigned long long total, max;
+
+    static unsigned index(const uint64_t v) {
+        if(v<(1u<<SUB_BITS))
+            return v;
+        const unsigned e=63-__builtin_clzll(v)-(SUB_BITS-1);
+        return (e<<(SUB_BITS-1))+(v>>e);
+    }
+    static uint64_t value(const unsigned i) { // the lowest in the bucket
+        if(i<(1u<<SUB_BITS))
+            return i;
+        const unsigned e=(i>>(SUB_BITS-1))-1;
+        return (uint64_t)((i&((1u<<(SUB_BITS-1))-1))+(1u<<(SUB_BITS-1)))<<e;
+    }
+public:
+    HISTOGRAM() : counts(64<<(SUB_BITS-1), 0), total(0), max(0) {}
+    void record(const uint64_t v) {
+        ++counts[index(v)];
+        ++total;
+        if(v>max)
+            max=v;
+    }
+    void merge(const HISTOGRAM &h) {
+        for(size_t i=0; i<counts.size(); ++i)
+            counts[i]+=h.counts[i];
+        total+=h.total;
+        if(h.max>max)
+            max=h.max;
+    }
+    uint64_t percentile(const double p) const {
+        const unsigned long long rank=(unsigned long long)ceil(p/100*total);
+        unsigned long long seen=0;
+        for(size_t i=0; i<counts.size(); ++i)
+            if((seen+=counts[i])>=rank && seen)
+                return value(i);
+        return max;
+    }
+    uint64_t maximum() const {
+        return max;
+    }
+};
+
+typedef struct {
+    pthread_t thread;
+    unsigned id;
+    unsigned long long sent[3], replies, hits, lost;
+    HISTOGRAM latency; // of the GETs, in nanoseconds
+} THREAD;
+
+static uint64_t next_random(uint64_t &s) { // xorshift64*
+    s^=s>>12;
+    s^=s<<25;
+    s^=s>>27;
+    return s*0x2545f4914f6cdd1dULL;
+}
+
+static uint32_t pick_key(uint64_t &s) {
+    if(cdf.empty())
+        return next_random(s)%nkeys;
+    const double u=cdf.back()*(next_random(s)>>11)/9007199254740992.0;
+    const size_t k=lower_bound(cdf.begin(), cdf.end(), u)-cdf.begin();
+    return k<nkeys ? k : nkeys-1;
+}
+
+static unsigned pick_len(uint64_t &s) { // the sum of two uniform halves
+    const unsigned span=max_len-min_len;
+    return min_len+(next_random(s)%(span/2+1))+(next_random(s)%(span-span/2+1));
+}
+
+static int open_socket() {
+    const int sock=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(sock==-1 || connect(sock, (struct sockaddr *)&server, sizeof server)==-1) {
+        perror("socket");
+        exit(1);
+    }
+    const int size=4<<20;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof size);
+    return sock;
+}
+
+// store every key once, waiting for a GET every BURST packets
+static void populate() {
+    const int sock=open_socket();
+    uint64_t s=1;
+    CACHE_PACKET p;
+    memset(&p, 0, sizeof p);
+    p.version=1;
+    p.timeout=htons(SESSION_TIMEOUT);
+    for(uint32_t k=0; k<nkeys; ++k) {
+        p.type=CACHE_CMD_NEW;
+        make_key(p.key, k);
+        send(sock, &p, CACHE_HDR_LEN+pick_len(s), 0);
+        if(k%BURST==BURST-1 || k==nkeys-1) {
+            p.type=CACHE_CMD_GET;
+            send(sock, &p, CACHE_HDR_LEN, 0);
+            struct pollfd pfd={sock, POLLIN, 0};
+            if(poll(&pfd, 1, 1000)!=1) {
+                fprintf(stderr, "no reply from the server\n");
+                exit(1);
+            }
+            recv(sock, &p, sizeof p, 0);
+        }
+    }
+    close(sock);
+}
+
+static void *load(void *arg) {
+    THREAD &t=*(THREAD *)arg;
+    const int sock=open_socket();
+    uint64_t s=0x9e3779b97f4a7c15ULL*(t.id+1);
+    const double interval=1e9*nthreads/rate; // between requests of this thread
+    const int64_t end=start+(int64_t)seconds*1000000000;
+    map<uint32_t, deque<int64_t> > waiting; // GETs by key, oldest first
+    CACHE_PACKET packets[BURST];
+    struct iovec iov[BURST];
+    struct mmsghdr msgs[BURST];
+    memset(msgs, 0, sizeof msgs);
+    uint64_t n=0; // requests due so far
+    int64_t sweep=start+SWEEP;
+    for(;;) {
+        int64_t now=now_ns();
+        // send the requests that are due, a burst at a time to keep
+        // receiving the replies when behind the schedule
+        if(now<end) {
+            unsigned m=0;
+            for(; m<BURST; ++m) {
+                const int64_t due=start+(int64_t)(n*interval);
+                if(due>now)
+                    break;
+                CACHE_PACKET &p=packets[m];
+                const unsigned r=next_random(s)%100;
+                const int op=r<mix[0] ? 0 : r<mix[0]+mix[1] ? 1 : 2;
+                const uint32_t k=pick_key(s);
+                p.version=1;
+                p.type=op==0 ? CACHE_CMD_NEW : op==1 ? CACHE_CMD_GET : CACHE_CMD_REMOVE;
+                p.timeout=htons(SESSION_TIMEOUT);
+                make_key(p.key, k);
+                iov[m].iov_base=&p;
+                iov[m].iov_len=CACHE_HDR_LEN+(op==0 ? pick_len(s) : 0);
+                msgs[m].msg_hdr.msg_iov=&iov[m];
+                msgs[m].msg_hdr.msg_iovlen=1;
+                ++t.sent[op];
+                if(op==1)
+                    waiting[k].push_back(due);
+                ++n;
+            }
+            for(unsigned done=0; done<m; ) { // a full buffer is waited for
+                const int r=sendmmsg(sock, msgs+done, m-done, 0);
+                if(r>0)
+                    done+=r;
+                else if(r==-1 && errno!=EINTR)
+                    break;
+            }
+        }
+        // receive the replies
+        CACHE_PACKET p;
+        ssize_t len;
+        while((len=recv(sock, &p, sizeof p, MSG_DONTWAIT))>=(ssize_t)CACHE_HDR_LEN) {
+            const int64_t at=now_ns();
+            map<uint32_t, deque<int64_t> >::iterator w=waiting.find(key_number(p.key));
+            if(w==waiting.end()) // already counted as lost
+                continue;
+            t.latency.record(at-w->second.front());
+            w->second.pop_front();
+            if(w->second.empty())
+                waiting.erase(w);
+            ++t.replies;
+            if(p.type==CACHE_RESP_OK)
+                ++t.hits;
+        }
+        now=now_ns();
+        if(now>=sweep) { // give up on the GETs without a reply for too long
+            for(map<uint32_t, deque<int64_t> >::iterator w=waiting.begin(); w!=waiting.end(); ) {
+                while(!w->second.empty() && w->second.front()<now-LOST_AFTER) {
+                    w->second.pop_front();
+                    ++t.lost;
+                }
+                if(w->second.empty())
+                    waiting.erase(w++);
+                else
+                    ++w;
+            }
+            sweep=now+SWEEP;
+        }
+        if(now>=end && (waiting.empty() || now>=end+LOST_AFTER))
+            break;
+        // wait for a reply or the next request
+        int64_t wait=now<end ? start+(int64_t)(n*interval)-now : end+LOST_AFTER-now;
+        if(wait>SWEEP)
+            wait=SWEEP;
+        if(wait>0) {
+            struct pollfd pfd={sock, POLLIN, 0};
+            const struct timespec ts={0, (long)wait};
+            ppoll(&pfd, 1, &ts, NULL);
+        }
+    }
+    for(map<uint32_t, deque<int64_t> >::iterator w=waiting.begin(); w!=waiting.end(); ++w)
+        t.lost+=w->second.size();
+    close(sock);
+    return NULL;
+}
+
+static void usage(const char *bin_path) {
+    fprintf(stderr, "Usage: %s [-t threads] [-r rate] [-d seconds] [-k keys] [-z exponent] [-m new:get:remove] [-v min-max] [-n] <host> <udp port>\n", bin_path);
+    fprintf(stderr, "  -t threads          sending threads, each with its own socket (1-%d, default 1)\n", MAX_THREADS);
+    fprintf(stderr, "  -r rate             requests per second in total (default 10000)\n");
+    fprintf(stderr, "  -d seconds          duration of the run (default 10)\n");
+    fprintf(stderr, "  -k keys             number of sessions (default 100000)\n");
+    fprintf(stderr, "  -z exponent         Zipf distributed keys (default 0, uniform)\n");
+    fprintf(stderr, "  -m new:get:remove   percentages of the requests (default 10:85:5)\n");
+    fprintf(stderr, "  -v min-max          value lengths (default 100-250)\n");
+    fprintf(stderr, "  -n                  do not store the keys before the run\n");
+}
+
+int main(int argc, char *argv[]) {
+    bool fill=true;
+    int opt;
+    while((opt=getopt(argc, argv, "t:r:d:k:z:m:v:n"))!=-1) {
+        switch(opt) {
+        case 't':
+            nthreads=atoi(optarg);
+            break;
+        case 'r':
+            rate=atof(optarg);
+            break;
+        case 'd':
+            seconds=atoi(optarg);
+            break;
+        case 'k':
+            nkeys=atoi(optarg);
+            break;
+        case 'z':
+            zipf=atof(optarg);
+            break;
+        case 'm':
+            if(sscanf(optarg, "%u:%u:%u", &mix[0], &mix[1], &mix[2])!=3 ||
+                    mix[0]+mix[1]+mix[2]!=100) {
+                fprintf(stderr, "the percentages must add up to 100.\n");
+                return 1;
+            }
+            break;
+        case 'v':
+            if(sscanf(optarg, "%u-%u", &min_len, &max_len)!=2 ||
+                    min_len>max_len || max_len>MAX_VAL_LEN) {
+                fprintf(stderr, "illegal value lengths.\n");
+                return 1;
+            }
+            break;
+        case 'n':
+            fill=false;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if(argc-optind!=2 || nthreads<1 || nthreads>MAX_THREADS || rate<=0 ||
+            !seconds || !nkeys || zipf<0) {
+        usage(argv[0]);
+        return 1;
+    }
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family=AF_INET;
+    hints.ai_socktype=SOCK_DGRAM;
+    const int error=getaddrinfo(argv[optind], NULL, &hints, &result);
+    if(error) {
+        fprintf(stderr, "error in getaddrinfo: %s\n", gai_strerror(error));
+        return 1;
+    }
+    server=*(struct sockaddr_in *)result->ai_addr;
+    server.sin_port=htons(atoi(argv[optind+1]));
+    freeaddrinfo(result);
+
+    if(zipf>0) {
+        cdf.resize(nkeys);
+        double sum=0;
+        for(unsigned i=0; i<nkeys; ++i)
+            cdf[i]=sum+=1/pow(i+1, zipf);
+    }
+    if(fill)
+        populate();
+
+    static THREAD threads[MAX_THREADS];
+    start=now_ns();
+    for(unsigned i=0; i<nthreads; ++i) {
+        threads[i].id=i;
+        if(pthread_create(&threads[i].thread, NULL, load, &threads[i])) {
+            perror("pthread_create");
+            return 1;
+        }
+    }
+    unsigned long long sent[3]={0, 0, 0}, replies=0, hits=0, lost=0;
+    HISTOGRAM latency;
+    for(unsigned i=0; i<nthreads; ++i) {
+        pthread_join(threads[i].thread, NULL);
+        for(int op=0; op<3; ++op)
+            sent[op]+=threads[i].sent[op];
+        replies+=threads[i].replies;
+        hits+=threads[i].hits;
+        lost+=threads[i].lost;
+        latency.merge(threads[i].latency);
+    }
+    const unsigned long long total=sent[0]+sent[1]+sent[2];
+    printf("sent %llu requests in %us: %.0f/s (target %.0f/s), new %llu, get %llu, remove %llu\n",
+        total, seconds, (double)total/seconds, rate, sent[0], sent[1], sent[2]);
+    printf("get replies %llu, hit ratio %.2f%%, lost %llu (%.3f%%)\n",
+        replies, replies ? 100.0*hits/replies : 0.0, lost,
+        sent[1] ? 100.0*lost/sent[1] : 0.0);
+    printf("get latency (us): p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+        latency.percentile(50)/1e3, latency.percentile(90)/1e3,
+        latency.percentile(99)/1e3, latency.percentile(99.9)/1e3,
+        latency.maximum()/1e3);
+    return 0;
+}
+
+// end of sessiond-bench.cpp
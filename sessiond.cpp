@@ -18,12 +18,19 @@
 // a combined work based on sessiond. Thus, the terms and conditions of
 // the GNU General Public License cover the whole combination.
 
+#include "data.h"
 #include "log.h"
+#include "mirror.h"
+#include "tier.h"
+#include "protocol.h"
+#include "uring.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <signal.h>
+#include <limits.h>
+#include <stddef.h>
 #ifdef __WIN32__
 #include <winsock2.h>
 #else
@@ -33,41 +40,251 @@
 #include <sys/types.h>
 #include <arpa/inet.h>
 #endif
+#ifdef __linux__
+#include <stdint.h>
+#include <pthread.h>
+#include <linux/filter.h>
+#endif
 
 // logging is performed every 5 minutes
 #define LOG_FREQ 300
+// requests received with a single system call by default
+#ifdef __linux__
+#define DEFAULT_BATCH 32
+#else
+#define DEFAULT_BATCH 1
+#endif
+#define MAX_BATCH 1024
+#define MAX_WORKERS 64
+#define MAX_PEERS 16
 static const char* ANY_STRING = "any";
 
-void process_request(const int, const unsigned short, const unsigned long, LOG &); // defined in comm.cpp
+void init_workers(const int *, const unsigned, const unsigned, const size_t, const size_t); // defined in comm.cpp
+bool preallocate(const unsigned, LOG &); // defined in comm.cpp
+void init_replication(const struct sockaddr_in *, const unsigned); // defined in comm.cpp
+void init_admission(const unsigned); // defined in comm.cpp
+void process_request(const unsigned, const unsigned short, const unsigned long, LOG &); // defined in comm.cpp
+#ifdef __linux__
+void process_batch(const unsigned, const unsigned short, const unsigned long, const unsigned, LOG &); // defined in comm.cpp
+static bool steer(const int, const unsigned, const bool);
+static void *worker_thread(void *);
+static void worker_loop(const unsigned, LOG &);
+#endif
+#ifdef HAVE_URING
+bool init_uring(const unsigned); // defined in comm.cpp
+void process_uring(const unsigned, const unsigned short, const unsigned long, const unsigned, LOG &); // defined in comm.cpp
+#endif
+#ifndef __WIN32__
+void park_worker(); // defined in comm.cpp
+void load_cache(const char *, LOG &); // defined in comm.cpp
+bool save_cache(const char *, LOG &); // defined in comm.cpp
+bool init_trace(const char *); // defined in comm.cpp
+void start_trace(); // defined in comm.cpp
+void close_trace(LOG &); // defined in comm.cpp
+bool init_mirror(const char *, const size_t); // defined in comm.cpp
+void close_mirror(); // defined in comm.cpp
+bool init_tier(const char *, const size_t); // defined in comm.cpp
+#endif
 void my_perror(const char *); // defined in comm.cpp
 #ifdef __WIN32__
 static void log_thread(void *);
 #else
 static void signal_handler(int);
+static void stop_handler(int);
 #endif
 static void send_empty();
+static bool resolve_peer(const char *, struct sockaddr_in &);
 static unsigned short port;
 static struct sockaddr_in listen_address;
 static int s;
+static unsigned batch=DEFAULT_BATCH;
+static LOG *worker_log;
+static bool use_uring=false;
+static char *cache_file=NULL; // saved on SIGTERM or SIGINT, loaded on startup
+static volatile sig_atomic_t stopping=0;
+
+static inline bool stopped() { // by stop_handler()
+    return __atomic_load_n(&stopping, __ATOMIC_RELAXED);
+}
 
 void usage( const char *bin_path )
 {
-    fprintf(stderr, "Usage: %s <hostname|ipv4|'%s'> <udp port>\n", bin_path, ANY_STRING);
+    fprintf(stderr, "Usage: %s [-f] [-u] [-b batch] [-w workers] [-g] [-m mb] [-n sessions] [-p|-P] [-c file] [-r host:port]... [-l rate] [-t file] [-s name[:mb]] [-o file[:gb]] <hostname|ipv4|'%s'> <udp port>\n", bin_path, ANY_STRING);
+    fprintf(stderr, "  -f          stay in the foreground\n");
+    fprintf(stderr, "  -u          serve with io_uring where available (Linux 6.0)\n");
+    fprintf(stderr, "  -b batch    requests received per system call (1-%d, default %d)\n", MAX_BATCH, DEFAULT_BATCH);
+    fprintf(stderr, "  -w workers  serving threads, each with a shard of the cache (1-%d, default 1)\n", MAX_WORKERS);
+    fprintf(stderr, "  -g          spread GETs over all the workers rather than to the owners of their keys\n");
+    fprintf(stderr, "  -m mb       megabytes of sessions cached at most (default no limit)\n");
+    fprintf(stderr, "  -n sessions sessions cached at most (default %u)\n", (unsigned)MAX_CONCURRENT_SESSIONS);
+    fprintf(stderr, "  -p          reserve the memory of the whole cache at startup, in huge pages\n");
+    fprintf(stderr, "  -P          reserve it, fault it in and lock it in memory\n");
+    fprintf(stderr, "  -c file     load the cache from file, save it there on SIGTERM/SIGINT\n");
+    fprintf(stderr, "  -r peer     replicate new and removed sessions to another instance (up to %d)\n", MAX_PEERS);
+    fprintf(stderr, "  -l rate     requests per second served to each source address (default no limit)\n");
+    fprintf(stderr, "  -t file     capture the requests served to a trace file, see tracereplay\n");
+    fprintf(stderr, "  -s name[:mb] publish the sessions in shared memory for local clients (default %dMB)\n", MIRROR_DEFAULT_MB);
+    fprintf(stderr, "  -o file[:gb] demote the sessions evicted from memory to files on disk (default %dGB)\n", TIER_DEFAULT_GB);
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 3) 
+    bool foreground=false;
+    unsigned nworkers=1;
+    size_t budget=0;
+    size_t capacity=MAX_CONCURRENT_SESSIONS;
+    bool prealloc=false;
+    unsigned prealloc_flags=0; // REGION flags
+    const char *peer_args[MAX_PEERS];
+    unsigned npeers=0;
+    unsigned rate=0;
+    const char *trace_file=NULL;
+    char *mirror_name=NULL;
+    bool spread=false; // GETs over all the workers
+    size_t mirror_size=(size_t)MIRROR_DEFAULT_MB<<20;
+    char *tier_file=NULL;
+    size_t tier_size=(size_t)TIER_DEFAULT_GB<<30;
+    int opt;
+    while((opt=getopt(argc, argv, "fub:w:gm:n:pPc:r:l:t:s:o:"))!=-1) {
+        switch(opt) {
+        case 'f':
+            foreground=true;
+            break;
+        case 'u':
+            use_uring=true;
+            break;
+        case 'b':
+            batch=atoi(optarg);
+            if(batch<1 || batch>MAX_BATCH) {
+                fprintf(stderr, "illegal batch size.\n");
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'w':
+            nworkers=atoi(optarg);
+#ifdef __linux__
+            if(nworkers<1 || nworkers>MAX_WORKERS) {
+#else
+            if(nworkers!=1) { // SO_REUSEPORT and recvmmsg are required
+#endif
+                fprintf(stderr, "illegal number of workers.\n");
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'g':
+            spread=true;
+            break;
+        case 'm':
+            budget=(size_t)atol(optarg)<<20;
+            if(atol(optarg)<1) {
+                fprintf(stderr, "illegal memory limit.\n");
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'n':
+            capacity=atol(optarg);
+            if(atol(optarg)<1 || capacity>ARENA_NONE-(1u<<ARENA_BLOCK_BITS)) {
+                fprintf(stderr, "illegal number of sessions.\n");
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'p':
+            prealloc=true;
+            break;
+        case 'P':
+            prealloc=true;
+            prealloc_flags=REGION_PREFAULT|REGION_LOCK;
+            break;
+#ifndef __WIN32__
+        case 'c':
+            if(optarg[0]=='/') {
+                cache_file=strdup(optarg);
+            } else { // daemon() changes the directory
+                char cwd[PATH_MAX];
+                if(!getcwd(cwd, sizeof cwd)) {
+                    perror("getcwd");
+                    return 1;
+                }
+                cache_file=(char *)malloc(strlen(cwd)+strlen(optarg)+2);
+                sprintf(cache_file, "%s/%s", cwd, optarg);
+            }
+            break;
+#endif
+        case 'r':
+            if(npeers==MAX_PEERS) {
+                fprintf(stderr, "too many peers.\n");
+                usage(argv[0]);
+                return 1;
+            }
+            peer_args[npeers++]=optarg;
+            break;
+        case 'l':
+            if(atoi(optarg)<1) {
+                fprintf(stderr, "illegal rate.\n");
+                usage(argv[0]);
+                return 1;
+            }
+            rate=atoi(optarg);
+            break;
+        case 't':
+            trace_file=optarg;
+            break;
+#ifndef __WIN32__
+        case 's': {
+            mirror_name=optarg;
+            char *colon=strchr(optarg, ':');
+            if(colon) {
+                *colon='\0';
+                mirror_size=(size_t)atol(colon+1)<<20;
+                if(atol(colon+1)<1) {
+                    fprintf(stderr, "illegal shared memory size.\n");
+                    usage(argv[0]);
+                    return 1;
+                }
+            }
+            break;
+        }
+        case 'o': {
+            tier_file=optarg;
+            char *colon=strchr(optarg, ':');
+            if(colon) {
+                *colon='\0';
+                tier_size=(size_t)atol(colon+1)<<30;
+                if(atol(colon+1)<1) {
+                    fprintf(stderr, "illegal disk tier size.\n");
+                    usage(argv[0]);
+                    return 1;
+                }
+            }
+            break;
+        }
+#endif
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if(spread && tier_file) { // a GET may need the disk tier of its owner
+        fprintf(stderr, "-g cannot be used with -o.\n");
+        usage(argv[0]);
+        return 1;
+    }
+    if (argc-optind != 2) 
     {
-        fprintf(stderr, "Invalid number of arguments. Expected 2, got %d\n", argc-1);
+        fprintf(stderr, "Invalid number of arguments. Expected 2, got %d\n", argc-optind);
         usage(argv[0]);
         return 1;
     }
+    const char *host=argv[optind], *port_arg=argv[optind+1];
 
     // set the listen address 
     memset(&listen_address, 0, sizeof(listen_address));
 
     // parse the ip to listen on (can be 'any')
-    if ( strncmp(argv[1], ANY_STRING, sizeof(ANY_STRING)) == 0 )
+    if ( strncmp(host, ANY_STRING, sizeof(ANY_STRING)) == 0 )
     {
         listen_address.sin_addr.s_addr = htonl(INADDR_ANY);
     }
@@ -75,7 +292,7 @@ int main(int argc, char *argv[]) {
     {
         struct addrinfo *result;
         int error;
-        error = getaddrinfo(argv[1], NULL, NULL, &result);
+        error = getaddrinfo(host, NULL, NULL, &result);
         if (error != 0)
         { 
             fprintf(stderr, "error in getaddrinfo: %s\n", gai_strerror(error));
@@ -88,7 +305,7 @@ int main(int argc, char *argv[]) {
     }
 
     // parse the port number
-    port=atoi(argv[2]);
+    port=atoi(port_arg);
     if(port == 0) {
         fprintf(stderr, "illegal port number.\n");
         usage(argv[0]);
@@ -110,21 +327,61 @@ int main(int argc, char *argv[]) {
     }
 #endif
 
-    // create the socket
-    s=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-    if(s==-1) {
-        my_perror("socket");
-        return 1;
-    }
-
-    // bind it to the specified port
+    // create a socket for each worker
+    int sockets[MAX_WORKERS];
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof addr);
     addr.sin_family = AF_INET;
     addr.sin_port = htons(port);
     addr.sin_addr.s_addr = listen_address.sin_addr.s_addr; // already in network byte order
-    if(bind(s, (struct sockaddr *)&addr, sizeof addr)==-1) {
-        my_perror("bind");
+    for(unsigned w=0; w<nworkers; ++w) {
+        sockets[w]=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        if(sockets[w]==-1) {
+            my_perror("socket");
+            return 1;
+        }
+#ifdef __linux__
+        // workers share the port, the kernel spreads packets among them
+        const int one=1;
+        if(nworkers>1 && setsockopt(sockets[w], SOL_SOCKET, SO_REUSEPORT,
+                (const char *)&one, sizeof one)==-1) {
+            my_perror("SO_REUSEPORT");
+            return 1;
+        }
+#endif
+
+        // bind it to the specified port
+        if(bind(sockets[w], (struct sockaddr *)&addr, sizeof addr)==-1) {
+            my_perror("bind");
+            return 1;
+        }
+    }
+    s=sockets[0];
+#ifdef __linux__
+    if(nworkers>1 && !steer(s, nworkers, spread))
+        my_perror("SO_ATTACH_REUSEPORT_CBPF (requests will be forwarded between workers)");
+#endif
+    init_workers(sockets, nworkers, batch, capacity, budget);
+    if(npeers) {
+        struct sockaddr_in peers[MAX_PEERS];
+        for(unsigned p=0; p<npeers; ++p)
+            if(!resolve_peer(peer_args[p], peers[p])) {
+                usage(argv[0]);
+                return 1;
+            }
+        init_replication(peers, npeers);
+    }
+    init_admission(rate);
+    if(trace_file && !init_trace(trace_file)) {
+        my_perror(trace_file);
+        return 1;
+    }
+    if(mirror_name && !init_mirror(mirror_name, mirror_size)) {
+        my_perror(mirror_name);
+        return 1;
+    }
+    if(tier_file && !init_tier(tier_file, tier_size)) {
+        my_perror(tier_file);
         return 1;
     }
 
@@ -135,22 +392,120 @@ int main(int argc, char *argv[]) {
 #else
 
 #ifdef DAEMONISE
-    int ret = daemon(0, 0);
+    int ret = foreground ? 0 : daemon(0, 0);
     if ( ret != 0 )
     {
         my_perror("daemonise");
         return 1;
     }
+#endif
+    log.start(); // in the daemon
+#ifndef __WIN32__
+    start_trace();
 #endif
     signal(SIGUSR1, signal_handler);
     signal(SIGALRM, signal_handler);
     alarm(LOG_FREQ);
     log.msg(LOG_NOTICE, "sessiond(version %s) started", VERSION);
+    if(prealloc && !preallocate(prealloc_flags, log))
+        return 1;
+    if(cache_file)
+        load_cache(cache_file, log);
+    if(cache_file || trace_file || mirror_name) { // to be saved, flushed or withdrawn on stop
+        // no SA_RESTART: the blocking calls of worker 0 are interrupted
+        struct sigaction sa;
+        memset(&sa, 0, sizeof sa);
+        sa.sa_handler=stop_handler;
+        sigaction(SIGTERM, &sa, NULL);
+        sigaction(SIGINT, &sa, NULL);
+    }
+#endif
+#ifdef __linux__
+    if(nworkers>1) {
+        // signals are only handled by the main thread
+        sigset_t set, old;
+        sigemptyset(&set);
+        sigaddset(&set, SIGUSR1);
+        sigaddset(&set, SIGALRM);
+        sigaddset(&set, SIGTERM);
+        sigaddset(&set, SIGINT);
+        pthread_sigmask(SIG_BLOCK, &set, &old);
+        worker_log=&log;
+        for(unsigned w=1; w<nworkers; ++w) {
+            pthread_t thread;
+            if(pthread_create(&thread, NULL, worker_thread, (void *)(uintptr_t)w)) {
+                log.msg(LOG_ERR, "Failed to start worker %u", w);
+                return 1;
+            }
+        }
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+    }
+    if(batch>1 || nworkers>1 || use_uring)
+        worker_loop(0, log); // returns once stopped
+#endif
+    while(!stopped()) // the main loop
+        process_request(0, port, listen_address.sin_addr.s_addr, log);
+#ifndef __WIN32__
+    close_trace(log); // stopped
+    close_mirror();
+    if(cache_file && !save_cache(cache_file, log))
+        return 1;
+#endif
+    return 0;
+}
+
+#ifdef __linux__
+
+// steer each request to the socket of the worker owning its key:
+// the first 4 bytes of the key (big endian) modulo the number of workers,
+// as computed by shard() in comm.cpp; a version 2 datagram goes to the
+// owner of its first key; with spread, a version 1 GET goes to a random
+// worker instead, which reads the owner's shard; packets too short to
+// hold a key abort the program, which returns 0
+static bool steer(const int sock, const unsigned n, const bool spread) {
+    struct sock_filter code[]={
+        BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 0), // version
+        BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, CACHE_V2_VERSION, 0, 2),
+        BPF_STMT(BPF_LD|BPF_W|BPF_ABS,
+            sizeof(CACHE_V2_HEADER)+offsetof(CACHE_OP, key)),
+        BPF_JUMP(BPF_JMP|BPF_JA, 5, 0, 0),
+        BPF_STMT(BPF_LD|BPF_B|BPF_ABS, 1), // type
+        BPF_JUMP(BPF_JMP|BPF_JEQ|BPF_K, // 0x100 is never a type byte
+            spread ? (__u32)CACHE_CMD_GET : 0x100u, 0, 2),
+        BPF_STMT(BPF_LD|BPF_W|BPF_ABS, (__u32)(SKF_AD_OFF+SKF_AD_RANDOM)),
+        BPF_JUMP(BPF_JMP|BPF_JA, 1, 0, 0),
+        BPF_STMT(BPF_LD|BPF_W|BPF_ABS, 4), // offsetof(CACHE_PACKET, key)
+        BPF_STMT(BPF_ALU|BPF_MOD|BPF_K, n),
+        BPF_STMT(BPF_RET|BPF_A, 0),
+    };
+    struct sock_fprog prog={sizeof code/sizeof *code, code};
+    return setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+        &prog, sizeof prog)==0;
+}
+
+static void *worker_thread(void *arg) {
+    worker_loop((uintptr_t)arg, *worker_log);
+    park_worker(); // until worker 0 has saved the cache
+    return NULL;
+}
+
+static void worker_loop(const unsigned w, LOG &log) {
+#ifdef HAVE_URING
+    if(use_uring) {
+        if(init_uring(w)) { // in this thread, the ring has a single issuer
+            while(!stopped()) // the main loop of this worker
+                process_uring(w, port, listen_address.sin_addr.s_addr, batch, log);
+            return;
+        }
+        log.msg(LOG_WARNING, "io_uring unavailable, worker %u uses recvmmsg", w);
+    }
 #endif
-    for(;;) // the main loop
-        process_request(s, port, listen_address.sin_addr.s_addr, log);
+    while(!stopped()) // the main loop of this worker
+        process_batch(w, port, listen_address.sin_addr.s_addr, batch, log);
 }
 
+#endif // defined __linux__
+
 
 #ifdef __WIN32__
 
@@ -169,6 +524,10 @@ static void signal_handler(int sig) {
     send_empty();
 }
 
+static void stop_handler(int sig) {
+    stopping=1;
+}
+
 #endif // defined __WIN32__
 
 static void send_empty() { // send an empty UDP packet
@@ -180,4 +539,28 @@ static void send_empty() { // send an empty UDP packet
     sendto(s, "", 0, 0, (struct sockaddr *)&addr, sizeof addr);
 }
 
+// parse a peer given as host:port
+static bool resolve_peer(const char *arg, struct sockaddr_in &addr) {
+    const char *colon=strrchr(arg, ':');
+    if(!colon || !atoi(colon+1) || atoi(colon+1)>65535) {
+        fprintf(stderr, "illegal peer %s.\n", arg);
+        return false;
+    }
+    char host[256];
+    snprintf(host, sizeof host, "%.*s", (int)(colon-arg), arg);
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family=AF_INET;
+    hints.ai_socktype=SOCK_DGRAM;
+    const int error=getaddrinfo(host, NULL, &hints, &result);
+    if(error) {
+        fprintf(stderr, "error in getaddrinfo: %s\n", gai_strerror(error));
+        return false;
+    }
+    addr=*(struct sockaddr_in *)result->ai_addr;
+    addr.sin_port=htons(atoi(colon+1));
+    freeaddrinfo(result);
+    return true;
+}
+
 // end of sessiond.cpp
@@ -0,0 +1,132 @@
+// sessiond - SSL session cache daemon, file sketch.cpp
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+#include "sketch.h"
+#include <string.h>
+#include <algorithm>
+
+SKETCH::SKETCH() : size(0), shown_size(0), seq(0) {
+    memset(counts, 0, sizeof counts);
+}
+
+// the items are folded a word at a time and mixed (the murmur3 finalizer)
+static inline uint64_t item_hash(const unsigned char *p, const unsigned len) {
+    uint64_t h=len;
+    for(unsigned i=0; i<len; i+=8) {
+        uint64_t w=0;
+        if(len-i>=8) // a constant size, a single load
+            memcpy(&w, p+i, 8);
+        else
+            memcpy(&w, p+i, len-i);
+        h=(h^w)*0x9e3779b97f4a7c15ULL;
+    }
+    h=(h^(h>>33))*0xff51afd7ed558ccdULL;
+    h=(h^(h>>33))*0xc4ceb9fe1a85ec53ULL;
+    return h^(h>>33);
+}
+
+// count an item of len bytes, at most SKETCH_ITEM
+void SKETCH::add(const unsigned char *p, const unsigned len) {
+    const uint64_t h=item_hash(p, len);
+    // the rows are indexed by two halves of the hash combined
+    const uint32_t h1=(uint32_t)h, h2=(uint32_t)(h>>32)|1;
+    uint32_t est=~0u;
+    for(unsigned r=0; r<SKETCH_DEPTH; ++r) {
+        uint32_t &c=counts[r][(h1+r*h2)&(SKETCH_WIDTH-1)];
+        if(++c<est)
+            est=c;
+    }
+    // an item in the heap was counted at most est times before this
+    if(size==SKETCH_TOP && est<=top[0].count)
+        return;
+    for(unsigned i=0; i<size; ++i)
+        if(top[i].hash==h && top[i].len==len && !memcmp(top[i].item, p, len)) {
+            top[i].count=est;
+            sift(i);
+            return;
+        }
+    unsigned i=0;
+    if(size<SKETCH_TOP) { // append, then move up while below its parent
+        i=size++;
+        while(i && top[(i-1)/2].count>est) {
+            top[i]=top[(i-1)/2];
+            i=(i-1)/2;
+        }
+    }
+    // otherwise it replaces the least busy item, at the root
+    SKETCH_ENTRY &e=top[i];
+    e.hash=h;
+    e.count=est;
+    e.len=len;
+    memcpy(e.item, p, len);
+    if(i==0)
+        sift(0);
+}
+
+// move entry i down the heap while it is busier than a child
+void SKETCH::sift(unsigned i) {
+    const SKETCH_ENTRY e=top[i];
+    for(unsigned c; (c=2*i+1)<size; i=c) {
+        if(c+1<size && top[c+1].count<top[c].count)
+            ++c;
+        if(top[c].count>=e.count)
+            break;
+        top[i]=top[c];
+    }
+    top[i]=e;
+}
+
+// halve every count, which keeps the heap ordered
+void SKETCH::decay() {
+    for(unsigned r=0; r<SKETCH_DEPTH; ++r)
+        for(unsigned i=0; i<SKETCH_WIDTH; ++i)
+            counts[r][i]>>=1;
+    for(unsigned i=0; i<size; ++i)
+        top[i].count>>=1;
+}
+
+void SKETCH::publish() {
+    __atomic_store_n(&seq, seq+1, __ATOMIC_RELAXED); // odd: being written
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(shown, top, size*sizeof(SKETCH_ENTRY));
+    __atomic_store_n(&shown_size, size, __ATOMIC_RELAXED);
+    __atomic_store_n(&seq, seq+1, __ATOMIC_RELEASE); // even: stable
+}
+
+static bool busier(const SKETCH_ENTRY &a, const SKETCH_ENTRY &b) {
+    return a.count>b.count;
+}
+
+// copy the published entries into out, room for SKETCH_TOP, and return
+// how many there are; retried while the owner is publishing them
+const unsigned SKETCH::read(SKETCH_ENTRY *out) const {
+    unsigned n, s;
+    do {
+        while((s=__atomic_load_n(&seq, __ATOMIC_ACQUIRE))&1)
+            ;
+        n=__atomic_load_n(&shown_size, __ATOMIC_RELAXED);
+        memcpy(out, shown, n*sizeof(SKETCH_ENTRY));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while(__atomic_load_n(&seq, __ATOMIC_RELAXED)!=s);
+    std::sort(out, out+n, busier);
+    return n;
+}
+
+// end of sketch.cpp
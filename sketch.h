@@ -0,0 +1,68 @@
+// sessiond - SSL session cache daemon, file sketch.h
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+#ifndef __SKETCH_H
+#define __SKETCH_H
+
+#include <stdint.h>
+
+#define SKETCH_DEPTH 4 // rows of counters, each with its own hash
+#define SKETCH_WIDTH 1024 // counters per row, a power of 2
+#define SKETCH_TOP 16 // busiest items tracked
+#define SKETCH_ITEM 32 // bytes of an item at most, a session ID
+
+// a busy item and its estimated count
+typedef struct {
+    uint64_t hash; // of the item
+    uint32_t count;
+    uint32_t len;
+    unsigned char item[SKETCH_ITEM];
+} SKETCH_ENTRY;
+
+// SKETCH class - the busiest items of a stream in fixed memory
+//
+// A count-min sketch estimates how often each item was seen, from above,
+// and a min-heap keeps the SKETCH_TOP items with the largest estimates:
+// an item enters once its estimate exceeds the smallest of the heap, so
+// that most updates cost four counter increments and one comparison.
+// decay() halves all the counts, so that they follow recent traffic.
+// The sketch is updated by its owner only, which copies the heap out
+// with publish() for other threads to read() under a sequence number.
+class SKETCH {
+    uint32_t counts[SKETCH_DEPTH][SKETCH_WIDTH];
+    SKETCH_ENTRY top[SKETCH_TOP]; // a min-heap on count
+    unsigned size; // entries in top
+    SKETCH_ENTRY shown[SKETCH_TOP]; // the heap as last published
+    unsigned shown_size;
+    unsigned seq; // odd while shown is being written
+
+    void sift(unsigned);
+public:
+    SKETCH();
+    void add(const unsigned char *, const unsigned);
+    void decay();
+    void publish();
+    // from any thread, the entries as last published, the busiest first
+    const unsigned read(SKETCH_ENTRY *) const;
+};
+
+#endif // __SKETCH_H
+
+// end of sketch.h
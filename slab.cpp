@@ -0,0 +1,98 @@
+// sessiond - SSL session cache daemon, file slab.cpp
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+#include "slab.h"
+#include <sys/mman.h>
+
+// roughly 1/8 apart, so that at most ~12% of a chunk is wasted
+const unsigned SLAB::sizes[SLAB_CLASSES]={
+    32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512};
+
+SLAB::SLAB() : npages(0), region(NULL) {
+    // the page table never moves, values may be read concurrently
+    pages.reserve(1u<<(32-SLAB_INDEX_BITS));
+    unsigned c=0;
+    for(unsigned l=0; l<=MAX_VAL_LEN; ++l) {
+        while(sizes[c]<l)
+            ++c;
+        cls[l]=c;
+    }
+    for(c=0; c<SLAB_CLASSES; ++c) {
+        classes[c].free=classes[c].page=SLAB_NONE;
+        classes[c].next=0;
+        classes[c].chunks=0;
+    }
+}
+
+SLAB::~SLAB() {
+    for(size_t i=0; i<pages.size(); ++i)
+        if(!region || !region->owns(pages[i]))
+            munmap(pages[i], 1u<<SLAB_PAGE_BITS);
+}
+
+uint32_t SLAB::alloc(const unsigned len) {
+    if(len>MAX_VAL_LEN)
+        return SLAB_NONE;
+    CLASS &c=classes[cls[len]];
+    uint32_t ref;
+    if(c.free!=SLAB_NONE) { // reuse a released chunk
+        ref=c.free;
+        c.free=*(uint32_t *)ptr(ref, len);
+    } else {
+        if(c.page==SLAB_NONE ||
+                c.next>=(1u<<SLAB_PAGE_BITS)/sizes[cls[len]]) { // new page
+            if(pages.size()>=(1u<<(32-SLAB_INDEX_BITS))-1)
+                return SLAB_NONE;
+            void *p=region ? region->take(1u<<SLAB_PAGE_BITS) : NULL;
+            if(!p)
+                p=mmap(NULL, 1u<<SLAB_PAGE_BITS, PROT_READ|PROT_WRITE,
+                    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+            if(p==MAP_FAILED)
+                return SLAB_NONE;
+            c.page=pages.size();
+            c.next=0;
+            pages.push_back((unsigned char *)p);
+            __atomic_store_n(&npages, npages+1, __ATOMIC_RELEASE);
+        }
+        ref=c.page<<SLAB_INDEX_BITS|c.next++;
+    }
+    ++c.chunks;
+    return ref;
+}
+
+void SLAB::free(const uint32_t ref, const unsigned len) {
+    CLASS &c=classes[cls[len]];
+    *(uint32_t *)ptr(ref, len)=c.free; // link the chunk into the free list
+    c.free=ref;
+    --c.chunks;
+}
+
+size_t SLAB::memory() const {
+    return pages.size()<<SLAB_PAGE_BITS;
+}
+
+size_t SLAB::chunk_bytes() const {
+    size_t n=0;
+    for(unsigned c=0; c<SLAB_CLASSES; ++c)
+        n+=classes[c].chunks*sizes[c];
+    return n;
+}
+
+// end of slab.cpp
@@ -0,0 +1,81 @@
+// sessiond - SSL session cache daemon, file slab.h
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+#ifndef __SLAB_H
+#define __SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include "protocol.h" // MAX_VAL_LEN
+#include "region.h"
+
+#define SLAB_NONE 0xffffffff
+#define SLAB_PAGE_BITS 20 // 1MB pages
+#define SLAB_INDEX_BITS 16 // up to 65536 chunks per page
+#define SLAB_CLASSES 15
+
+// SLAB class - size-class allocator for session values
+//
+// Values are stored in fixed-size chunks carved out of 1MB pages, with
+// one free list per size class.  A value is referenced by a 32-bit
+// page/chunk number, and its class follows from its length, so no
+// per-value header is kept.  Pages are never returned to the system.
+class SLAB {
+    typedef struct {
+        uint32_t free; // head of the free list
+        uint32_t page; // page currently being carved, or SLAB_NONE
+        uint32_t next; // next unused chunk of that page
+        size_t chunks; // chunks handed out
+    } CLASS;
+    static const unsigned sizes[SLAB_CLASSES];
+    unsigned char cls[MAX_VAL_LEN+1]; // size class of each length
+    CLASS classes[SLAB_CLASSES];
+    std::vector<unsigned char *> pages;
+    uint32_t npages; // pages.size(), for concurrent readers
+    REGION *region; // preallocated pages, or NULL
+public:
+    SLAB();
+    ~SLAB();
+    void place(REGION *r) { // take the pages from r while it lasts
+        region=r;
+    }
+    uint32_t alloc(const unsigned);
+    void free(const uint32_t, const unsigned);
+    unsigned char *ptr(const uint32_t ref, const unsigned len) const {
+        return pages[ref>>SLAB_INDEX_BITS]+
+            (ref&((1u<<SLAB_INDEX_BITS)-1))*sizes[cls[len]];
+    }
+    bool holds(const uint32_t ref, const unsigned len) const { // a valid ref
+        return len<=MAX_VAL_LEN &&
+            ref>>SLAB_INDEX_BITS<__atomic_load_n(&npages, __ATOMIC_ACQUIRE) &&
+            ((ref&((1u<<SLAB_INDEX_BITS)-1))+1)*sizes[cls[len]]<=
+                1u<<SLAB_PAGE_BITS;
+    }
+    unsigned chunk_size(const unsigned len) const {
+        return sizes[cls[len]];
+    }
+    size_t memory() const; // bytes of pages mapped
+    size_t chunk_bytes() const; // bytes of chunks handed out
+};
+
+#endif // __SLAB_H
+
+// end of slab.h
@@ -0,0 +1,152 @@
+// sessiond - SSL session cache daemon, file snapshot.cpp
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+#include "snapshot.h"
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SNAPSHOT_BUFFER (1<<20) // stdio buffer of the file being written
+
+SNAPSHOT::SNAPSHOT(const char *p) : f(NULL), map(NULL), size(0), pos(0),
+        count(0), left(0) {
+    path=strdup(p);
+    tmp=(char *)malloc(strlen(p)+5);
+    strcpy(tmp, p);
+    strcat(tmp, ".tmp");
+}
+
+SNAPSHOT::~SNAPSHOT() {
+    if(f) { // not committed
+        fclose(f);
+        unlink(tmp);
+    }
+    if(map)
+        munmap(map, size);
+    free(path);
+    free(tmp);
+}
+
+// start writing a new snapshot
+bool SNAPSHOT::create() {
+    f=fopen(tmp, "wb");
+    if(!f)
+        return false;
+    setvbuf(f, NULL, _IOFBF, SNAPSHOT_BUFFER);
+    count=0;
+    SNAPSHOT_HEADER h; // rewritten with the count by commit()
+    memset(&h, 0, sizeof h);
+    return fwrite(&h, sizeof h, 1, f)==1;
+}
+
+bool SNAPSHOT::add(const unsigned char *k, const unsigned char *v,
+        const unsigned len, const time_t t) {
+    unsigned char r[SNAPSHOT_RECORD_LEN];
+    const int64_t t64=t;
+    const uint16_t len16=len;
+    memcpy(r, &t64, 8);
+    memcpy(r+8, &len16, 2);
+    memcpy(r+10, k, KEY_LEN);
+    ++count;
+    return fwrite(r, sizeof r, 1, f)==1 && (!len || fwrite(v, len, 1, f)==1);
+}
+
+// complete the snapshot and replace the previous one with it
+bool SNAPSHOT::commit() {
+    SNAPSHOT_HEADER h;
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, SNAPSHOT_MAGIC, sizeof h.magic);
+    h.version=SNAPSHOT_VERSION;
+    h.key_len=KEY_LEN;
+    h.count=count;
+    bool ok=!fseek(f, 0, SEEK_SET) && fwrite(&h, sizeof h, 1, f)==1 &&
+        !fflush(f) && !fsync(fileno(f));
+    if(fclose(f))
+        ok=false;
+    f=NULL;
+    if(!ok || rename(tmp, path)) {
+        const int e=errno;
+        unlink(tmp);
+        errno=e;
+        return false;
+    }
+    return true;
+}
+
+// map a snapshot for reading, errno is ENOENT if there is none
+// and EINVAL if it was written by an incompatible version
+bool SNAPSHOT::open() {
+    const int fd=::open(path, O_RDONLY);
+    if(fd==-1)
+        return false;
+    struct stat st;
+    if(fstat(fd, &st)) {
+        close(fd);
+        return false;
+    }
+    size=st.st_size;
+    if(size<sizeof(SNAPSHOT_HEADER)) {
+        close(fd);
+        errno=EINVAL;
+        return false;
+    }
+    void *p=mmap(NULL, size, PROT_READ, MAP_PRIVATE|MAP_POPULATE, fd, 0);
+    close(fd);
+    if(p==MAP_FAILED)
+        return false;
+    map=(unsigned char *)p;
+    madvise(map, size, MADV_SEQUENTIAL);
+    SNAPSHOT_HEADER h;
+    memcpy(&h, map, sizeof h);
+    if(memcmp(h.magic, SNAPSHOT_MAGIC, sizeof h.magic) ||
+            h.version!=SNAPSHOT_VERSION || h.key_len!=KEY_LEN) {
+        errno=EINVAL;
+        return false;
+    }
+    count=left=h.count;
+    pos=sizeof h;
+    return true;
+}
+
+// the next session of the snapshot, false at its end or if it is truncated
+bool SNAPSHOT::next(const unsigned char *&k, const unsigned char *&v,
+        unsigned &len, time_t &t) {
+    if(!left || pos+SNAPSHOT_RECORD_LEN>size)
+        return false;
+    int64_t t64;
+    uint16_t len16;
+    memcpy(&t64, map+pos, 8);
+    memcpy(&len16, map+pos+8, 2);
+    if(len16>MAX_VAL_LEN || pos+SNAPSHOT_RECORD_LEN+len16>size)
+        return false;
+    k=map+pos+10;
+    v=map+pos+SNAPSHOT_RECORD_LEN;
+    len=len16;
+    t=t64;
+    pos+=SNAPSHOT_RECORD_LEN+len16;
+    --left;
+    return true;
+}
+
+// end of snapshot.cpp
@@ -0,0 +1,71 @@
+// sessiond - SSL session cache daemon, file snapshot.h
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+#include <stdio.h>
+#include <time.h>
+#include <stdint.h>
+#include "protocol.h" // KEY_LEN
+
+#define SNAPSHOT_MAGIC "sessiond"
+#define SNAPSHOT_VERSION 1
+
+// file header, followed by count records of the form
+// int64 expiry time, uint16 value length, key, value;
+// all the numbers are in host byte order and nothing is padded
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t key_len; // KEY_LEN
+    uint64_t count;
+} SNAPSHOT_HEADER;
+
+#define SNAPSHOT_RECORD_LEN (8+2+KEY_LEN) // without the value
+
+// SNAPSHOT class - the session cache saved across restarts
+//
+// A snapshot is written to a temporary file, which replaces the previous
+// one only once it is complete.  It is read back through a memory mapping.
+class SNAPSHOT {
+    char *path, *tmp;
+    FILE *f; // being written
+    unsigned char *map; // being read
+    size_t size, pos;
+    uint64_t count, left;
+public:
+    SNAPSHOT(const char *);
+    ~SNAPSHOT();
+    bool create();
+    bool add(const unsigned char *, const unsigned char *, const unsigned,
+        const time_t);
+    bool commit();
+    bool open();
+    uint64_t sessions() const { // in the snapshot being read
+        return count;
+    }
+    bool next(const unsigned char *&, const unsigned char *&, unsigned &,
+        time_t &);
+};
+
+#endif // __SNAPSHOT_H
+
+// end of snapshot.h
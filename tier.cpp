@@ -0,0 +1,370 @@
+// sessiond - SSL session cache daemon, file tier.cpp
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+#include "tier.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <algorithm>
+
+// splitmix64, mixing the key words into the salt
+static inline uint64_t mix(uint64_t z) {
+    z=(z^(z>>30))*0xbf58476d1ce4e5b9ULL;
+    z=(z^(z>>27))*0x94d049bb133111ebULL;
+    return z^(z>>31);
+}
+
+// bytes a record takes with a value of len bytes
+static inline size_t record_size(const unsigned len) {
+    return (sizeof(TIER_RECORD)+len+7)&~(size_t)7;
+}
+
+TIER::TIER() : fd(-1), base(NULL), active(TIER_NONE), compacting(TIER_NONE),
+        cursor(0), checked(0), salt(0), live(0), demotions(0), promotions(0),
+        drops(0), filtered(0) {
+}
+
+TIER::~TIER() {
+    if(base)
+        munmap(base, segments.size()*TIER_SEGMENT);
+    if(fd!=-1)
+        close(fd);
+    for(size_t s=0; s<segments.size(); ++s)
+        delete[] segments[s].bloom;
+}
+
+uint64_t TIER::hash(const unsigned char *k) const {
+    uint64_t h=salt;
+    for(unsigned i=0; i<KEY_LEN; i+=8) {
+        uint64_t w;
+        memcpy(&w, k+i, 8);
+        h=mix(h^w);
+    }
+    return h;
+}
+
+// create the file at path, split into as many segments as fit into
+// bytes, and unlink it at once: the sessions in it are as secret as
+// the ones in memory, and nothing is left behind when sessiond exits
+bool TIER::create(const char *path, const size_t bytes) {
+    size_t n=bytes/TIER_SEGMENT;
+    if(n<TIER_MIN_SEGMENTS)
+        n=TIER_MIN_SEGMENTS;
+    fd=open(path, O_RDWR|O_CREAT|O_EXCL, 0600);
+    if(fd==-1)
+        return false;
+    unlink(path);
+    void *p=MAP_FAILED;
+    if(!ftruncate(fd, n*TIER_SEGMENT)) // sparse, blocks are allocated by advance()
+        p=mmap(NULL, n*TIER_SEGMENT, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if(p==MAP_FAILED) {
+        const int error=errno;
+        close(fd);
+        fd=-1;
+        errno=error;
+        return false;
+    }
+    base=(unsigned char *)p;
+    madvise(base, n*TIER_SEGMENT, MADV_RANDOM); // a lookup reads a page or two
+    segments.resize(n);
+    for(size_t s=0; s<n; ++s) {
+        TIER_SEGMENT_INFO &g=segments[s];
+        g.bloom=new uint64_t[TIER_BLOCKS*8];
+        memset(g.bloom, 0, TIER_BLOCKS*8*sizeof(uint64_t));
+        g.used=g.count=g.live=0;
+        g.expiry=0;
+        spare.push_back(n-1-s); // segment 0 is taken first
+    }
+    const int r=open("/dev/urandom", O_RDONLY);
+    if(r==-1 || read(r, &salt, sizeof salt)!=sizeof salt)
+        salt=mix((uint64_t)time(NULL)^(uint64_t)getpid()<<32);
+    if(r!=-1)
+        close(r);
+    return true;
+}
+
+// may key hash h have been appended to segment s; a block of the Bloom
+// filter is a cache line, so that a test costs a single miss
+bool TIER::filter(const unsigned s, const uint64_t h) const {
+    const uint64_t *b=segments[s].bloom+((h>>32)*TIER_BLOCKS>>32)*8;
+    uint64_t bits=mix(h);
+    for(unsigned i=0; i<TIER_PROBES; ++i, bits>>=9)
+        if(!(b[(bits&511)>>6]>>(bits&63)&1))
+            return false;
+    return true;
+}
+
+// the newest live record of key k in segment s, NULL if there is none;
+// the slots of a key are taken in the order its records were appended,
+// but a newer one may be further along the probe sequence
+TIER_RECORD *TIER::probe(const unsigned s, const unsigned char *k,
+        const uint64_t h, const time_t now) const {
+    const uint64_t *ix=index(s);
+    const uint32_t tag=(uint32_t)(h>>32);
+    TIER_RECORD *newest=NULL;
+    for(size_t i=h&(TIER_SLOTS-1); ix[i]; i=(i+1)&(TIER_SLOTS-1))
+        if((uint32_t)(ix[i]>>32)==tag) {
+            TIER_RECORD *r=record(s, ((ix[i]&0xffffffffu)-1)*8);
+            if(r->expiry>=now && !memcmp(r->key, k, KEY_LEN) &&
+                    (!newest || r>newest))
+                newest=r;
+        }
+    return newest;
+}
+
+// copy the newest live record of key k into v, or with remove, remove
+// every live record of it instead; false if there was none
+bool TIER::search(const unsigned char *k, unsigned char *v, unsigned &len,
+        time_t &t, const time_t now, const bool remove) {
+    if(!base)
+        return false;
+    const uint64_t h=hash(k);
+    bool found=false;
+    for(size_t i=0; i<=sealed.size(); ++i) { // the newest segment first
+        const unsigned s=i ? sealed[sealed.size()-i] : active;
+        if(s==TIER_NONE)
+            continue;
+        if(!filter(s, h)) {
+            ++filtered;
+            continue;
+        }
+        if(!remove) {
+            const TIER_RECORD *r=probe(s, k, h, now);
+            if(r) {
+                len=r->len;
+                t=r->expiry;
+                memcpy(v, r+1, len);
+                return true;
+            }
+            continue;
+        }
+        for(TIER_RECORD *r; (r=probe(s, k, h, now)); kill(s, r))
+            found=true;
+    }
+    return found;
+}
+
+void TIER::kill(const unsigned s, TIER_RECORD *r) {
+    r->expiry=0;
+    --segments[s].live;
+    --live;
+}
+
+// append a session to the active segment, starting another once it is full
+bool TIER::append(const unsigned char *k, const unsigned char *v,
+        const unsigned len, const time_t t) {
+    const size_t size=record_size(len);
+    if((active==TIER_NONE || segments[active].used+size>TIER_DATA ||
+            segments[active].count==TIER_RECORDS) && !advance())
+        return false;
+    TIER_SEGMENT_INFO &g=segments[active];
+    TIER_RECORD *r=record(active, g.used);
+    r->expiry=t;
+    r->len=len;
+    memset(r->unused, 0, sizeof r->unused);
+    memcpy(r->key, k, KEY_LEN);
+    if(len)
+        memcpy(r+1, v, len);
+    const uint64_t h=hash(k);
+    uint64_t *ix=index(active);
+    size_t i=h&(TIER_SLOTS-1);
+    while(ix[i]) // at most half of the slots are taken
+        i=(i+1)&(TIER_SLOTS-1);
+    ix[i]=(h&0xffffffff00000000ULL)|(g.used/8+1);
+    uint64_t *b=g.bloom+((h>>32)*TIER_BLOCKS>>32)*8;
+    uint64_t bits=mix(h);
+    for(unsigned p=0; p<TIER_PROBES; ++p, bits>>=9)
+        b[(bits&511)>>6]|=1ULL<<(bits&63);
+    g.used+=size;
+    ++g.count;
+    ++g.live;
+    ++live;
+    if(t>g.expiry)
+        g.expiry=t;
+    return true;
+}
+
+// seal the active segment and take a spare one, dropping the oldest
+// segment if the compactor has not freed one in time
+bool TIER::advance() {
+    if(active!=TIER_NONE) {
+        sealed.push_back(active);
+        active=TIER_NONE;
+    }
+    if(spare.empty())
+        drop(sealed.front());
+    const unsigned s=spare.back();
+    // allocate its blocks now: a shared mapping could only report
+    // a full disk with SIGBUS
+    if(posix_fallocate(fd, (off_t)s*TIER_SEGMENT, TIER_SEGMENT))
+        return false;
+    spare.pop_back();
+    active=s;
+    return true;
+}
+
+// free a sealed segment and punch its blocks out of the file
+void TIER::release(const unsigned s) {
+    deque<unsigned>::iterator i=std::find(sealed.begin(), sealed.end(), s);
+    if(i!=sealed.end())
+        sealed.erase(i);
+    if(compacting==s)
+        compacting=TIER_NONE;
+    TIER_SEGMENT_INFO &g=segments[s];
+    live-=g.live;
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if(fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+            (off_t)s*TIER_SEGMENT, TIER_SEGMENT))
+#endif
+        memset(index(s), 0, TIER_SLOTS*sizeof(uint64_t));
+    memset(g.bloom, 0, TIER_BLOCKS*8*sizeof(uint64_t));
+    g.used=g.count=g.live=0;
+    g.expiry=0;
+    spare.push_back(s);
+}
+
+// free a segment with the sessions still live in it
+void TIER::drop(const unsigned s) {
+    drops+=segments[s].live;
+    release(s);
+}
+
+// demote a session expiring at t, evicted from memory
+void TIER::store(const unsigned char *k, const unsigned char *v,
+        const unsigned len, const time_t t, const time_t now) {
+    if(!base || t<now || len>MAX_VAL_LEN)
+        return;
+    if(append(k, v, len, t))
+        ++demotions;
+    else
+        ++drops;
+}
+
+bool TIER::find(const unsigned char *k, unsigned char *v, unsigned &len,
+        time_t &t, const time_t now) {
+    return search(k, v, len, t, now, false);
+}
+
+void TIER::erase(const unsigned char *k, const time_t now, const bool promoted) {
+    unsigned len;
+    time_t t;
+    if(search(k, NULL, len, t, now, true) && promoted)
+        ++promotions;
+}
+
+// free the segments expired once a second, and compact one while
+// a single spare segment is left
+void TIER::tick(const time_t now) {
+    if(!base)
+        return;
+    if(now!=checked) {
+        checked=now;
+        for(size_t i=0; i<sealed.size(); ) {
+            const TIER_SEGMENT_INFO &g=segments[sealed[i]];
+            if(g.expiry<now || !g.live)
+                release(sealed[i]); // out of sealed
+            else
+                ++i;
+        }
+    }
+    if(compacting==TIER_NONE) {
+        if(spare.size()>1)
+            return;
+        // the segment with the fewest records left, if it is worth moving
+        // them; otherwise the oldest is dropped once the spare is taken
+        unsigned best=TIER_NONE;
+        for(size_t i=0; i<sealed.size(); ++i)
+            if(best==TIER_NONE || segments[sealed[i]].live<segments[best].live)
+                best=sealed[i];
+        if(best==TIER_NONE || segments[best].live*4>segments[best].count*3)
+            return;
+        compacting=best;
+        cursor=0;
+    }
+    for(unsigned budget=TIER_BUDGET; budget && compacting!=TIER_NONE; --budget) {
+        const unsigned s=compacting;
+        if(cursor>=segments[s].used) {
+            release(s);
+            break;
+        }
+        TIER_RECORD *r=record(s, cursor);
+        cursor+=record_size(r->len);
+        if(r->expiry<now) // removed, moved or expired
+            continue;
+        TIER_RECORD h=*r;
+        unsigned char v[MAX_VAL_LEN];
+        memcpy(v, r+1, h.len);
+        kill(s, r); // first, appending may drop this segment
+        if(!append(h.key, v, h.len, h.expiry))
+            ++drops;
+    }
+}
+
+bool TIER::next(size_t &pos, const unsigned char *&k, const unsigned char *&v,
+        unsigned &len, time_t &t, const time_t now) const {
+    if(!base)
+        return false;
+    for(;;) {
+        const size_t s=pos/TIER_DATA, offset=pos%TIER_DATA;
+        if(s>=segments.size())
+            return false;
+        if(offset>=segments[s].used) {
+            pos=(s+1)*TIER_DATA;
+            continue;
+        }
+        const TIER_RECORD *r=record(s, offset);
+        pos+=record_size(r->len);
+        if(r->expiry>=now) {
+            k=r->key;
+            v=(const unsigned char *)(r+1);
+            len=r->len;
+            t=r->expiry;
+            return true;
+        }
+    }
+}
+
+const size_t TIER::sessions() const {
+    return live;
+}
+
+const size_t TIER::bytes() const {
+    return (sealed.size()+(active!=TIER_NONE))*TIER_SEGMENT;
+}
+
+const unsigned long long TIER::demoted() const {
+    return demotions;
+}
+
+const unsigned long long TIER::promoted() const {
+    return promotions;
+}
+
+const unsigned long long TIER::dropped() const {
+    return drops;
+}
+
+const unsigned long long TIER::skipped() const {
+    return filtered;
+}
+
+// end of tier.cpp
@@ -0,0 +1,138 @@
+// sessiond - SSL session cache daemon, file tier.h
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+#ifndef __TIER_H
+#define __TIER_H
+
+#include <time.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "protocol.h" // KEY_LEN, MAX_VAL_LEN
+
+// STL headers
+#include <vector>
+#include <deque>
+using namespace std;
+
+#define TIER_SLOTS (1u<<18) // index slots of a segment, a power of 2
+#define TIER_RECORDS (TIER_SLOTS/2) // sessions appended to a segment at most
+#define TIER_DATA (32u<<20) // bytes of sessions appended to a segment at most
+#define TIER_SEGMENT ((size_t)TIER_SLOTS*sizeof(uint64_t)+TIER_DATA) // in the file
+#define TIER_BLOCKS (TIER_RECORDS*10/512) // 512-bit Bloom filter blocks, 10 bits a session
+#define TIER_PROBES 6 // bits set in its block for each session
+#define TIER_MIN_SEGMENTS 3 // the one appended to, a spare and one to compact
+#define TIER_BUDGET 64 // sessions moved by the compactor per tick
+#define TIER_DEFAULT_GB 8
+#define TIER_NONE (~0u)
+
+// a session as appended to a segment, followed by its value and padded
+// to 8 bytes; numbers are in host byte order, the file is never reused
+typedef struct {
+    int64_t expiry; // time of day, 0 once removed or moved elsewhere
+    uint16_t len;
+    uint16_t unused[3];
+    unsigned char key[KEY_LEN];
+} TIER_RECORD;
+
+// a segment of the file, kept in memory: a Bloom filter of the keys
+// appended to it, so that most lookups never touch the disk
+typedef struct {
+    uint64_t *bloom; // TIER_BLOCKS blocks of 8 words
+    size_t used; // bytes of records
+    unsigned count; // records appended
+    unsigned live; // records not removed or moved, some may have expired
+    time_t expiry; // the latest of its records
+} TIER_SEGMENT_INFO;
+
+// TIER class - sessions evicted from memory, demoted to a file on disk
+//
+// The file is split into segments, each an index of TIER_SLOTS slots
+// (a 32-bit hint of the key hash and the offset of its record, linear
+// probing) followed by an append-only log of records, and is accessed
+// through a shared mapping, leaving the writing to the kernel.  Sessions
+// are appended to one segment at a time; once it is full it is sealed.
+// A session found is taken back into memory, and its records removed.
+// Segments whose sessions have all expired or been removed are freed
+// (their blocks punched out of the file).  Once a single spare segment
+// is left, the live records of the one with the fewest, if at least
+// a quarter are gone, are moved to the one being appended to, TIER_BUDGET
+// at a time; if no segment is freed in time, the oldest is dropped.
+// Like DATA, a tier has a single writer, the worker owning the shard.
+class TIER {
+    int fd;
+    unsigned char *base; // the whole file mapped
+    vector<TIER_SEGMENT_INFO> segments;
+    vector<unsigned> spare; // free segments
+    deque<unsigned> sealed; // full segments, oldest first
+    unsigned active; // the segment appended to, TIER_NONE for none yet
+    unsigned compacting; // the segment whose records are moved
+    size_t cursor; // to its next record
+    time_t checked; // when the segments were last checked for expiry
+    uint64_t salt; // of the key hash
+    size_t live; // records not removed or moved, in all the segments
+    unsigned long long demotions, promotions, drops, filtered;
+
+    uint64_t hash(const unsigned char *) const;
+    uint64_t *index(const unsigned s) const {
+        return (uint64_t *)(base+s*TIER_SEGMENT);
+    }
+    TIER_RECORD *record(const unsigned s, const size_t offset) const {
+        return (TIER_RECORD *)(base+s*TIER_SEGMENT+
+            TIER_SLOTS*sizeof(uint64_t)+offset);
+    }
+    bool filter(const unsigned, const uint64_t) const;
+    TIER_RECORD *probe(const unsigned, const unsigned char *, const uint64_t,
+        const time_t) const;
+    bool search(const unsigned char *, unsigned char *, unsigned &, time_t &,
+        const time_t, const bool);
+    void kill(const unsigned, TIER_RECORD *);
+    bool append(const unsigned char *, const unsigned char *, const unsigned,
+        const time_t);
+    bool advance();
+    void release(const unsigned);
+    void drop(const unsigned);
+public:
+    TIER();
+    ~TIER();
+    // a file of about bytes, removed as soon as it is created
+    bool create(const char *, const size_t);
+    void store(const unsigned char *, const unsigned char *, const unsigned,
+        const time_t, const time_t);
+    // copy the session of a key into a buffer of MAX_VAL_LEN bytes, with
+    // its expiry time, false if there is none; it is left on the tier
+    bool find(const unsigned char *, unsigned char *, unsigned &, time_t &,
+        const time_t);
+    // remove the session of a key, counted as promoted if so
+    void erase(const unsigned char *, const time_t, const bool=false);
+    void tick(const time_t);
+    // the live sessions one by one, from a cursor of 0 on
+    bool next(size_t &, const unsigned char *&, const unsigned char *&,
+        unsigned &, time_t &, const time_t) const;
+    const size_t sessions() const; // live records, some may have expired
+    const size_t bytes() const; // of the file in use
+    const unsigned long long demoted() const; // sessions stored
+    const unsigned long long promoted() const; // sessions taken
+    const unsigned long long dropped() const; // sessions lost for space
+    const unsigned long long skipped() const; // segments a lookup did not read
+};
+
+#endif // __TIER_H
+
+// end of tier.h
@@ -0,0 +1,223 @@
+// sessiond - SSL session cache daemon, file trace.cpp
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+#include "trace.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+
+// splitmix64, mixing the key words into the salt
+static inline uint64_t mix(uint64_t z) {
+    z=(z^(z>>30))*0xbf58476d1ce4e5b9ULL;
+    z=(z^(z>>27))*0x94d049bb133111ebULL;
+    return z^(z>>31);
+}
+
+TRACE::TRACE() : fd(-1), f(NULL), salt(0), start(0), ring(NULL), head(0),
+        tail(0), unwritten(0), error(0), running(false), stopping(false) {
+}
+
+TRACE::~TRACE() {
+    stop();
+    if(fd!=-1)
+        close(fd);
+    if(f)
+        fclose(f);
+    delete[] ring;
+}
+
+// start a trace at the monotonic time now (in nanoseconds)
+bool TRACE::create(const char *path, const uint64_t now) {
+    fd=::open(path, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND, 0600);
+    if(fd==-1)
+        return false;
+    const int r=::open("/dev/urandom", O_RDONLY);
+    if(r==-1 || read(r, &salt, sizeof salt)!=sizeof salt)
+        salt=mix(now^(uint64_t)getpid()<<32);
+    if(r!=-1)
+        close(r);
+    start=now;
+    ring=new TRACE_CHUNK[TRACE_CHUNKS];
+    for(unsigned i=0; i<TRACE_CHUNKS; ++i)
+        ring[i].seq=i;
+    TRACE_HEADER h;
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, TRACE_MAGIC, sizeof h.magic);
+    h.version=TRACE_VERSION;
+    h.record_len=TRACE_RECORD_LEN;
+    h.start=time(NULL);
+    return put((const unsigned char *)&h, sizeof h);
+}
+
+// start the writer thread, after daemon() as it does not survive fork();
+// until then, and if it cannot be started, the buffers are written at once
+void TRACE::launch() {
+    // signals are left to the main thread
+    sigset_t set, old;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+    running=!pthread_create(&thread, NULL, run, this);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+// once the workers have stopped
+void TRACE::stop() {
+    if(!running)
+        return;
+    __atomic_store_n(&stopping, true, __ATOMIC_RELAXED);
+    pthread_join(thread, NULL);
+    running=false;
+    drain(); // whatever was queued since
+}
+
+void *TRACE::run(void *arg) {
+    TRACE &trace=*(TRACE *)arg;
+    while(!__atomic_load_n(&trace.stopping, __ATOMIC_RELAXED))
+        if(!trace.drain())
+            usleep(1000); // a worker fills a buffer in a few milliseconds
+    return NULL;
+}
+
+// encode a request received at the monotonic time now into r,
+// TRACE_RECORD_LEN bytes
+void TRACE::encode(unsigned char *r, const unsigned type, const unsigned char *k,
+        const unsigned len, const unsigned timeout, const uint64_t now,
+        const unsigned worker) const {
+    uint64_t h=salt;
+    for(unsigned i=0; i<KEY_LEN; i+=8) {
+        uint64_t w;
+        memcpy(&w, k+i, 8);
+        h=mix(h^w);
+    }
+    const uint32_t ms=now>start ? (now-start)/1000000 : 0;
+    const uint16_t len16=len, timeout16=timeout;
+    memcpy(r, &h, 8);
+    memcpy(r+8, &ms, 4);
+    memcpy(r+12, &len16, 2);
+    memcpy(r+14, &timeout16, 2);
+    r[16]=type;
+    r[17]=worker;
+}
+
+// queue whole records for the writer thread, or write them at once while
+// it is not running; false if they are dropped
+bool TRACE::write(const unsigned char *d, const size_t len) {
+    if(__atomic_load_n(&error, __ATOMIC_RELAXED) ||
+            len>sizeof ring[0].data)
+        return false;
+    if(!running)
+        return put(d, len);
+    unsigned pos=__atomic_load_n(&head, __ATOMIC_RELAXED);
+    TRACE_CHUNK *c;
+    for(;;) {
+        c=&ring[pos%TRACE_CHUNKS];
+        const int diff=(int)(__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE)-pos);
+        if(!diff) {
+            if(__atomic_compare_exchange_n(&head, &pos, pos+1, true,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if(diff<0) { // not yet written out by the writer thread
+            return false;
+        } else {
+            pos=__atomic_load_n(&head, __ATOMIC_RELAXED);
+        }
+    }
+    memcpy(c->data, d, len);
+    c->len=len;
+    __atomic_store_n(&c->seq, pos+1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// write len bytes out, resuming a short write; a failed one stops the
+// trace, as the records written after it would no longer be aligned
+bool TRACE::put(const unsigned char *d, size_t len) {
+    if(__atomic_load_n(&error, __ATOMIC_RELAXED))
+        return false;
+    while(len) {
+        const ssize_t r=::write(fd, d, len);
+        if(r==-1 && errno==EINTR)
+            continue;
+        if(r<=0) {
+            __atomic_store_n(&error, r ? errno : ENOSPC, __ATOMIC_RELAXED);
+            return false;
+        }
+        d+=r;
+        len-=r;
+    }
+    return true;
+}
+
+// write out the buffers queued, false if there were none
+bool TRACE::drain() {
+    bool any=false;
+    for(;;) {
+        TRACE_CHUNK &c=ring[tail%TRACE_CHUNKS];
+        if(__atomic_load_n(&c.seq, __ATOMIC_ACQUIRE)!=tail+1)
+            break;
+        any=true;
+        if(!put(c.data, c.len))
+            __atomic_add_fetch(&unwritten, c.len/TRACE_RECORD_LEN,
+                __ATOMIC_RELAXED);
+        __atomic_store_n(&c.seq, tail+TRACE_CHUNKS, __ATOMIC_RELEASE);
+        ++tail;
+    }
+    return any;
+}
+
+const unsigned long long TRACE::lost() const {
+    return __atomic_load_n(&unwritten, __ATOMIC_RELAXED);
+}
+
+const int TRACE::failed() const {
+    return __atomic_load_n(&error, __ATOMIC_RELAXED);
+}
+
+// start reading a trace, started at time of day t
+bool TRACE::open(const char *path, time_t &t) {
+    f=fopen(path, "rb");
+    if(!f)
+        return false;
+    TRACE_HEADER h;
+    if(fread(&h, sizeof h, 1, f)!=1 ||
+            memcmp(h.magic, TRACE_MAGIC, sizeof h.magic) ||
+            h.version!=TRACE_VERSION || h.record_len!=TRACE_RECORD_LEN) {
+        errno=EINVAL;
+        return false;
+    }
+    t=h.start;
+    return true;
+}
+
+bool TRACE::next(TRACE_RECORD &rec) {
+    unsigned char r[TRACE_RECORD_LEN];
+    if(fread(r, sizeof r, 1, f)!=1)
+        return false;
+    memcpy(&rec.key, r, 8);
+    memcpy(&rec.ms, r+8, 4);
+    memcpy(&rec.len, r+12, 2);
+    memcpy(&rec.timeout, r+14, 2);
+    rec.type=r[16];
+    rec.worker=r[17];
+    return true;
+}
+
+// end of trace.cpp
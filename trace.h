@@ -0,0 +1,109 @@
+// sessiond - SSL session cache daemon, file trace.h
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdio.h>
+#include <time.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "protocol.h" // KEY_LEN
+
+#define TRACE_MAGIC "sdtrace1"
+#define TRACE_VERSION 1
+
+// file header, followed by records of the form uint64 key hash,
+// uint32 milliseconds since the start, uint16 value length, uint16
+// timeout, uint8 type, uint8 worker; all the numbers are in host byte
+// order and nothing is padded; records of different workers are written
+// in chunks, so they are only ordered by time within a worker
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_len; // TRACE_RECORD_LEN
+    int64_t start; // time of day at the start of the trace
+} TRACE_HEADER;
+
+#define TRACE_RECORD_LEN (8+4+2+2+1+1)
+#define TRACE_BUFFER 4096 // records buffered by each worker
+#define TRACE_CHUNKS 16 // buffers queued for the writer thread
+
+// a request as captured, without any session material: the key is
+// replaced by a hash salted with a random number that is not saved
+typedef struct {
+    uint64_t key;
+    uint32_t ms;
+    uint16_t len; // of the value
+    uint16_t timeout;
+    uint8_t type; // CACHE_CMD_*
+    uint8_t worker;
+} TRACE_RECORD;
+
+// a buffer of records queued for the writer thread
+typedef struct {
+    unsigned seq; // the ticket of its producer or consumer
+    size_t len;
+    unsigned char data[TRACE_BUFFER*TRACE_RECORD_LEN];
+} TRACE_CHUNK;
+
+// TRACE class - a capture of the requests served
+//
+// The workers hand their full buffers over to a writer thread through
+// a lock-free ring, as LOG does its messages, so that they never wait for
+// the disk; a full ring drops the buffer.  A short write is resumed, and
+// a failed one stops the trace, which is only ever made of whole records.
+class TRACE {
+    int fd; // being written
+    FILE *f; // being read
+    uint64_t salt;
+    uint64_t start; // monotonic nanoseconds of ms 0
+    TRACE_CHUNK *ring;
+    unsigned head; // taken by the workers
+    char pad[64-sizeof(unsigned)]; // keep head and tail in separate lines
+    unsigned tail; // advanced by the writer thread
+    unsigned long long unwritten; // records queued but not written
+    int error; // errno of the write that failed, 0 for none
+    pthread_t thread;
+    bool running;
+    volatile bool stopping;
+
+    bool put(const unsigned char *, size_t);
+    bool drain();
+    static void *run(void *);
+public:
+    TRACE();
+    ~TRACE();
+    bool create(const char *, const uint64_t);
+    void launch(); // the writer thread, after daemon()
+    void stop(); // it, writing out what is queued
+    void encode(unsigned char *, const unsigned, const unsigned char *,
+        const unsigned, const unsigned, const uint64_t, const unsigned) const;
+    bool write(const unsigned char *, const size_t);
+    const unsigned long long lost() const; // records queued, not written
+    const int failed() const; // errno of the write that stopped the trace
+    bool open(const char *, time_t &);
+    bool next(TRACE_RECORD &);
+};
+
+#endif // __TRACE_H
+
+// end of trace.h
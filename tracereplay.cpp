@@ -0,0 +1,287 @@
+// sessiond - SSL session cache daemon, file tracereplay.cpp
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+// Replay of a trace captured with sessiond -t: either straight into a
+// DATA instance, with the clock simulated from the trace, to compare
+// capacities, memory limits and eviction policies, or against a running
+// sessiond, at the original timing (sped up with -x) or as fast as the
+// socket allows (-a).  The keys are rebuilt from their hashes and the
+// values are zeros of the lengths captured.
+
+#include "data.h"
+#include "trace.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <algorithm>
+
+#define DRAIN 1000 // milliseconds to wait for the last replies
+#define RCVBUF (8<<20)
+
+static vector<TRACE_RECORD> records;
+
+static bool by_time(const TRACE_RECORD &a, const TRACE_RECORD &b) {
+    return a.ms<b.ms;
+}
+
+static int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+
+// the same hash always gets the same key
+static void make_key(unsigned char *k, const uint64_t hash) {
+    uint64_t x=hash;
+    for(unsigned i=0; i<KEY_LEN/8; ++i) { // splitmix64
+        uint64_t z=(x+=0x9e3779b97f4a7c15ULL);
+        z=(z^(z>>30))*0xbf58476d1ce4e5b9ULL;
+        z=(z^(z>>27))*0x94d049bb133111ebULL;
+        z^=z>>31;
+        memcpy(k+8*i, &z, 8);
+    }
+}
+
+static bool load(const char *name) {
+    TRACE trace;
+    time_t start;
+    if(!trace.open(name, start)) {
+        perror(name);
+        return false;
+    }
+    TRACE_RECORD r;
+    while(trace.next(r))
+        if(r.type<=CACHE_CMD_REMOVE && r.len<=MAX_VAL_LEN)
+            records.push_back(r);
+    // workers write their records in chunks
+    stable_sort(records.begin(), records.end(), by_time);
+    char date[64];
+    strftime(date, sizeof date, "%Y-%m-%d %H:%M:%S", localtime(&start));
+    printf("%lu requests over %.1f seconds, captured %s\n",
+        (unsigned long)records.size(),
+        records.empty() ? 0.0 : records.back().ms/1000.0, date);
+    return true;
+}
+
+static void replay_data(const size_t capacity, const size_t budget,
+        const int policy) {
+    DATA data(capacity, budget, policy);
+    static unsigned char val[MAX_VAL_LEN];
+    const time_t start=time(NULL);
+    unsigned long long hits=0, gets=0;
+    unsigned long long missed[GHOST_REASONS]={0}, larger[GHOST_LARGER]={0};
+    size_t peak=0;
+    unsigned char key[KEY_LEN];
+    const int64_t t0=now_ns();
+    for(size_t i=0; i<records.size(); ++i) {
+        const TRACE_RECORD &r=records[i];
+        data.tick(start+r.ms/1000);
+        make_key(key, r.key);
+        if(r.type==CACHE_CMD_NEW) {
+            data.insert(key, val, r.len, r.timeout);
+            if(data.size()>peak)
+                peak=data.size();
+        } else if(r.type==CACHE_CMD_GET) {
+            const unsigned char *v;
+            unsigned l;
+            ++gets;
+            if(data.find(key, v, l)) {
+                ++hits;
+            } else {
+                uint64_t since=0;
+                const int reason=data.missed(key, since);
+                ++missed[reason];
+                for(unsigned j=0; reason==GHOST_EVICTED && j<GHOST_LARGER; ++j)
+                    if((since+1)*100<=data.size()*ghost_larger[j])
+                        ++larger[j];
+            }
+        } else {
+            data.erase(key);
+        }
+        data.reclaim();
+    }
+    const double elapsed=(now_ns()-t0)/1e9;
+    printf("hit ratio %.2f%% of %llu GETs, %llu evicted, %llu expired\n",
+        gets ? 100.0*hits/gets : 0.0, gets, data.evicted(), data.expired());
+    printf("misses: %llu expired, %llu evicted, %llu removed, %llu unknown\n",
+        missed[GHOST_EXPIRED], missed[GHOST_EVICTED], missed[GHOST_REMOVED],
+        missed[GHOST_UNKNOWN]);
+    printf("estimated hit ratio");
+    for(unsigned j=0; j<GHOST_LARGER; ++j)
+        printf("%s %u%% larger %.2f%%", j ? "," : "", ghost_larger[j],
+            gets ? 100.0*(hits+larger[j])/gets : 0.0);
+    printf("\n");
+    printf("peak %lu sessions, %lu left using %.1fMB, replayed in %.2fs\n",
+        (unsigned long)peak, (unsigned long)data.size(),
+        data.memory()/1048576.0, elapsed);
+}
+
+// count the replies received so far
+static void receive(const int sock, unsigned long long &hits,
+        unsigned long long &misses) {
+    unsigned char reply[CACHE_HDR_LEN+MAX_VAL_LEN];
+    ssize_t len;
+    while((len=recv(sock, reply, sizeof reply, MSG_DONTWAIT))>=(ssize_t)CACHE_HDR_LEN) {
+        if(reply[1]==CACHE_RESP_OK)
+            ++hits;
+        else if(reply[1]==CACHE_RESP_ERR)
+            ++misses;
+    }
+}
+
+static int replay_server(const struct sockaddr_in &server, const double speed,
+        const bool fast) {
+    const int sock=socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(sock==-1 || connect(sock, (const struct sockaddr *)&server, sizeof server)) {
+        perror("socket");
+        return 1;
+    }
+    int size=RCVBUF; // room for the replies to a burst
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof size);
+    unsigned long long hits=0, misses=0, gets=0;
+    CACHE_PACKET packet;
+    memset(&packet, 0, sizeof packet);
+    packet.version=1;
+    const int64_t t0=now_ns();
+    for(size_t i=0; i<records.size(); ++i) {
+        const TRACE_RECORD &r=records[i];
+        if(!fast) { // wait for the request to be due
+            const int64_t due=t0+(int64_t)(r.ms*1e6/speed);
+            for(int64_t now; (now=now_ns())<due; ) {
+                struct pollfd pfd={sock, POLLIN, 0};
+                poll(&pfd, 1, (due-now)/1000000);
+                receive(sock, hits, misses);
+            }
+        }
+        packet.type=r.type;
+        packet.timeout=htons(r.timeout);
+        make_key(packet.key, r.key);
+        while(send(sock, &packet, CACHE_HDR_LEN+r.len, MSG_DONTWAIT)==-1) {
+            if(errno!=EAGAIN && errno!=EWOULDBLOCK && errno!=ECONNREFUSED) {
+                perror("send");
+                return 1;
+            }
+            struct pollfd pfd={sock, POLLIN|POLLOUT, 0};
+            poll(&pfd, 1, 10);
+            receive(sock, hits, misses);
+        }
+        if(r.type==CACHE_CMD_GET)
+            ++gets;
+        receive(sock, hits, misses);
+    }
+    const double elapsed=(now_ns()-t0)/1e9;
+    for(int64_t end=now_ns()+DRAIN*1000000LL; hits+misses<gets && now_ns()<end; ) {
+        struct pollfd pfd={sock, POLLIN, 0};
+        poll(&pfd, 1, 10);
+        receive(sock, hits, misses);
+    }
+    close(sock);
+    printf("%.0f requests/s, hit ratio %.2f%% of %llu GETs, %llu lost\n",
+        elapsed>0 ? records.size()/elapsed : 0.0,
+        gets ? 100.0*hits/gets : 0.0, gets,
+        gets>hits+misses ? gets-hits-misses : 0);
+    return 0;
+}
+
+static void usage(const char *bin_path) {
+    fprintf(stderr, "Usage: %s [-n sessions] [-m mb] [-e] trace\n", bin_path);
+    fprintf(stderr, "       %s -s host:port [-x speed | -a] trace\n", bin_path);
+    fprintf(stderr, "  -n sessions  capacity of the cache (default %u)\n", (unsigned)MAX_CONCURRENT_SESSIONS);
+    fprintf(stderr, "  -m mb        memory limit of the cache (default none)\n");
+    fprintf(stderr, "  -e           evict the session expiring first rather than with CLOCK\n");
+    fprintf(stderr, "  -s host:port replay against a running sessiond instead\n");
+    fprintf(stderr, "  -x speed     times the original rate (default 1)\n");
+    fprintf(stderr, "  -a           as fast as possible\n");
+}
+
+int main(int argc, char *argv[]) {
+    size_t capacity=MAX_CONCURRENT_SESSIONS, budget=0;
+    int policy=EVICT_CLOCK;
+    const char *server=NULL;
+    double speed=1;
+    bool fast=false;
+    int opt;
+    while((opt=getopt(argc, argv, "n:m:es:x:a"))!=-1) {
+        switch(opt) {
+        case 'n':
+            capacity=atol(optarg);
+            break;
+        case 'm':
+            budget=(size_t)atol(optarg)<<20;
+            break;
+        case 'e':
+            policy=EVICT_EXPIRY;
+            break;
+        case 's':
+            server=optarg;
+            break;
+        case 'x':
+            speed=atof(optarg);
+            break;
+        case 'a':
+            fast=true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if(optind!=argc-1 || !capacity || speed<=0) {
+        usage(argv[0]);
+        return 1;
+    }
+    struct sockaddr_in addr;
+    if(server) {
+        char host[256];
+        const char *colon=strrchr(server, ':');
+        if(!colon || !atoi(colon+1)) {
+            fprintf(stderr, "illegal server %s.\n", server);
+            return 1;
+        }
+        snprintf(host, sizeof host, "%.*s", (int)(colon-server), server);
+        struct addrinfo hints, *result;
+        memset(&hints, 0, sizeof hints);
+        hints.ai_family=AF_INET;
+        hints.ai_socktype=SOCK_DGRAM;
+        const int error=getaddrinfo(host, NULL, &hints, &result);
+        if(error) {
+            fprintf(stderr, "error in getaddrinfo: %s\n", gai_strerror(error));
+            return 1;
+        }
+        addr=*(struct sockaddr_in *)result->ai_addr;
+        addr.sin_port=htons(atoi(colon+1));
+        freeaddrinfo(result);
+    }
+    if(!load(argv[optind]))
+        return 1;
+    if(server)
+        return replay_server(addr, speed, fast);
+    replay_data(capacity, budget, policy);
+    return 0;
+}
+
+// end of tracereplay.cpp
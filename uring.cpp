@@ -0,0 +1,158 @@
+// sessiond - SSL session cache daemon, file uring.cpp
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+#include "uring.h"
+
+#ifdef HAVE_URING
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+URING::URING() : fd(-1), sq_ptr(MAP_FAILED), cq_ptr(MAP_FAILED),
+        sqes((struct io_uring_sqe *)MAP_FAILED), queued(0),
+        br((struct io_uring_buf_ring *)MAP_FAILED), br_entries(0), br_tail(0) {
+}
+
+URING::~URING() {
+    if(br!=MAP_FAILED)
+        munmap(br, br_entries*sizeof(struct io_uring_buf));
+    if(sqes!=MAP_FAILED)
+        munmap(sqes, sqes_size);
+    if(cq_ptr!=MAP_FAILED && cq_ptr!=sq_ptr)
+        munmap(cq_ptr, cq_size);
+    if(sq_ptr!=MAP_FAILED)
+        munmap(sq_ptr, sq_size);
+    if(fd!=-1)
+        close(fd);
+}
+
+bool URING::init(const unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof p);
+    // completions are only posted when the serving thread enters the
+    // ring, so one wakeup drains every packet received since (Linux 6.1)
+    static const unsigned flags[]={
+        IORING_SETUP_SINGLE_ISSUER|IORING_SETUP_DEFER_TASKRUN,
+        IORING_SETUP_SINGLE_ISSUER|IORING_SETUP_COOP_TASKRUN, // Linux 6.0
+        0};
+    for(unsigned i=0; i<sizeof flags/sizeof *flags; ++i) {
+        memset(&p, 0, sizeof p);
+        p.flags=flags[i];
+        fd=syscall(__NR_io_uring_setup, entries, &p);
+        if(fd!=-1 || errno!=EINVAL) // EINVAL is an older kernel
+            break;
+    }
+    if(fd==-1)
+        return false;
+
+    sq_size=p.sq_off.array+p.sq_entries*sizeof(unsigned);
+    cq_size=p.cq_off.cqes+p.cq_entries*sizeof(struct io_uring_cqe);
+    if(p.features&IORING_FEAT_SINGLE_MMAP && cq_size>sq_size)
+        sq_size=cq_size;
+    sq_ptr=mmap(NULL, sq_size, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(sq_ptr==MAP_FAILED)
+        return false;
+    if(p.features&IORING_FEAT_SINGLE_MMAP) {
+        cq_ptr=sq_ptr;
+    } else {
+        cq_ptr=mmap(NULL, cq_size, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if(cq_ptr==MAP_FAILED)
+            return false;
+    }
+    sqes_size=p.sq_entries*sizeof(struct io_uring_sqe);
+    sqes=(struct io_uring_sqe *)mmap(NULL, sqes_size, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(sqes==MAP_FAILED)
+        return false;
+
+    unsigned char *sq=(unsigned char *)sq_ptr, *cq=(unsigned char *)cq_ptr;
+    sq_head=(unsigned *)(sq+p.sq_off.head);
+    sq_tail=(unsigned *)(sq+p.sq_off.tail);
+    sq_mask=(unsigned *)(sq+p.sq_off.ring_mask);
+    sq_array=(unsigned *)(sq+p.sq_off.array);
+    cq_head=(unsigned *)(cq+p.cq_off.head);
+    cq_tail=(unsigned *)(cq+p.cq_off.tail);
+    cq_mask=(unsigned *)(cq+p.cq_off.ring_mask);
+    cqes=(struct io_uring_cqe *)(cq+p.cq_off.cqes);
+    return true;
+}
+
+// make fd available as fixed file 0
+bool URING::register_file(const int f) {
+    return syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES, &f, 1)==0;
+}
+
+// create an empty provided buffer ring for the buffer group
+bool URING::register_buffers(const unsigned short group, const unsigned n) {
+    br_entries=n; // a power of 2
+    br=(struct io_uring_buf_ring *)mmap(NULL, n*sizeof(struct io_uring_buf),
+        PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(br==MAP_FAILED)
+        return false;
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof reg);
+    reg.ring_addr=(unsigned long)br;
+    reg.ring_entries=n;
+    reg.bgid=group;
+    return syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1)==0;
+}
+
+// a cleared submission queue entry, or NULL if the queue is full
+struct io_uring_sqe *URING::sqe() {
+    const unsigned tail=*sq_tail+queued;
+    if(tail-__atomic_load_n(sq_head, __ATOMIC_ACQUIRE)>*sq_mask)
+        return NULL;
+    const unsigned i=tail&*sq_mask;
+    sq_array[i]=i;
+    ++queued;
+    memset(&sqes[i], 0, sizeof sqes[i]);
+    return &sqes[i];
+}
+
+// submit the queued entries, post the pending completions
+// and wait until there are at least n of them
+int URING::enter(const unsigned n) {
+    const unsigned submit=queued;
+    __atomic_store_n(sq_tail, *sq_tail+queued, __ATOMIC_RELEASE);
+    queued=0;
+    const int r=syscall(__NR_io_uring_enter, fd, submit, n,
+        IORING_ENTER_GETEVENTS, NULL, 0);
+    return r==-1 && errno==EINTR ? 0 : r;
+}
+
+// hand a buffer (back) to the kernel, call provided() to publish it;
+// br->bufs is not used, as C++ gives the empty struct of its flexible
+// array declaration a size and so misplaces the array
+void URING::provide(void *addr, const unsigned len, const unsigned short bid) {
+    struct io_uring_buf &b=((struct io_uring_buf *)br)[br_tail&(br_entries-1)];
+    b.addr=(unsigned long)addr;
+    b.len=len;
+    b.bid=bid;
+    ++br_tail;
+}
+
+#endif // HAVE_URING
+
+// end of uring.cpp
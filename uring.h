@@ -0,0 +1,80 @@
+// sessiond - SSL session cache daemon, file uring.h
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+#ifndef __URING_H
+#define __URING_H
+
+#include <stddef.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+// multishot receive with provided buffer rings needs Linux 6.0 headers
+#ifdef IORING_RECV_MULTISHOT
+#define HAVE_URING
+#endif
+#endif
+
+#ifdef HAVE_URING
+
+// URING class - a minimal io_uring instance driven with raw system calls
+class URING {
+    int fd;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size;
+    // submission queue
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned queued; // prepared, but not yet submitted
+    // completion queue
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    // provided buffer ring
+    struct io_uring_buf_ring *br;
+    unsigned br_entries;
+    unsigned short br_tail;
+public:
+    URING();
+    ~URING();
+    bool init(const unsigned);
+    bool register_file(const int);
+    bool register_buffers(const unsigned short, const unsigned);
+    struct io_uring_sqe *sqe();
+    int enter(const unsigned);
+    struct io_uring_cqe *peek() {
+        const unsigned head=*cq_head;
+        if(head==__atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+            return NULL;
+        return &cqes[head&*cq_mask];
+    }
+    void seen() {
+        __atomic_store_n(cq_head, *cq_head+1, __ATOMIC_RELEASE);
+    }
+    void provide(void *, const unsigned, const unsigned short);
+    void provided() { // make the buffers given to provide() visible
+        __atomic_store_n(&br->tail, br_tail, __ATOMIC_RELEASE);
+    }
+};
+
+#endif // HAVE_URING
+
+#endif // __URING_H
+
+// end of uring.h
@@ -0,0 +1,89 @@
+// sessiond - SSL session cache daemon, file wheel.cpp
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+#include "wheel.h"
+
+WHEEL::WHEEL(ARENA &a, const time_t t) :
+        entries(a), cursor(t), draining(false), scan(ARENA_NONE) {
+    slots=new uint32_t[WHEEL_SIZE];
+    for(unsigned i=0; i<WHEEL_SIZE; ++i)
+        slots[i]=ARENA_NONE;
+}
+
+WHEEL::~WHEEL() {
+    delete[] slots;
+}
+
+void WHEEL::link(const uint32_t id) {
+    ENTRY &e=entries[id];
+    uint32_t &head=slots[e.t&(WHEEL_SIZE-1)];
+    e.prev=ARENA_NONE;
+    e.next=head;
+    if(head!=ARENA_NONE)
+        entries[head].prev=id;
+    head=id;
+}
+
+void WHEEL::unlink(const uint32_t id) {
+    ENTRY &e=entries[id];
+    if(id==scan) // keep the drain position valid
+        scan=e.next;
+    if(e.prev!=ARENA_NONE)
+        entries[e.prev].next=e.next;
+    else
+        slots[e.t&(WHEEL_SIZE-1)]=e.next;
+    if(e.next!=ARENA_NONE)
+        entries[e.next].prev=e.prev;
+}
+
+// return the next entry that expired before t, or ARENA_NONE when there
+// are none left or the budget (one unit per entry or slot) is exhausted;
+// the caller is expected to unlink the returned entry
+uint32_t WHEEL::expired(const time_t t, unsigned &budget) {
+    while(budget && cursor<t) {
+        --budget;
+        if(!draining) {
+            scan=slots[cursor&(WHEEL_SIZE-1)];
+            draining=true;
+        }
+        if(scan==ARENA_NONE) { // this second is done
+            draining=false;
+            ++cursor;
+            continue;
+        }
+        const uint32_t id=scan;
+        scan=entries[id].next;
+        if(entries[id].t<t) // otherwise due in a later revolution
+            return id;
+    }
+    return ARENA_NONE;
+}
+
+// the entry closest to expiry, or ARENA_NONE when the wheel is empty
+uint32_t WHEEL::earliest() {
+    for(unsigned i=0; i<WHEEL_SIZE; ++i) {
+        const uint32_t head=slots[(cursor+i)&(WHEEL_SIZE-1)];
+        if(head!=ARENA_NONE)
+            return head;
+    }
+    return ARENA_NONE;
+}
+
+// end of wheel.cpp
@@ -0,0 +1,55 @@
+// sessiond - SSL session cache daemon, file wheel.h
+// Copyright (C) 2009 Michal Trojnara <Michal.Trojnara@mirt.net>
+//
+// This program is free software; you can redistribute it and/or modify it
+// under the terms of the GNU General Public License as published by the
+// Free Software Foundation; either version 2 of the License, or (at your
+// option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, see <http://www.gnu.org/licenses>.
+//
+// Linking sessiond statically or dynamically with other modules is making
+// a combined work based on sessiond. Thus, the terms and conditions of
+// the GNU General Public License cover the whole combination.
+
+#ifndef __WHEEL_H
+#define __WHEEL_H
+
+#include <time.h>
+#include <stdint.h>
+#include "arena.h"
+
+// one slot per second: a 16-bit timeout always fits in a single revolution
+#define WHEEL_BITS 16
+#define WHEEL_SIZE (1u<<WHEEL_BITS)
+
+// WHEEL class - hashed timing wheel of session expiry times
+//
+// Entries are linked intrusively through their prev/next fields into the
+// slot of their expiry second, so linking and unlinking are O(1).
+// Expired entries are handed out one at a time against a work budget,
+// so that a popular second is drained over many calls instead of one.
+class WHEEL {
+    ARENA &entries;
+    uint32_t *slots; // list heads
+    time_t cursor; // all slots before this second have been drained
+    bool draining; // the cursor slot is being drained
+    uint32_t scan; // next entry of the cursor slot to examine
+public:
+    WHEEL(ARENA &, const time_t);
+    ~WHEEL();
+    void link(const uint32_t);
+    void unlink(const uint32_t);
+    uint32_t expired(const time_t, unsigned &);
+    uint32_t earliest();
+};
+
+#endif // __WHEEL_H
+
+// end of wheel.h